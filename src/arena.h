@@ -0,0 +1,52 @@
+#pragma once
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <sys/mman.h>
+
+namespace bns {
+
+/*
+ * One contiguous, 64-byte-aligned block for many sketches' payloads, released in a single call.
+ * With huge pages requested, explicit huge pages (MAP_HUGETLB) are tried first, then transparent huge pages via madvise;
+ * either way, the block is rounded up to a multiple of 2 MiB. Otherwise it is an ordinary aligned allocation.
+ */
+class Arena {
+    static constexpr size_t ALIGNMENT = 64, HUGE_PAGE_SIZE = size_t(1) << 21;
+    void *data_ = nullptr;
+    size_t bytes_ = 0;
+    bool mapped_ = false;
+public:
+    Arena(size_t bytes, bool huge_pages): bytes_(bytes) {
+        if(bytes == 0) return;
+        if(huge_pages) {
+            bytes_ = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+            data_ = ::mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if(data_ == MAP_FAILED)
+#endif
+            {
+                data_ = ::mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if(data_ == MAP_FAILED) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+                ::madvise(data_, bytes_, MADV_HUGEPAGE);
+#endif
+            }
+            mapped_ = true;
+        } else if(::posix_memalign(&data_, ALIGNMENT, bytes)) {
+            throw std::bad_alloc();
+        }
+    }
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+    ~Arena() {
+        if(mapped_) ::munmap(data_, bytes_);
+        else        std::free(data_);
+    }
+    uint8_t *data() {return static_cast<uint8_t *>(data_);}
+    const uint8_t *data() const {return static_cast<const uint8_t *>(data_);}
+    // Rounds a per-sketch payload size up so that every payload starts on a SIMD-aligned boundary.
+    static size_t stride(size_t payload) {return (payload + ALIGNMENT - 1) & ~(ALIGNMENT - 1);}
+};
+
+} // namespace bns
@@ -0,0 +1,236 @@
+#pragma once
+#include "dashing.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <mutex>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace bns {
+
+/*
+ * A directory of sketches (--cache-dir) named by a fingerprint of their input and parameters, with one manifest listing them.
+ *   manifest.tsv: name (fingerprint and sketch suffix), bytes, last use (seconds since the epoch), input; one line per sketch
+ *   manifest.lock: locked (flock) while the manifest is read or rewritten
+ * An input's fingerprint hashes the device, inode, size and modification time of each of its files (so it changes when a file
+ * is rewritten, and does not depend on the working directory), with the sketch type, size, k, window, spacing, encoding,
+ * canonicalization, suffix and count-min threshold. Whether a sketch is cached is then a lookup in the manifest,
+ * read once per run, rather than a stat of a file per input.
+ * New sketches are written to temporary files and renamed into place, so that concurrent runs never read a partial sketch.
+ * An entry whose file is missing (e.g., removed by hand) is dropped and its sketch made again.
+ * save() merges this run's uses and sketches into the manifest, then evicts the least recently used sketches while the
+ * directory holds more than max_bytes (0 never evicts). Sketches used in the last EVICTION_GRACE seconds are kept even so,
+ * since a run which started recently may still read them.
+ */
+class SketchCache {
+public:
+    static constexpr time_t EVICTION_GRACE = 3600;
+    struct Entry {
+        uint64_t bytes = 0;
+        time_t last_used = 0;
+        std::string input;
+    };
+private:
+    std::string dir_;
+    uint64_t max_bytes_;
+    std::mutex m_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::unordered_map<std::string, Entry> touched_; // Entries used or written by this run
+    std::vector<std::string> missing_; // Entries whose files were gone when looked up
+    // Holds the manifest lock for its lifetime.
+    class Lock {
+        int fd_;
+    public:
+        Lock(const std::string &dir): fd_(::open((dir + "/manifest.lock").data(), O_RDWR | O_CREAT, 0644)) {
+            if(fd_ < 0 || ::flock(fd_, LOCK_EX)) RUNTIME_ERROR(std::string("Could not lock the sketch cache manifest in ") + dir);
+        }
+        ~Lock() {::flock(fd_, LOCK_UN); ::close(fd_);}
+    };
+    std::string manifest_path() const {return dir_ + "/manifest.tsv";}
+    std::unordered_map<std::string, Entry> read_manifest() const {
+        std::unordered_map<std::string, Entry> ret;
+        std::ifstream ifs(manifest_path());
+        for(std::string line; std::getline(ifs, line);) {
+            if(line.empty() || line[0] == '#') continue;
+            const size_t t1 = line.find('\t'), t2 = line.find('\t', t1 + 1), t3 = line.find('\t', t2 + 1);
+            if(t3 == std::string::npos) {
+                LOG_WARNING("Skipping malformed line in %s: %s\n", manifest_path().data(), line.data());
+                continue;
+            }
+            Entry &e = ret[line.substr(0, t1)];
+            e.bytes = std::strtoull(line.data() + t1 + 1, nullptr, 10);
+            e.last_used = std::strtoll(line.data() + t2 + 1, nullptr, 10);
+            e.input = line.substr(t3 + 1);
+        }
+        return ret;
+    }
+    // Mixes 64-bit words into two independent 64-bit hashes (murmur3's finalizer on each), giving a 128-bit fingerprint.
+    struct Fingerprint {
+        uint64_t a = 0x9e3779b97f4a7c15ull, b = 0xc2b2ae3d27d4eb4full;
+        static uint64_t fmix(uint64_t x) {
+            x ^= x >> 33; x *= 0xff51afd7ed558ccdull;
+            x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ull;
+            return x ^ (x >> 33);
+        }
+        void add(uint64_t x) {a = fmix(a ^ x); b = fmix(b + x * 0x9e3779b97f4a7c15ull + 1);}
+        void add(const std::string &s) {
+            add(s.size());
+            for(size_t i = 0; i < s.size(); i += sizeof(uint64_t)) {
+                uint64_t w = 0;
+                std::memcpy(&w, s.data() + i, std::min(sizeof(w), s.size() - i));
+                add(w);
+            }
+        }
+        std::string hex() const {
+            char buf[33];
+            std::snprintf(buf, sizeof(buf), "%016llx%016llx", static_cast<unsigned long long>(a), static_cast<unsigned long long>(b));
+            return buf;
+        }
+    };
+public:
+    SketchCache(const std::string &dir, uint64_t max_bytes): dir_(dir), max_bytes_(max_bytes) {
+        if(::mkdir(dir_.data(), 0755) && errno != EEXIST) RUNTIME_ERROR(std::string("Could not create sketch cache directory ") + dir_);
+        {
+            Lock lock(dir_);
+            entries_ = read_manifest();
+        }
+        uint64_t total = 0;
+        for(const auto &e: entries_) total += e.second.bytes;
+        LOG_INFO("Sketch cache %s holds %zu sketches (%zu bytes)\n", dir_.data(), entries_.size(), size_t(total));
+    }
+    // The fingerprint of input (files separated by FNAME_SEP) sketched with params, or an empty string if any file is not a regular file (e.g., standard input).
+    static std::string fingerprint(const std::string &input, const std::string &params) {
+        Fingerprint fp;
+        bool cacheable = true;
+        for_each_substr([&](const char *path) {
+            struct stat st;
+            if(!cacheable || is_stdin_path(path) || ::stat(path, &st) || !S_ISREG(st.st_mode)) {cacheable = false; return;}
+            fp.add(st.st_dev), fp.add(st.st_ino), fp.add(st.st_size);
+            fp.add(st.st_mtim.tv_sec), fp.add(st.st_mtim.tv_nsec);
+        }, input, FNAME_SEP);
+        if(!cacheable) return std::string();
+        fp.add(params);
+        return fp.hex();
+    }
+    std::string path(const std::string &name) const {return dir_ + '/' + name;}
+    // Whether a sketch by this name is cached; if so, it counts as used now.
+    // An entry whose file has been removed is dropped, so that the sketch is made again.
+    bool contains(const std::string &name) {
+        std::lock_guard<std::mutex> lock(m_);
+        auto it = entries_.find(name);
+        if(it == entries_.end()) return false;
+        if(!isfile(path(name))) {
+            LOG_WARNING("Sketch cache lists %s, which is missing; sketching it again.\n", path(name).data());
+            entries_.erase(it);
+            touched_.erase(name);
+            missing_.push_back(name);
+            return false;
+        }
+        it->second.last_used = std::time(nullptr);
+        touched_[name] = it->second;
+        return true;
+    }
+    // Moves a sketch written to tmp_path into the cache as name.
+    void insert(const std::string &name, const std::string &tmp_path, const std::string &input) {
+        struct stat st;
+        if(::stat(tmp_path.data(), &st) || std::rename(tmp_path.data(), path(name).data()))
+            RUNTIME_ERROR(std::string("Could not move ") + tmp_path + " into the sketch cache as " + path(name));
+        Entry e;
+        e.bytes = st.st_size, e.last_used = std::time(nullptr), e.input = input;
+        std::lock_guard<std::mutex> lock(m_);
+        entries_[name] = e;
+        touched_[name] = std::move(e);
+    }
+    // Merges this run's entries into the manifest on disk (which other runs may have changed since), evicts, and rewrites it.
+    void save() {
+        std::lock_guard<std::mutex> guard(m_);
+        Lock lock(dir_);
+        entries_ = read_manifest();
+        for(const auto &name: missing_) // Unless it has been written again since
+            if(!touched_.count(name) && !isfile(path(name))) entries_.erase(name);
+        missing_.clear();
+        for(const auto &t: touched_) {
+            Entry &e = entries_[t.first];
+            if(e.last_used <= t.second.last_used) e = t.second;
+        }
+        touched_.clear();
+        uint64_t total = 0;
+        for(const auto &e: entries_) total += e.second.bytes;
+        size_t nevicted = 0;
+        if(max_bytes_ && total > max_bytes_) {
+            std::vector<std::pair<time_t, std::string>> lru;
+            for(const auto &e: entries_) lru.emplace_back(e.second.last_used, e.first);
+            std::sort(lru.begin(), lru.end());
+            const time_t keep_after = std::time(nullptr) - EVICTION_GRACE;
+            for(const auto &e: lru) {
+                if(total <= max_bytes_ || e.first > keep_after) break;
+                if(::unlink(path(e.second).data()) && errno != ENOENT) {
+                    LOG_WARNING("Could not evict %s from the sketch cache\n", path(e.second).data());
+                    continue;
+                }
+                total -= entries_[e.second].bytes;
+                entries_.erase(e.second);
+                ++nevicted;
+            }
+            if(total > max_bytes_) LOG_WARNING("Sketch cache %s holds %zu bytes, over its limit of %zu, in sketches used within the last %zu seconds.\n",
+                                               dir_.data(), size_t(total), size_t(max_bytes_), size_t(EVICTION_GRACE));
+        }
+        const std::string tmp = manifest_path() + ".tmp." + std::to_string(::getpid());
+        std::FILE *fp = std::fopen(tmp.data(), "w");
+        if(fp == nullptr) RUNTIME_ERROR(std::string("Could not write ") + tmp);
+        std::fputs("#name\tbytes\tlast_used\tinput\n", fp);
+        for(const auto &e: entries_)
+            std::fprintf(fp, "%s\t%zu\t%lld\t%s\n", e.first.data(), size_t(e.second.bytes), static_cast<long long>(e.second.last_used), e.second.input.data());
+        if(std::fclose(fp) || std::rename(tmp.data(), manifest_path().data())) RUNTIME_ERROR(std::string("Could not write ") + manifest_path());
+        LOG_INFO("Sketch cache %s holds %zu sketches (%zu bytes)%s\n", dir_.data(), entries_.size(), size_t(total),
+                 nevicted ? (", after evicting " + std::to_string(nevicted)).data(): "");
+    }
+};
+
+// Where an input's sketch is kept: in gargs.cache by fingerprint when there is a cache and the input can be fingerprinted, or else at make_fname's path.
+struct CachedSketch {
+    std::string path;
+    std::string name; // Name in gargs.cache; empty if not kept there
+    bool found = false;
+    // Where to write the sketch: straight to path, or for the cache, to a temporary file which insert() renames to path.
+    std::string write_path() const {
+        return name.empty() ? path: path + ".tmp." + std::to_string(::getpid()) + '.' + std::to_string(omp_get_thread_num());
+    }
+    // Records a sketch written to write_path(), from the same thread.
+    void insert(const std::string &input) const {
+        if(name.size()) gargs.cache->insert(name, write_path(), input);
+    }
+};
+// filter: the count-min filter k-mers pass through (at least mincount times) before reaching the sketch, or null if none.
+// check: whether to look for a sketch already at make_fname's path (the cache is always checked).
+template<typename SketchType>
+inline CachedSketch find_cached(const std::string &input, size_t sketch_p, int wsz, int k, int csz, const std::string &spacing,
+                                const std::string &suffix, const std::string &prefix, EncodingType enct, bool canon,
+                                const CountingSketch *filter, uint32_t mincount, bool check) {
+    CachedSketch ret;
+    if(gargs.cache) {
+        std::string params = make_fname<SketchType>("", sketch_p, wsz, k, csz, spacing, suffix, "", enct);
+        params += canon ? ".canon": ".noncanon";
+        if(filter) // Which k-mers pass also depends on the filter's table size and number of hashes
+            params += ".mincount" + std::to_string(mincount) + ".cm" + std::to_string(filter->l2sz()) + 'x' + std::to_string(filter->nhashes());
+        ret.name = SketchCache::fingerprint(input, params);
+        if(ret.name.size()) {
+            ret.name += SketchFileSuffix<SketchType>::suffix;
+            ret.path = gargs.cache->path(ret.name);
+            ret.found = gargs.cache->contains(ret.name);
+            return ret;
+        }
+    }
+    ret.path = make_fname<SketchType>(input.data(), sketch_p, wsz, k, csz, spacing, suffix, prefix, enct);
+    ret.found = check && isfile(ret.path);
+    return ret;
+}
+
+} // namespace bns
@@ -0,0 +1,296 @@
+#pragma once
+#include "intersect.h"
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace bns {
+
+/*
+ * Compact on-disk format for sorted sets of 64-bit keys (full k-mer hash sets), which can be memory-mapped and compared
+ * without decoding more than a block at a time.
+ *
+ * Layout (all fields little-endian, all sections 8-byte aligned):
+ *   CompactSetHeader
+ *   blocks: keys are cut into blocks of block_size; each block is Elias-Fano coded relative to its first key
+ *   index: a CompactBlockEntry (first key, byte offset of the block) per block
+ *   CompactSetTrailer
+ * The trailer comes last so that sets can be written in one pass to a stream (including through gzip, which is then read into memory).
+ *
+ * A block of m keys x_0 < ... < x_{m-1} stores v_i = x_i - x_0 for i in [1, m): a word holding L | m << 8, then the low L bits
+ * of each v_i packed into words, then a bit vector with bit (v_i >> L) + (i - 1) set for each v_i. Choosing
+ * L = floor(log2(v_{m-1} / (m - 1))) costs about L + 2 bits per key; for random hashes, L is about 64 - log2(n).
+ */
+struct CompactSetHeader {
+    static constexpr uint64_t MAGIC = 0x4653484b48534144ull; // "DASHKHSF", little-endian
+    static constexpr uint32_t VERSION = 1;
+    uint64_t magic = MAGIC;
+    uint32_t version = VERSION, block_size = 0;
+};
+struct CompactSetTrailer {
+    uint64_t n = 0, nblocks = 0, index_offset = 0, magic = CompactSetHeader::MAGIC;
+};
+struct CompactBlockEntry {
+    uint64_t first, offset;
+};
+
+static constexpr uint32_t COMPACT_BLOCK_SIZE = 128;
+static constexpr uint32_t COMPACT_MAX_BLOCK_SIZE = 1024;
+
+class CompactSetView {
+    const uint64_t *words_ = nullptr, *blocks_end_ = nullptr;
+    const CompactBlockEntry *index_ = nullptr;
+    uint64_t n_ = 0, nblocks_ = 0;
+    uint32_t block_size_ = 0;
+public:
+    CompactSetView() {}
+    // Validates the header and trailer of a complete set in memory; data must be 8-byte aligned.
+    CompactSetView(const void *data, size_t nbytes) {
+        CompactSetHeader hdr;
+        CompactSetTrailer tr;
+        if(nbytes < sizeof(hdr) + sizeof(tr) || nbytes % 8) throw std::runtime_error("Truncated compact hash set");
+        std::memcpy(&hdr, data, sizeof(hdr));
+        std::memcpy(&tr, static_cast<const char *>(data) + nbytes - sizeof(tr), sizeof(tr));
+        if(hdr.magic != CompactSetHeader::MAGIC || tr.magic != CompactSetHeader::MAGIC) throw std::runtime_error("Not a compact hash set, or truncated");
+        if(hdr.version != CompactSetHeader::VERSION)
+            throw std::runtime_error(std::string("Compact hash set format version ") + std::to_string(hdr.version) + " is not supported by this version of dashing");
+        if(hdr.block_size == 0 || hdr.block_size > COMPACT_MAX_BLOCK_SIZE || tr.nblocks != (tr.n + hdr.block_size - 1) / hdr.block_size
+           || tr.index_offset % 8 || tr.index_offset + tr.nblocks * sizeof(CompactBlockEntry) + sizeof(tr) != nbytes)
+            throw std::runtime_error("Corrupted compact hash set");
+        words_ = static_cast<const uint64_t *>(data);
+        blocks_end_ = words_ + tr.index_offset / 8;
+        index_ = reinterpret_cast<const CompactBlockEntry *>(static_cast<const char *>(data) + tr.index_offset);
+        n_ = tr.n, nblocks_ = tr.nblocks, block_size_ = hdr.block_size;
+    }
+    static bool has_magic(const void *data, size_t nbytes) {
+        uint64_t magic;
+        if(nbytes < sizeof(magic)) return false;
+        std::memcpy(&magic, data, sizeof(magic));
+        return magic == CompactSetHeader::MAGIC;
+    }
+    size_t size() const {return n_;}
+    size_t nblocks() const {return nblocks_;}
+    uint64_t first(size_t b) const {return index_[b].first;}
+    // Largest key block b could hold: one less than the first key of the next block.
+    uint64_t limit(size_t b) const {return b + 1 < nblocks_ ? index_[b + 1].first - 1: UINT64_MAX;}
+    size_t block_keys(size_t b) const {return b + 1 < nblocks_ ? block_size_: n_ - b * block_size_;}
+    // Decodes block b into out (which has room for COMPACT_MAX_BLOCK_SIZE keys), returning the number of keys.
+    // The offset, key count and widths come from the file, so each is checked before anything is read or written through it.
+    size_t decode(size_t b, uint64_t *out) const {
+        const uint64_t base = index_[b].first, offset = index_[b].offset;
+        if(offset % 8 || offset < sizeof(CompactSetHeader) || offset / 8 >= size_t(blocks_end_ - words_))
+            throw std::runtime_error("Corrupted compact hash set");
+        const uint64_t *p = words_ + offset / 8;
+        const unsigned L = *p & 0xFF;
+        const size_t k = (*p >> 8) - 1;
+        if(L > 63 || k + 1 != block_keys(b)) throw std::runtime_error("Corrupted compact hash set");
+        const uint64_t *low = p + 1, *high = low + (k * L + 63) / 64;
+        if(k && high >= blocks_end_) throw std::runtime_error("Corrupted compact hash set");
+        out[0] = base;
+        const uint64_t lmask = L ? UINT64_MAX >> (64 - L): 0;
+        const char *const lowbytes = reinterpret_cast<const char *>(low);
+        size_t i = 0;
+        for(size_t w = 0; i < k; ++w) {
+            if(high + w == blocks_end_) throw std::runtime_error("Corrupted compact hash set"); // Too few bits set for k keys
+            for(uint64_t bits = high[w]; bits && i < k; bits &= bits - 1, ++i) {
+                const uint64_t h = w * 64 + __builtin_ctzll(bits) - i;
+                const size_t pos = i * L;
+                uint64_t lo;
+                if(L <= 57) { // An unaligned load holds all L bits; it may read into the high bits, which follow
+                    std::memcpy(&lo, lowbytes + pos / 8, sizeof(lo));
+                    lo = (lo >> (pos % 8)) & lmask;
+                } else {
+                    const size_t lw = pos / 64, lo_off = pos % 64;
+                    lo = low[lw] >> lo_off;
+                    if(lo_off + L > 64) lo |= low[lw + 1] << (64 - lo_off);
+                    lo &= lmask;
+                }
+                out[i + 1] = base + ((h << L) | lo);
+            }
+        }
+        return k + 1;
+    }
+    void decode_all(uint64_t *out) const {
+        for(size_t b = 0; b < nblocks_; ++b) decode(b, out + b * block_size_);
+    }
+};
+
+// Writes a compact set to a gzFile (opened with "wT" to keep it mappable) from keys given in increasing order.
+class CompactSetWriter {
+    gzFile fp_;
+    std::vector<uint64_t> block_, words_;
+    std::vector<CompactBlockEntry> index_;
+    uint64_t offset_ = 0, n_ = 0, last_ = 0;
+    const uint32_t block_size_;
+    void put(const void *data, size_t nb) {
+        if(nb && gzwrite(fp_, data, nb) != ssize_t(nb)) throw std::runtime_error("Failed to write compact hash set to disk.");
+        offset_ += nb;
+    }
+    void flush_block() {
+        if(block_.empty()) return;
+        const uint64_t base = block_.front();
+        const size_t k = block_.size() - 1;
+        const uint64_t u = block_.back() - base;
+        const unsigned L = k && u / k ? 63 - __builtin_clzll(u / k): 0;
+        const size_t nlow = (k * L + 63) / 64, nhigh = k ? ((u >> L) + k + 63) / 64: 0;
+        words_.assign(1 + nlow + nhigh, 0);
+        words_[0] = L | uint64_t(block_.size()) << 8;
+        uint64_t *low = words_.data() + 1, *high = low + nlow;
+        for(size_t i = 0; i < k; ++i) {
+            const uint64_t v = block_[i + 1] - base;
+            if(L) {
+                const uint64_t lo = v & (UINT64_MAX >> (64 - L));
+                const size_t pos = i * L, lw = pos / 64, lo_off = pos % 64;
+                low[lw] |= lo << lo_off;
+                if(lo_off + L > 64) low[lw + 1] |= lo >> (64 - lo_off);
+            }
+            const uint64_t hp = (v >> L) + i;
+            high[hp / 64] |= uint64_t(1) << (hp % 64);
+        }
+        index_.push_back(CompactBlockEntry{base, offset_});
+        put(words_.data(), words_.size() * sizeof(uint64_t));
+        block_.clear();
+    }
+public:
+    CompactSetWriter(gzFile fp, uint32_t block_size=COMPACT_BLOCK_SIZE): fp_(fp), block_size_(block_size) {
+        CompactSetHeader hdr;
+        hdr.block_size = block_size_;
+        put(&hdr, sizeof(hdr));
+        block_.reserve(block_size_);
+    }
+    void add(uint64_t x) {
+        assert(n_ == 0 || x > last_);
+        block_.push_back(last_ = x);
+        ++n_;
+        if(block_.size() == block_size_) flush_block();
+    }
+    void add(const uint64_t *keys, size_t n) {
+        for(size_t i = 0; i < n; ++i) add(keys[i]);
+    }
+    void finish() {
+        flush_block();
+        CompactSetTrailer tr;
+        tr.n = n_, tr.nblocks = index_.size(), tr.index_offset = offset_;
+        put(index_.data(), index_.size() * sizeof(CompactBlockEntry));
+        put(&tr, sizeof(tr));
+    }
+};
+
+/*
+ * A compact set read from disk: memory-mapped when stored uncompressed, otherwise decompressed into memory (still compact),
+ * or borrowed from a larger mapping (a sketch pack) which owner_ keeps alive.
+ */
+class CompactSetFile {
+    void *map_ = nullptr;
+    size_t maplen_ = 0;
+    std::vector<uint64_t> buf_;
+    std::shared_ptr<const void> owner_;
+    CompactSetView view_;
+    size_t nbytes_ = 0;
+public:
+    CompactSetFile() {}
+    CompactSetFile(const CompactSetFile &) = delete;
+    CompactSetFile &operator=(const CompactSetFile &) = delete;
+    ~CompactSetFile() {if(map_) ::munmap(map_, maplen_);}
+    const CompactSetView &view() const {return view_;}
+    size_t bytes() const {return nbytes_;}
+    static std::shared_ptr<CompactSetFile> borrow(std::shared_ptr<const void> owner, const void *data, size_t nbytes) {
+        std::shared_ptr<CompactSetFile> ret(new CompactSetFile);
+        ret->owner_ = std::move(owner);
+        ret->view_ = CompactSetView(data, nbytes);
+        ret->nbytes_ = nbytes;
+        return ret;
+    }
+    // Returns nullptr if path does not hold a compact set (e.g., a set written by older versions of dashing).
+    static std::shared_ptr<CompactSetFile> open(const char *path) {
+        std::shared_ptr<CompactSetFile> ret;
+        const int fd = ::open(path, O_RDONLY);
+        if(fd < 0) throw std::runtime_error(std::string("Could not open ") + path);
+        struct stat st;
+        uint64_t magic = 0;
+        if(::fstat(fd, &st) || ::pread(fd, &magic, sizeof(magic), 0) < 0) {
+            ::close(fd);
+            throw std::runtime_error(std::string("Could not read ") + path);
+        }
+        if(CompactSetView::has_magic(&magic, sizeof(magic))) {
+            ret.reset(new CompactSetFile);
+            ret->maplen_ = st.st_size;
+            ret->map_ = ::mmap(nullptr, ret->maplen_, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if(ret->map_ == MAP_FAILED) {
+                ret->map_ = nullptr;
+                throw std::runtime_error(std::string("Could not map ") + path);
+            }
+            ret->view_ = CompactSetView(ret->map_, ret->maplen_);
+            ret->nbytes_ = ret->maplen_;
+            return ret;
+        }
+        ::close(fd);
+        gzFile fp = gzopen(path, "rb");
+        if(fp == nullptr) throw std::runtime_error(std::string("Could not open ") + path);
+        if(gzread(fp, &magic, sizeof(magic)) == sizeof(magic) && CompactSetView::has_magic(&magic, sizeof(magic))) {
+            ret.reset(new CompactSetFile);
+            auto &buf = ret->buf_;
+            buf.push_back(magic);
+            static constexpr size_t CHUNK = size_t(1) << 20;
+            for(int nr;;) {
+                const size_t nw = buf.size();
+                buf.resize(nw + CHUNK);
+                if((nr = gzread(fp, buf.data() + nw, CHUNK * sizeof(uint64_t))) < 0) {
+                    gzclose(fp);
+                    throw std::runtime_error(std::string("Could not read ") + path);
+                }
+                buf.resize(nw + (nr + 7) / 8);
+                if(size_t(nr) < CHUNK * sizeof(uint64_t)) break;
+            }
+            buf.shrink_to_fit();
+            ret->view_ = CompactSetView(buf.data(), buf.size() * sizeof(uint64_t));
+            ret->nbytes_ = buf.size() * sizeof(uint64_t);
+        }
+        gzclose(fp);
+        return ret;
+    }
+};
+
+// Sizes of intersections involving compact sets, decoding only blocks whose key ranges overlap the other set.
+inline size_t intersection_size(const CompactSetView &a, const CompactSetView &b) {
+    if(a.size() > b.size()) return intersection_size(b, a);
+    // Blocks of the larger set b are only decoded when they could hold a key of the current block of a.
+    uint64_t bufa[COMPACT_MAX_BLOCK_SIZE], bufb[COMPACT_MAX_BLOCK_SIZE];
+    size_t i = 0, j = 0, ret = 0, na = 0, deca = SIZE_MAX;
+    while(i < a.nblocks() && j < b.nblocks()) {
+        const uint64_t la = a.limit(i), lb = b.limit(j);
+        if(la < b.first(j)) {++i; continue;}
+        if(lb < a.first(i)) {++j; continue;}
+        if(deca != i) na = a.decode(i, bufa), deca = i;
+        const uint64_t *const lo = std::lower_bound(bufa, bufa + na, b.first(j)), *const hi = std::upper_bound(lo, static_cast<const uint64_t *>(bufa) + na, lb);
+        if(lo != hi) ret += intersection_size(lo, hi - lo, bufb, b.decode(j, bufb));
+        i += la <= lb;
+        j += lb <= la;
+    }
+    return ret;
+}
+inline size_t intersection_size(const CompactSetView &a, const uint64_t *b, size_t nb) {
+    uint64_t buf[COMPACT_MAX_BLOCK_SIZE];
+    size_t ret = 0;
+    const uint64_t *p = b, *const end = b + nb;
+    for(size_t i = 0; i < a.nblocks() && p != end; ++i) {
+        p = std::lower_bound(p, end, a.first(i));
+        const uint64_t *const e = i + 1 < a.nblocks() ? std::lower_bound(p, end, a.first(i + 1)): end;
+        if(p == e) continue;
+        ret += intersection_size(buf, a.decode(i, buf), p, e - p);
+        p = e;
+    }
+    return ret;
+}
+
+} // namespace bns
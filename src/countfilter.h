@@ -0,0 +1,106 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace bns {
+
+/*
+ * Approximate k-mer counter for filtering low-count (likely erroneous) k-mers, reset between inputs.
+ *
+ * Counts are exact until EXACT_LIMIT distinct keys have been seen, in a small open-addressing table;
+ * after that, they are moved into a count-min table (nhashes rows of 2^l2sz cells, conservative update),
+ * which is only allocated once some input is that large. Every slot carries the generation in which it was written,
+ * and slots from older generations read as empty, so clear() just advances the generation instead of touching memory.
+ * This keeps the cost of many small inputs proportional to their size rather than to the table's.
+ */
+template<typename Hasher>
+class CountFilter {
+public:
+    static constexpr size_t EXACT_LIMIT = 1 << 14;
+private:
+    static constexpr size_t EXACT_SLOTS = EXACT_LIMIT * 2;
+    struct Slot {
+        uint64_t key;
+        uint32_t gen, count;
+    };
+    struct Cell {
+        uint32_t gen, count;
+    };
+    std::unique_ptr<Slot[]> exact_;
+    std::unique_ptr<Cell[]> cells_;
+    std::vector<Hasher> hashers_;
+    const unsigned l2sz_;
+    const uint64_t mask_;
+    size_t nexact_ = 0;
+    uint32_t gen_ = 1;
+    bool exact_mode_ = true;
+
+    uint32_t &cell_count(size_t row, uint64_t key) {
+        Cell &c = cells_[(row << l2sz_) | (hashers_[row](key) & mask_)];
+        if(c.gen != gen_) c.gen = gen_, c.count = 0;
+        return c.count;
+    }
+    uint64_t add_cm(uint64_t key, uint32_t inc) {
+        uint32_t *counts[64];
+        uint32_t mn = UINT32_MAX;
+        for(size_t i = 0; i < hashers_.size(); ++i)
+            mn = std::min(mn, *(counts[i] = &cell_count(i, key)));
+        const uint32_t next = mn + inc;
+        for(size_t i = 0; i < hashers_.size(); ++i) // Conservative update: only raise cells below the new estimate
+            if(*counts[i] < next) *counts[i] = next;
+        return next;
+    }
+    void spill() {
+        if(!cells_) {
+            cells_.reset(new Cell[hashers_.size() << l2sz_]);
+            std::memset(cells_.get(), 0, sizeof(Cell) * (hashers_.size() << l2sz_));
+        }
+        for(size_t i = 0; i < EXACT_SLOTS; ++i)
+            if(exact_[i].gen == gen_) add_cm(exact_[i].key, exact_[i].count);
+        exact_mode_ = false;
+    }
+public:
+    CountFilter(unsigned l2sz, unsigned nhashes, uint64_t seed):
+        exact_(new Slot[EXACT_SLOTS]), l2sz_(std::max(l2sz, 1u)), mask_((uint64_t(1) << l2sz_) - 1)
+    {
+        if(nhashes == 0 || nhashes > 64) throw std::invalid_argument("count-min filters need between 1 and 64 hashes");
+        if(l2sz > 40) throw std::invalid_argument("count-min filter size (log2) must be at most 40");
+        std::memset(exact_.get(), 0, sizeof(Slot) * EXACT_SLOTS);
+        for(unsigned i = 0; i < nhashes; ++i) hashers_.emplace_back(seed + i * 0x9E3779B97F4A7C15ull);
+    }
+    CountFilter(CountFilter &&) = default;
+    unsigned l2sz() const {return l2sz_;}
+    size_t nhashes() const {return hashers_.size();}
+    // Adds key (a k-mer) and returns its count so far, which never underestimates the true count.
+    uint64_t addh(uint64_t key) {
+        if(!exact_mode_) return add_cm(key, 1);
+        for(size_t i = hashers_[0](key) & (EXACT_SLOTS - 1);; i = (i + 1) & (EXACT_SLOTS - 1)) {
+            Slot &s = exact_[i];
+            if(s.gen != gen_) {
+                if(nexact_ == EXACT_LIMIT) {
+                    spill();
+                    return add_cm(key, 1);
+                }
+                ++nexact_;
+                s = Slot{key, gen_, 1};
+                return 1;
+            }
+            if(s.key == key) return ++s.count;
+        }
+    }
+    void clear() {
+        nexact_ = 0;
+        exact_mode_ = true;
+        if(++gen_ == 0) { // Wrapped: stale generations could alias, so reset for real once every 2^32 - 1 clears.
+            std::memset(exact_.get(), 0, sizeof(Slot) * EXACT_SLOTS);
+            if(cells_) std::memset(cells_.get(), 0, sizeof(Cell) * (hashers_.size() << l2sz_));
+            gen_ = 1;
+        }
+    }
+};
+
+} // namespace bns
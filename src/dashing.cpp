@@ -5,6 +5,7 @@ using hll::hll_t;
 
 
 namespace bns {
+GlobalArgs gargs;
 extern template void sketch_core<mh::RangeMinHash<uint64_t>>(uint32_t ssarg, uint32_t nthreads, uint32_t wsz, uint32_t k, const Spacer &sp, const std::vector<std::string> &inpaths, const std::string &suffix, const std::string &prefix, std::vector<CountingSketch> &counting_sketches, EstimationMethod estim, JointEstimationMethod jestim, KSeqBufferHolder &kseqs, const std::vector<bool> &use_filter, const std::string &spacing, bool skip_cached, bool canon, uint32_t mincount, bool entropy_minimization, EncodingType enct);
 extern template void sketch_core<mh::CountingRangeMinHash<uint64_t>>(uint32_t ssarg, uint32_t nthreads, uint32_t wsz, uint32_t k, const Spacer &sp, const std::vector<std::string> &inpaths, const std::string &suffix, const std::string &prefix, std::vector<CountingSketch> &counting_sketches, EstimationMethod estim, JointEstimationMethod jestim, KSeqBufferHolder &kseqs, const std::vector<bool> &use_filter, const std::string &spacing, bool skip_cached, bool canon, uint32_t mincount, bool entropy_minimization, EncodingType enct);
 extern template void sketch_core<SuperMinHashType>(uint32_t ssarg, uint32_t nthreads, uint32_t wsz, uint32_t k, const Spacer &sp, const std::vector<std::string> &inpaths, const std::string &suffix, const std::string &prefix, std::vector<CountingSketch> &counting_sketches, EstimationMethod estim, JointEstimationMethod jestim, KSeqBufferHolder &kseqs, const std::vector<bool> &use_filter, const std::string &spacing, bool skip_cached, bool canon, uint32_t mincount, bool entropy_minimization, EncodingType enct);
@@ -15,7 +16,7 @@ extern template void sketch_core<mh::BBitMinHasher<uint64_t>>(uint32_t ssarg, ui
 
 
 void main_usage(char **argv) {
-    std::fprintf(stderr, "Usage: %s <subcommand> [options...]. Use %s <subcommand> for more options. [Subcommands: sketch, dist, setdist, hll, printmat.]\n",
+    std::fprintf(stderr, "Usage: %s <subcommand> [options...]. Use %s <subcommand> for more options. [Subcommands: sketch, dist, setdist, hll, printmat, merge-shards, pack.]\n",
                  *argv, *argv);
     std::exit(EXIT_FAILURE);
 }
@@ -27,7 +28,7 @@ size_t posix_fsize(const char *path) {
 }
 
 void dist_usage(const char *arg) {
-    std::fprintf(stderr, "Usage: %s <opts> [genome1 genome2 seq.fq [...] if not provided from a file with -F]\n"
+    std::fprintf(stderr, "Usage: %s <opts> [genome1 genome2 seq.fq [...] if not provided from a file with -F. Use - for stdin; named pipes are also accepted]\n"
                          "Flags:\n"
                          "-h/-?, --help\tUsage\n\n\n"
                          "===Encoding Options===\n\n"
@@ -53,16 +54,42 @@ void dist_usage(const char *arg) {
                          "===Runtime Options\n\n"
                          "-F, --paths\tGet paths to genomes from file rather than positional arguments\n"
                          "-W, --cache-sketches\tCache sketches/use cached sketches\n"
+                         "--cache-dir\tCache sketches in (and use cached sketches from) this directory, found through one manifest by a fingerprint\n"
+                         "of each input (device, inode, size and modification time) and the sketch parameters. Implies -W.\n"
+                         "--cache-max-bytes\tAfter the run, evict least recently used sketches from --cache-dir until it holds at most this many bytes [0: never evict]\n"
                          "-p, --nthreads\tSet number of threads [1]\n"
-                         "--presketched\tTreat provided paths as pre-made sketches.\n"
+                         "--split-files\tSplit the records of inputs with more than 1/nthreads of the estimated total work across all threads, then sketch the rest one per thread. Helps when a few very large inputs dominate runtime.\n"
+                         "--io-threads\tDecompress and parse each input on its own threads (this many inflating BGZF blocks in parallel), feeding batches of records to hashing threads. Implies --split-files.\n"
+                         "--compute-threads\tSet number of hashing threads per input with --split-files or --io-threads [nthreads]\n"
+                         "--tile-cache\tCompare all pairs in tiles of sketches fitting in this many bytes (e.g., L2 size); 0 compares one row at a time. Throughput is logged. [1048576]\n"
+                         "--huge-pages\tBack the contiguous arena of HLL registers used for comparisons with huge pages\n"
+                         "--shard\tCompute only shard i of N (given as i/N) of the all-pairs matrix, balanced by number of pairs, and write it to -O for `dashing merge-shards`.\n"
+                         "Every shard must be given the same inputs in the same order; they are not sorted. Best used with --presketched.\n"
+                         "A shard sketches only the inputs from its first row on, and writes (-o) the sizes of only its own rows.\n"
+                         "--extend-matrix\tExtend the binary matrix at this path (with its .labels and .result_type files, as written by -b -O) by the given inputs:\n"
+                         "only new x old and new x new pairs are computed, and existing entries are copied a block at a time. Old inputs are sketched as in their labels, so use -W or --presketched.\n"
+                         "Requires -b and the existing matrix's comparison; -O must be a different path from the existing matrix.\n"
+                         "--stream-queries\tWith -Q, sketch the references first, then sketch, compare and emit the queries this many at a time,\n"
+                         "so that memory holds the references and one window of queries. Query sizes are written only if -o and -O differ.\n"
+                         "--memory-budget\tCompute all pairs with sketches and rows in about this many bytes: sketch a window at a time, spill the sketches\n"
+                         "to a scratch file, and compare them in blocks which fit. Output is the same as without it. -b and -T still hold the whole matrix.\n"
+                         "--scratch-dir\tDirectory for the --memory-budget scratch file [$TMPDIR, or /tmp]\n"
+                         "--presketched\tTreat provided paths as pre-made sketches. Paths ending in .dpk are sketch packs (see dashing pack), each standing for the sketches in it.\n"
                          "-P, --prefix\tSet prefix for sketch file locations [empty]\n"
                          "-x, --suffix\tSet suffix in sketch file names [empty]\n"
-                         "--avoid-sorting\tAvoid sorting files by genome sizes. This avoids a computational step, but can result in degraded load-balancing.\n\n\n"
+                         "--avoid-sorting\tAvoid sorting files by estimated uncompressed size (compressed inputs are sampled), largest first. This avoids a computational step, but can result in degraded load-balancing.\n\n\n"
                          "===Emission Formats===\n\n"
                          "-b, --emit-binary\tEmit distances in binary (default: human-readable, upper-triangular)\n"
                          "-U, --phylip\tEmit distances in PHYLIP upper triangular format(default: human-readable, upper-triangular)\n"
                          "between bases repeated the second integer number of times\n"
-                         "-T, --full-tsv\tpostprocess binary format to human-readable TSV (not upper triangular)\n\n\n"
+                         "-T, --full-tsv\tpostprocess binary format to human-readable TSV (not upper triangular)\n"
+                         "--topk\tEmit only each input's (or query's) k nearest neighbours, best first, rather than the full matrix: as TSV (query, neighbor, value, rank),\n"
+                         "or with -b as k records of {uint32_t neighbor index; float value} per row, padded with index 0xFFFFFFFF. Memory scales with n * k.\n"
+                         "--min-similarity\tEmit only pairs with a similarity (e.g., Jaccard index) of at least this value, as an edge list: TSV (path1, path2, value),\n"
+                         "or with -b as {uint32_t i; uint32_t j; float value} records (COO). Rejected pairs are never formatted or written.\n"
+                         "--max-dist\tAs --min-similarity, for distances: emit only pairs at most this far apart.\n"
+                         "--lsh-threshold\tWith range minhash or b-bit minhash sketches, find pairs with a Jaccard similarity of at least this value\n"
+                         "by LSH banding, comparing only candidate pairs. Emits an edge list as --min-similarity does; the expected recall is logged and written to the TSV header.\n\n\n"
                          "===Emission Details===\n\n"
                          "-e, --emit-scientific\tEmit in scientific notation\n\n\n"
                          "===Data Structures===\n\n"
@@ -102,7 +129,7 @@ void dist_usage(const char *arg) {
 
 // Usage, utilities
 void sketch_usage(const char *arg) {
-    std::fprintf(stderr, "Usage: %s <opts> [genomes if not provided from a file with -F]\n"
+    std::fprintf(stderr, "Usage: %s <opts> [genomes if not provided from a file with -F. Use - for stdin; named pipes are also accepted]\n"
                          "Flags:\n"
                          "-h/-?:\tEmit usage\n"
                          "\n\n"
@@ -117,11 +144,17 @@ void sketch_usage(const char *arg) {
                          "--bbits/-B\tSet `b` for b-bit minwise hashing to <int>. Default: 16\n\n\n"
                          "Run options --\n\n"
                          "--nthreads/-p\tSet number of threads [1]\n"
+                         "--split-files\tSplit the records of inputs with more than 1/nthreads of the estimated total work across all threads, then sketch the rest one per thread. Helps when a few very large inputs dominate runtime.\n"
+                         "--io-threads\tDecompress and parse each input on its own threads (this many inflating BGZF blocks in parallel), feeding batches of records to hashing threads. Implies --split-files.\n"
+                         "--compute-threads\tSet number of hashing threads per input with --split-files or --io-threads [nthreads]\n"
                          "--prefix/-P\tSet prefix for sketch file locations [empty]\n"
                          "--suffix/-x\tSet suffix in sketch file names [empty]\n"
                          "--paths/-F\tGet paths to genomes from file rather than positional arguments\n"
                          "--skip-cached/-c\tSkip alreday produced/cached sketches (save sketches to disk in directory of the file [default] or in folder specified by -P\n"
-                         "--avoid-sorting\tAvoid sorting files by genome sizes. This avoids a computational step, but can result in degraded load-balancing.\n\n\n"
+                         "--cache-dir\tWrite sketches to (and skip sketches already in) this directory, found through one manifest by a fingerprint\n"
+                         "of each input (device, inode, size and modification time) and the sketch parameters. Implies --skip-cached.\n"
+                         "--cache-max-bytes\tAfter the run, evict least recently used sketches from --cache-dir until it holds at most this many bytes [0: never evict]\n"
+                         "--avoid-sorting\tAvoid sorting files by estimated uncompressed size (compressed inputs are sampled), largest first. This avoids a computational step, but can result in degraded load-balancing.\n\n\n"
                          "\n\n"
                          "Estimation methods --\n\n"
                          "--original/-E\tUse Flajolet with inclusion/exclusion quantitation method for hll. [Default: Ertl MLE]\n"
@@ -143,6 +176,15 @@ void sketch_usage(const char *arg) {
                          "--use-super-minhash\tCreate b-bit super minhash sketches\n"
                          "--use-counting-range-minhash\tCreate range minhash sketches\n"
                          "--use-full-khash-sets\tUse full khash sets for comparisons, rather than sketches. This can take a lot of memory and time!\n"
+                         "--sketch-types\tBuild several sketch types from one pass over each input, each written to its own file. Comma-separated list of <type>[:<log2 size>],\n"
+                         "              \twith types hll, bf, rmh, crmh, bbmh, smh and fhs, and sizes defaulting to -S. (e.g., hll:14,bbmh,rmh:12) Overrides the flags above.\n"
+                         "\n\n"
+                         "Demultiplexing Options --\n\n"
+                         "Treat inputs as multiplexed streams, writing one sketch per sample named by a field of each read name.\n"
+                         "Setting any of these enables demultiplexing. Records without the field are skipped.\n"
+                         "--demux-field\tUse this field (0-based; negative counts from the end) of the read name as the sample [0]\n"
+                         "--demux-delim\tSplit read names into fields at any of these characters [_]\n"
+                         "--demux-comment\tTake fields from the read comment instead (e.g., --demux-comment --demux-delim : --demux-field -1 for Illumina barcodes)\n"
                          "\n\n"
                          "===Count-min-based Streaming Weighted Jaccard===\n"
                          "--wj               \tEnable weighted jaccard adapter\n"
@@ -197,17 +239,45 @@ static option_struct sketch_long_options[] = {\
     LO_FLAG("use-cyclic-hash", 134, enct, NTHASH)\
     LO_FLAG("avoid-sorting", 135, avoid_fsorting, true)\
     LO_FLAG("wj", 138, weighted_jaccard, true)\
+    LO_FLAG("split-files", 139, split_files, true)\
+    LO_ARG("io-threads", 140)\
+    LO_ARG("compute-threads", 141)\
+    LO_ARG("demux-field", 142)\
+    LO_ARG("demux-delim", 143)\
+    LO_FLAG("demux-comment", 144, demux_comment, true)\
+    LO_ARG("sketch-types", 145)\
+    LO_ARG("cache-dir", 146)\
+    LO_ARG("cache-max-bytes", 147)\
     {0,0,0,0}\
 };
 
+// Parses a comma-separated list of <type>[:<log2 size in bytes>], where type is one of
+// hll, bf, rmh, crmh, bbmh, smh, or fhs; sizes default to default_size.
+static std::vector<SketchSpec> parse_sketch_specs(const char *arg, uint32_t default_size) {
+    static const std::pair<const char *, Sketch> names[] {
+        {"hll", HLL}, {"bf", BLOOM_FILTER}, {"rmh", RANGE_MINHASH}, {"crmh", COUNTING_RANGE_MINHASH},
+        {"bbmh", BB_MINHASH}, {"smh", BB_SUPERMINHASH}, {"fhs", FULL_KHASH_SET}
+    };
+    std::vector<SketchSpec> ret;
+    for_each_substr([&](const char *s) {
+        const char *colon = std::strchr(s, ':');
+        const std::string name(s, colon ? colon - s: std::strlen(s));
+        auto it = std::find_if(std::begin(names), std::end(names), [&](const auto &x) {return name == x.first;});
+        if(it == std::end(names)) RUNTIME_ERROR(std::string("Unknown sketch type '") + name + "'. Expected one of hll, bf, rmh, crmh, bbmh, smh, fhs.");
+        ret.emplace_back(it->second, colon ? uint32_t(std::atoi(colon + 1)): default_size);
+    }, arg, ',');
+    return ret;
+}
+
 // Main functions
 int sketch_main(int argc, char *argv[]) {
     int wsz(0), k(31), sketch_size(10), skip_cached(false), co, nthreads(1), mincount(1), nhashes(4), cmsketchsize(-1);
     int canon(true);
-    int entropy_minimization = false, avoid_fsorting = false, weighted_jaccard = false;
+    int entropy_minimization = false, avoid_fsorting = false, weighted_jaccard = false, split_files = false, demux_comment = false;
     hll::EstimationMethod estim = hll::EstimationMethod::ERTL_MLE;
     hll::JointEstimationMethod jestim = static_cast<hll::JointEstimationMethod>(hll::EstimationMethod::ERTL_MLE);
     std::string spacing, paths_file, suffix, prefix;
+    const char *sketch_types = nullptr;
     sketching_method sm = EXACT;
     Sketch sketch_type = HLL;
     EncodingType enct = BONSAI;
@@ -241,6 +311,13 @@ int sketch_main(int argc, char *argv[]) {
             case 's': spacing = optarg; break;
             case 'w': wsz = std::atoi(optarg); break;
             case 'x': suffix = optarg; break;
+            case 140: gargs.io_threads = std::atoi(optarg); break;
+            case 141: gargs.compute_threads = std::atoi(optarg); break;
+            case 142: gargs.demux = true; gargs.demux_field = std::atoi(optarg); break;
+            case 143: gargs.demux = true; gargs.demux_delim = optarg; break;
+            case 145: sketch_types = optarg; break;
+            case 146: gargs.cache_dir = optarg; skip_cached = true; break;
+            case 147: gargs.cache_max_bytes = std::strtoull(optarg, nullptr, 10); break;
             case 'h': case '?': sketch_usage(*argv); break;
         }
     }
@@ -250,6 +327,15 @@ int sketch_main(int argc, char *argv[]) {
         RUNTIME_ERROR("kmers must be unspaced for k > 32");
     nthreads = std::max(nthreads, 1);
     omp_set_num_threads(nthreads);
+    gargs.split_files = split_files;
+    if(demux_comment) gargs.demux = gargs.demux_comment = true;
+    if(gargs.demux && gargs.demux_delim.empty())
+        RUNTIME_ERROR("--demux-delim requires at least one delimiter character.");
+    if(gargs.cache_max_bytes && gargs.cache_dir.empty())
+        RUNTIME_ERROR("--cache-max-bytes bounds the sketch cache, which requires --cache-dir.");
+    if(gargs.demux && gargs.cache_dir.size())
+        RUNTIME_ERROR("--cache-dir caches sketches of inputs, and cannot be combined with demultiplexing, which sketches samples.");
+    if(gargs.cache_dir.size()) gargs.cache = std::make_shared<SketchCache>(gargs.cache_dir, gargs.cache_max_bytes);
     Spacer sp(k, wsz, parse_spacing(spacing.data(), k));
     std::vector<bool> use_filter;
     std::vector<CountingSketch> cms;
@@ -261,8 +347,8 @@ int sketch_main(int argc, char *argv[]) {
         std::fprintf(stderr, "No paths. See usage.\n");
         sketch_usage(*argv);
     }
-    if(!avoid_fsorting)
-        detail::sort_paths_by_fsize(inpaths);
+    if(!avoid_fsorting && !gargs.demux)
+        detail::sort_paths_by_work(inpaths);
     if(sm != EXACT) {
         if(cmsketchsize < 0) {
             cmsketchsize = 20;
@@ -273,10 +359,18 @@ int sketch_main(int argc, char *argv[]) {
         else // BY_FNAME
             for(const auto &path: inpaths) use_filter.emplace_back(fname_is_fq(path));
         while(cms.size() < unsigned(nthreads))
-            cms.emplace_back(cmsketchsize, nhashes, 1.08, (cms.size() ^ seedseedseed) * 1337uL);
+            cms.emplace_back(cmsketchsize, nhashes, (cms.size() ^ seedseedseed) * 1337uL);
     }
     KSeqBufferHolder kseqs(nthreads);
     if(wsz < (int)sp.c_) wsz = sp.c_;
+    if(sketch_types) {
+        const std::vector<SketchSpec> specs = parse_sketch_specs(sketch_types, sketch_size);
+        multi_sketch_core(specs, nthreads, wsz, k, sp, inpaths, suffix, prefix, cms, estim, jestim,
+                          kseqs, use_filter, spacing, skip_cached, canon, mincount, enct);
+        if(gargs.cache) gargs.cache->save();
+        LOG_INFO("Successfully finished sketching %zu types from %zu files\n", specs.size(), inpaths.size());
+        return EXIT_SUCCESS;
+    }
 #define SKETCH_CORE(type) \
     sketch_core<type>(sketch_size, nthreads, wsz, k, sp, inpaths,\
                             suffix, prefix, cms, estim, jestim,\
@@ -296,6 +390,7 @@ int sketch_main(int argc, char *argv[]) {
         }
     }
 #undef SKETCH_CORE
+    if(gargs.cache) gargs.cache->save();
     LOG_INFO("Successfully finished sketching from %zu files\n", inpaths.size());
     return EXIT_SUCCESS;
 }
@@ -16,7 +16,10 @@
 #include "getopt.h"
 #include <sys/stat.h>
 #include "substrs.h"
+#include <x86intrin.h>
 #include "khset64.h"
+#include "countfilter.h"
+#include "arena.h"
 
 #if __cplusplus >= 201703L && __cpp_lib_execution
 #include <execution>
@@ -29,43 +32,46 @@
 #ifndef BUFFER_FLUSH_SIZE
 #define BUFFER_FLUSH_SIZE (1u << 18)
 #endif
-#define CORE_ITER(zomg) do {\
+// Fills dists for ROW (a row index, or a TileBlock of rows) with OP (perform_core_op or perform_tile_op) according to result_type,
+// comparing through arena (an HllArena holding hlls' registers, or null) where comparisons are batched.
+#define CORE_ITER_OP(OP, ROW) do {\
         switch(result_type) {\
             case MASH_DIST: {\
-                perform_core_op(dists, nsketches, hlls, [ksinv](const auto &x, const auto &y) {return dist_index(similarity<const SketchType>(x, y), ksinv);}, i);\
+                OP(dists, nsketches, hlls, make_batched(arena, similarity<const SketchType>, [ksinv](double s) {return dist_index(s, ksinv);}), ROW);\
                 break;\
             }\
             case JI: {\
-            perform_core_op(dists, nsketches, hlls, similarity<const SketchType>, i);\
+            OP(dists, nsketches, hlls, make_batched(arena, similarity<const SketchType>, [](double s) {return s;}), ROW);\
                 break;\
             }\
             case SIZES: {\
-            perform_core_op(dists, nsketches, hlls, us::union_size<SketchType>, i);\
+            OP(dists, nsketches, hlls, us::union_size<SketchType>, ROW);\
                 break;\
             }\
             case FULL_MASH_DIST:\
-                perform_core_op(dists, nsketches, hlls, [ksinv](const auto &x, const auto &y) {return full_dist_index(similarity<const SketchType>(x, y), ksinv);}, i);\
+                OP(dists, nsketches, hlls, make_batched(arena, similarity<const SketchType>, [ksinv](double s) {return full_dist_index(s, ksinv);}), ROW);\
                 break;\
             case SYMMETRIC_CONTAINMENT_DIST:\
-                perform_core_op(dists, nsketches, hlls, [ksinv](const auto &x, const auto &y) { \
+                OP(dists, nsketches, hlls, [ksinv](const auto &x, const auto &y) { \
                     const auto triple = set_triple(x, y);\
                     auto ret = triple[2] / (std::min(triple[0], triple[1]) + triple[2]);\
                     auto di = dist_index(ret, ksinv);\
                     assert(di <= dist_index(triple[2] / (triple[0] + triple[2]), ksinv));\
                     assert(di <= dist_index(triple[2] / (triple[1] + triple[2]), ksinv));\
                     return di;\
-                }, i);\
+                }, ROW);\
                 break;\
             case SYMMETRIC_CONTAINMENT_INDEX:\
-                perform_core_op(dists, nsketches, hlls, [&](const auto &x, const auto &y) {\
+                OP(dists, nsketches, hlls, [&](const auto &x, const auto &y) {\
                     const auto triple = set_triple(x, y);\
                     auto ret = triple[2] / (std::min(triple[0], triple[1]) + triple[2]);\
                     assert(ret >= triple[2] / (std::max(triple[0], triple[1]) + triple[2]) || triple[1] == 0. || triple[0] == 0.);\
                     return ret;\
-                }, i);\
+                }, ROW);\
                 break;\
             default: __builtin_unreachable();\
         } } while(0)
+#define CORE_ITER(zomg) CORE_ITER_OP(perform_core_op, i)
 
 #define LO_ARG(LONG, SHORT) {LONG, required_argument, 0, SHORT},
 #define LO_NO(LONG, SHORT) {LONG, no_argument, 0, SHORT},
@@ -73,7 +79,13 @@
 
 
 namespace bns {
-namespace detail {void sort_paths_by_fsize(std::vector<std::string> &paths);}
+namespace detail {
+// Estimated uncompressed bytes in each input (summed over FNAME_SEP-separated parts); 0 for streams. Estimates are cached.
+size_t estimate_work(const std::string &path);
+std::vector<size_t> estimate_work(const std::vector<std::string> &paths);
+// Orders paths largest-first by estimated work, so that dynamic scheduling approximates longest-processing-time-first.
+void sort_paths_by_work(std::vector<std::string> &paths);
+}
 size_t posix_fsizes(const std::string &path, const char sep=FNAME_SEP);
 using namespace sketch;
 using namespace hll;
@@ -89,7 +101,7 @@ struct SeededHash {
     uint64_t operator()(uint64_t x) const {return wh_(x ^ seed_);}
 };
 
-using CountingSketch = sketch::hk::HeavyKeeper<6, 10, SeededHash<sketch::common::WangHash>>;
+using CountingSketch = CountFilter<SeededHash<sketch::common::WangHash>>;
 template<typename T> INLINE double similarity(const T &a, const T &b) {
     return a.jaccard_index(b);
 }
@@ -98,6 +110,134 @@ template<> INLINE double similarity<CRMFinal>(const CRMFinal &a, const CRMFinal
     return a.histogram_intersection(b);
 }
 
+namespace detail {
+// Histogram of max(a[i], b[i]), i.e., of the registers of the union of two HLLs.
+// Four partial histograms keep runs of equal register values from serializing on one counter.
+inline void union_histogram(const uint8_t *a, const uint8_t *b, size_t n, std::array<uint32_t, 64> &counts) {
+    uint32_t c[4][64]{};
+    size_t i = 0;
+#if __AVX2__
+    for(alignas(32) uint8_t m[32]; i + 32 <= n; i += 32) {
+        _mm256_store_si256(reinterpret_cast<__m256i *>(m), _mm256_max_epu8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)),
+                                                                        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i))));
+        for(unsigned k = 0; k < 32; k += 4)
+            ++c[0][m[k] & 63], ++c[1][m[k + 1] & 63], ++c[2][m[k + 2] & 63], ++c[3][m[k + 3] & 63];
+    }
+#elif __SSE2__
+    for(alignas(16) uint8_t m[16]; i + 16 <= n; i += 16) {
+        _mm_store_si128(reinterpret_cast<__m128i *>(m), _mm_max_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)),
+                                                                  _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i))));
+        for(unsigned k = 0; k < 16; k += 4)
+            ++c[0][m[k] & 63], ++c[1][m[k + 1] & 63], ++c[2][m[k + 2] & 63], ++c[3][m[k + 3] & 63];
+    }
+#endif
+    for(; i < n; ++i) ++c[i & 3][std::max(a[i], b[i]) & 63];
+    for(unsigned r = 0; r < 64; ++r) counts[r] = c[0][r] + c[1][r] + c[2][r] + c[3][r];
+}
+} // namespace detail
+
+/*
+ * One-versus-many similarity: out[j] = pairwise(refs[j], query) for j < n.
+ * The general case just loops, which still saves a call and a dispatch per pair.
+ * Specializations hoist the query's share of the work out of the loop and vectorize the rest.
+ */
+template<typename SketchType>
+struct SimilarityMany {
+    template<typename Pairwise>
+    static void apply(const SketchType &query, const SketchType *refs, size_t n, float *out, const Pairwise &pairwise) {
+        for(size_t j = 0; j < n; ++j) out[j] = pairwise(refs[j], query);
+    }
+};
+namespace detail {
+// Jaccard similarity of two HLLs from their registers and cardinalities, estimating the union as hll_t::union_size does.
+inline double hll_jaccard(const uint8_t *a, double acard, const uint8_t *b, double bcard, size_t m, unsigned p, hll::EstimationMethod estim, double alpha) {
+    std::array<uint32_t, 64> counts;
+    union_histogram(a, b, m, counts);
+    const double us = hll::detail::calculate_estimate(counts, estim, m, p, alpha);
+    return std::max(0., acard + bcard - us) / us;
+}
+} // namespace detail
+
+/*
+ * Registers and cardinality estimates of an array of HLLs, stored struct-of-arrays in one Arena, so that one-versus-many
+ * comparisons stream through contiguous, aligned memory instead of one heap allocation per sketch.
+ * Building it moves each sketch's registers out (the sketches are left empty), so from then on the array must be compared
+ * through the arena, which is passed explicitly to the comparison loops (see similarity_many). Destroying it frees them all at once.
+ */
+class HllArena {
+    size_t n_, m_, stride_;
+    Arena regs_;
+    std::vector<double> cards_;
+    hll::EstimationMethod estim_;
+    unsigned p_;
+    double alpha_;
+public:
+    // All sketches must have the same number of registers and have had their cardinalities computed.
+    HllArena(hll::hll_t *sketches, size_t n, bool huge_pages):
+        n_(n), m_(sketches[0].core().size()), stride_(Arena::stride(m_)), regs_(n * stride_, huge_pages), cards_(n),
+        estim_(sketches[0].get_estim()), p_(sketches[0].p()), alpha_(sketches[0].alpha())
+    {
+        #pragma omp parallel for
+        for(size_t i = 0; i < n; ++i) {
+            std::memcpy(regs_.data() + i * stride_, sketches[i].core().data(), m_);
+            cards_[i] = sketches[i].creport();
+            sketches[i].free();
+        }
+    }
+    HllArena(const HllArena &) = delete;
+    size_t size() const {return n_;}
+    // out[j] = Jaccard similarity of sketches j0 + j and qi, for j < n.
+    void similarity_many(size_t qi, size_t j0, size_t n, float *out) const {
+        assert(qi < n_ && j0 + n <= n_);
+        const uint8_t *const qregs = regs_.data() + qi * stride_;
+        for(size_t j = 0; j < n; ++j)
+            out[j] = detail::hll_jaccard(qregs, cards_[qi], regs_.data() + (j0 + j) * stride_, cards_[j0 + j], m_, p_, estim_, alpha_);
+    }
+};
+
+// Reads the query's registers and cardinality once, then takes each union's register histogram with SIMD max
+// and estimates its size as hll_t::union_size does. The joint MLE needs more than a histogram, so it stays pairwise.
+template<>
+struct SimilarityMany<hll::hll_t> {
+    template<typename Pairwise>
+    static void apply(const hll::hll_t &query, const hll::hll_t *refs, size_t n, float *out, const Pairwise &pairwise) {
+        if(query.get_jestim() == hll::JointEstimationMethod::ERTL_JOINT_MLE) {
+            for(size_t j = 0; j < n; ++j) out[j] = pairwise(refs[j], query);
+            return;
+        }
+        const uint8_t *const qregs = query.core().data();
+        const size_t m = query.core().size();
+        const double qcard = query.creport(), alpha = query.alpha();
+        const auto estim = query.get_estim();
+        const unsigned p = query.p();
+        for(size_t j = 0; j < n; ++j) {
+            if(refs[j].core().size() != m) out[j] = pairwise(refs[j], query); // Let the sketch report the mismatch
+            else out[j] = detail::hll_jaccard(qregs, qcard, refs[j].core().data(), refs[j].creport(), m, p, estim, alpha);
+        }
+    }
+};
+// out[j] = pairwise(hlls[j0 + j], hlls[qi]) for j < n, through SimilarityMany, or through arena when hlls' registers were moved into one.
+template<typename SketchType, typename Pairwise>
+void similarity_many(const HllArena *, const SketchType *hlls, size_t qi, size_t j0, size_t n, float *out, const Pairwise &pairwise) {
+    SimilarityMany<SketchType>::apply(hlls[qi], hlls + j0, n, out, pairwise);
+}
+template<typename Pairwise>
+void similarity_many(const HllArena *arena, const hll::hll_t *hlls, size_t qi, size_t j0, size_t n, float *out, const Pairwise &pairwise) {
+    if(arena) arena->similarity_many(qi, j0, n, out);
+    else      SimilarityMany<hll::hll_t>::apply(hlls[qi], hlls + j0, n, out, pairwise);
+}
+// Number of references per SimilarityMany call when a one-versus-many comparison is split across threads.
+static constexpr size_t SIMILARITY_BATCH = 64;
+template<typename SketchType, typename Pairwise, typename Transform>
+void similarity_many_parallel(const HllArena *arena, const SketchType *hlls, size_t qi, size_t j0, size_t n, float *out, const Pairwise &pairwise, const Transform &transform) {
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t b = 0; b < (n + SIMILARITY_BATCH - 1) / SIMILARITY_BATCH; ++b) {
+        const size_t jb = b * SIMILARITY_BATCH, nj = std::min(SIMILARITY_BATCH, n - jb);
+        similarity_many(arena, hlls, qi, j0 + jb, nj, out + jb, pairwise);
+        for(size_t j = jb; j < jb + nj; ++j) out[j] = transform(out[j]);
+    }
+}
+
 template<typename T>
 inline void sketch_finalize(T &x) {}
 template<> inline void sketch_finalize<khset64_t>(khset64_t &x) {x.cvt2shs();}
@@ -179,6 +319,64 @@ INLINE void perform_core_op(T &dists, size_t nhlls, SketchType *hlls, const Func
     h1.free();
 }
 
+// A similarity-based comparison which can run one-versus-many (see similarity_many): transform(similarity), with pairwise as the fallback,
+// reading registers from arena if the sketches' registers were moved into one.
+template<typename Pairwise, typename Transform>
+struct BatchedOp {
+    const HllArena *arena;
+    Pairwise pairwise;
+    Transform transform;
+};
+template<typename Pairwise, typename Transform>
+BatchedOp<Pairwise, Transform> make_batched(const HllArena *arena, Pairwise pairwise, Transform transform) {return {arena, pairwise, transform};}
+template<typename SketchType, typename T, typename Pairwise, typename Transform>
+INLINE void perform_core_op(T &dists, size_t nhlls, SketchType *hlls, const BatchedOp<Pairwise, Transform> &op, size_t i) {
+    if(i + 1 < nhlls) similarity_many_parallel(op.arena, hlls, i, i + 1, nhlls - i - 1, &dists[0], op.pairwise, op.transform);
+    hlls[i].free();
+}
+
+// Rows [i0, i1) of an all-pairs comparison, compared against columns cols at a time.
+struct TileBlock {
+    size_t i0, i1, cols;
+};
+/*
+ * Fills rows[i - i0][j - i - 1] for every row i in [i0, i1) and column j > i.
+ * Work is split into tiles of block.cols columns, and each tile is compared against every row in the block,
+ * so a column sketch is brought into cache once per row block rather than once per row.
+ * Rows are freed afterwards, as in perform_core_op.
+ */
+template<typename SketchType, typename T, typename Func>
+INLINE void perform_tile_op(T &rows, size_t nhlls, SketchType *hlls, const Func &func, const TileBlock &block) {
+    const size_t jstart = block.i0 + 1, ntiles = jstart < nhlls ? (nhlls - jstart + block.cols - 1) / block.cols: 0;
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t t = 0; t < ntiles; ++t) {
+        const size_t j0 = jstart + t * block.cols, j1 = std::min(j0 + block.cols, nhlls);
+        for(size_t i = block.i0; i < block.i1; ++i) {
+            auto &h1 = hlls[i];
+            auto *dists = &rows[i - block.i0][0];
+            for(size_t j = std::max(j0, i + 1); j < j1; ++j)
+                dists[j - i - 1] = func(hlls[j], h1);
+        }
+    }
+    for(size_t i = block.i0; i < block.i1; ++i) hlls[i].free();
+}
+template<typename SketchType, typename T, typename Pairwise, typename Transform>
+INLINE void perform_tile_op(T &rows, size_t nhlls, SketchType *hlls, const BatchedOp<Pairwise, Transform> &op, const TileBlock &block) {
+    const size_t jstart = block.i0 + 1, ntiles = jstart < nhlls ? (nhlls - jstart + block.cols - 1) / block.cols: 0;
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t t = 0; t < ntiles; ++t) {
+        const size_t j0 = jstart + t * block.cols, j1 = std::min(j0 + block.cols, nhlls);
+        for(size_t i = block.i0; i < block.i1; ++i) {
+            const size_t jlo = std::max(j0, i + 1);
+            if(jlo >= j1) continue;
+            float *dists = &rows[i - block.i0][jlo - i - 1];
+            similarity_many(op.arena, hlls, i, jlo, j1 - jlo, dists, op.pairwise);
+            for(size_t j = 0; j < j1 - jlo; ++j) dists[j] = op.transform(dists[j]);
+        }
+    }
+    for(size_t i = block.i0; i < block.i1; ++i) hlls[i].free();
+}
+
 static int flatten_all(const std::vector<std::string> &fpaths, size_t nk, const std::string outpath) {
     std::vector<dm::DistanceMatrix<float>> dms;
     dms.reserve(nk);
@@ -246,12 +444,54 @@ enum sketching_method: int {
 };
 
 
+class SketchPack;
+class SketchCache;
 struct GlobalArgs {
     size_t weighted_jaccard_cmsize = 22;
     size_t weighted_jaccard_nhashes = 8;
     uint32_t bbnbits = 16;
+    bool split_files = false;
+    unsigned io_threads = 0;
+    unsigned compute_threads = 0;
+    // Demultiplexing: route records to per-sample sketches by a field of each read name (or comment).
+    bool demux = false;
+    bool demux_comment = false;
+    int demux_field = 0;
+    std::string demux_delim = "_";
+    // All-pairs tiling: cache budget for a tile of row and column sketches (0 compares a row at a time), and bytes per sketch.
+    size_t tile_cache_bytes = size_t(1) << 20;
+    size_t sketch_bytes = 0;
+    // Back comparison arenas (see HllArena) with huge pages.
+    bool huge_pages = false;
+    // Emit only each row's topk nearest neighbours instead of the full matrix (0 emits the matrix).
+    size_t topk = 0;
+    // Emit only pairs at or beyond edge_threshold (--min-similarity or --max-dist) as an edge list.
+    bool edges = false;
+    float edge_threshold = 0;
+    // Find pairs with at least this Jaccard similarity by LSH banding (0 compares all pairs).
+    float lsh_threshold = 0;
+    // Compute only shard `shard` of `nshards` of the all-pairs matrix (nshards == 0 computes all of it).
+    unsigned shard = 0, nshards = 0;
+    // Extend the binary matrix at extend_matrix, whose extend_nold inputs come first, rather than computing all pairs.
+    std::string extend_matrix;
+    size_t extend_nold = 0;
+    // Sketch, compare and emit queries this many at a time after sketching the references (0 sketches every input first).
+    size_t query_window = 0;
+    // Compute all pairs within this many bytes of sketches and rows, spilling sketches to a file in scratch_dir (0 keeps every sketch in memory).
+    size_t memory_budget = 0;
+    std::string scratch_dir;
+    // Presketched inputs read from sketch packs: the pack and index of each input's sketch (null for sketch files); empty if none.
+    std::vector<std::pair<std::shared_ptr<SketchPack>, size_t>> packed;
+    // Keep and find sketches in a directory by fingerprint of input and parameters (see SketchCache), evicting beyond cache_max_bytes (0 never evicts).
+    std::string cache_dir;
+    size_t cache_max_bytes = 0;
+    std::shared_ptr<SketchCache> cache;
+    // Single-pass multi-k (mkdist --multik): k-mer lengths, the distance matrix path for each, and the window size as given (0 if unset).
+    std::vector<unsigned> multik;
+    std::vector<std::string> multik_paths;
+    unsigned multik_window = 0;
 };
-static GlobalArgs gargs;
+extern GlobalArgs gargs;
 enum EmissionType {
     MASH_DIST = 0,
     JI        = 1,
@@ -346,6 +586,10 @@ static constexpr bool is_symmetric(EmissionType result_type) {
     }
     return false;
 }
+// Whether larger values of result_type mean more similar inputs: true for indices, false for distances (and sizes).
+static constexpr bool is_similarity(EmissionType result_type) {
+    return result_type == JI || result_type == CONTAINMENT_INDEX || result_type == SYMMETRIC_CONTAINMENT_INDEX;
+}
 
 enum EncodingType {
     BONSAI,
@@ -418,6 +662,9 @@ template<> inline double cardinality_estimate(mh::FinalDivBBitMinHash &x) {retur
 //extern template double cardinality_estimate(mh::FinalBBitMinHash &x);
 //extern template double cardinality_estimate(mh::FinalDivBBitMinHash &x);
 
+// "-" reads from standard input.
+static inline bool is_stdin_path(const char *path) {return path[0] == '-' && path[1] == '\0';}
+
 template<typename SketchType>
 static inline std::string make_fname(const char *path, size_t sketch_p, int wsz, int k, int csz, const std::string &spacing,
                        const std::string &suffix="", const std::string &prefix="",
@@ -427,11 +674,12 @@ static inline std::string make_fname(const char *path, size_t sketch_p, int wsz,
     {
         const char *p, *p2;
 		p = (p = std::strchr(path, FNAME_SEP)) ? p + 1: path;
+        if(is_stdin_path(p)) p = "stdin";
         if(ret.size() && (p2 = strrchr(p, '/'))) ret += std::string(p2 + 1);
         else                                     ret += p;
     }
     ret += ".w";
-    ret + std::to_string(std::max(csz, wsz));
+    if(wsz > csz) ret += std::to_string(wsz); // Unwindowed sketches keep their names from when the window was never written
     ret += ".";
     ret += std::to_string(k);
     ret += ".spacing";
@@ -471,9 +719,72 @@ template<> INLINE double union_size<mh::FinalBBitMinHash> (const mh::FinalBBitMi
 //    return (a.est_cardinality_ + b.est_cardinality_ ) / (1. + a.jaccard_index(b));
 //}
 } // namespace us
+// Fills out[j] with the comparison of reference j (in [0, nr)) against query hlls[qi], according to result_type,
+// through arena if hlls' registers were moved into one (else null).
+template<typename SketchType>
+void fill_query_row(SketchType *hlls, size_t nr, size_t qi, EmissionType result_type, float ksinv, float *out, const HllArena *arena) {
+    switch(result_type) {
+#define dist_sim(x, y) dist_index(similarity(x, y), ksinv)
+#define fulldist_sim(x, y) full_dist_index(similarity(x, y), ksinv)
+#define fullcont_sim(x, y) full_containment_dist(containment_index(x, y), ksinv)
+#define cont_sim(x, y) containment_dist(containment_index(x, y), ksinv)
+#define DO_LOOP(func)\
+            for(size_t j = 0; j < nr; ++j) {\
+                out[j] = func(hlls[j], hlls[qi]);\
+            }
+#define DO_BATCHED(transform) \
+            similarity_many_parallel(arena, hlls, qi, 0, nr, out, [](const auto &x, const auto &y) {return similarity(x, y);}, transform)
+        case MASH_DIST:
+            DO_BATCHED([ksinv](double s) {return dist_index(s, ksinv);});
+            break;
+        case FULL_MASH_DIST:
+            DO_BATCHED([ksinv](double s) {return full_dist_index(s, ksinv);});
+            break;
+        case JI:
+            DO_BATCHED([](double s) {return s;});
+            break;
+        case SIZES:
+            #pragma omp parallel for schedule(dynamic)
+            DO_LOOP(us::union_size);
+            break;
+        case CONTAINMENT_INDEX:
+            #pragma omp parallel for schedule(dynamic)
+            DO_LOOP(containment_index);
+            break;
+        case CONTAINMENT_DIST:
+            #pragma omp parallel for schedule(dynamic)
+            DO_LOOP(cont_sim);
+            break;
+        case FULL_CONTAINMENT_DIST:
+            #pragma omp parallel for schedule(dynamic)
+            DO_LOOP(fullcont_sim);
+            break;
+        case SYMMETRIC_CONTAINMENT_INDEX:
+            #pragma omp parallel for schedule(dynamic)
+            for(size_t j = 0; j < nr; ++j) {
+                auto tmp = set_triple(hlls[j], hlls[qi]);
+                out[j] = tmp[2] / (std::min(tmp[0], tmp[1]) + tmp[2]);
+            }
+            break;
+        case SYMMETRIC_CONTAINMENT_DIST:
+            #pragma omp parallel for schedule(dynamic)
+            for(size_t j = 0; j < nr; ++j) {
+                auto tmp = set_triple(hlls[j], hlls[qi]);
+                out[j] = dist_index(tmp[2] / (std::min(tmp[0], tmp[1]) + tmp[2]), ksinv);
+            }
+            break;
+        default: throw std::runtime_error("Value not found");
+#undef DO_LOOP
+#undef DO_BATCHED
+#undef dist_sim
+#undef cont_sim
+#undef fulldist_sim
+#undef fullcont_sim
+    }
+}
 template<typename SketchType>
 void partdist_loop(std::FILE *ofp, SketchType *hlls, const std::vector<std::string> &inpaths, const bool use_scientific, const unsigned k, const EmissionType result_type, EmissionFormat emit_fmt, int nthreads, const size_t buffer_flush_size,
-                   size_t nq)
+                   size_t nq, const HllArena *arena)
 {
     const float ksinv = 1./ k;
     if(nq >= inpaths.size()) {
@@ -490,68 +801,11 @@ void partdist_loop(std::FILE *ofp, SketchType *hlls, const std::vector<std::stri
     for(auto &b: buffers) b.resize(4 * nr);
     for(size_t qi = nr; qi < inpaths.size(); ++qi) {
         size_t qind =  qi - nr;
-        switch(result_type) {
-#define dist_sim(x, y) dist_index(similarity(x, y), ksinv)
-#define fulldist_sim(x, y) full_dist_index(similarity(x, y), ksinv)
-#define fullcont_sim(x, y) full_containment_dist(containment_index(x, y), ksinv)
-#define cont_sim(x, y) containment_dist(containment_index(x, y), ksinv)
-#define DO_LOOP(func)\
-                for(size_t j = 0; j < nr; ++j) {\
-                    arr[qind * nr + j] = func(hlls[j], hlls[qi]);\
-                }
-            case MASH_DIST:
-                #pragma omp parallel for schedule(dynamic)
-                DO_LOOP(dist_sim);
-                break;
-            case FULL_MASH_DIST:
-                #pragma omp parallel for schedule(dynamic)
-                DO_LOOP(fulldist_sim);
-                break;
-            case JI:
-                #pragma omp parallel for schedule(dynamic)
-                DO_LOOP(similarity);
-                break;
-            case SIZES:
-                #pragma omp parallel for schedule(dynamic)
-                DO_LOOP(us::union_size);
-                break;
-            case CONTAINMENT_INDEX:
-                #pragma omp parallel for schedule(dynamic)
-                DO_LOOP(containment_index);
-                break;
-            case CONTAINMENT_DIST:
-                #pragma omp parallel for schedule(dynamic)
-                DO_LOOP(cont_sim);
-                break;
-            case FULL_CONTAINMENT_DIST:
-                #pragma omp parallel for schedule(dynamic)
-                DO_LOOP(fullcont_sim);
-                break;
-            case SYMMETRIC_CONTAINMENT_INDEX:
-                #pragma omp parallel for schedule(dynamic)
-                for(size_t j = 0; j < nr; ++j) {
-                    auto tmp = set_triple(hlls[j], hlls[qi]);
-                    arr[qind * nr + j] = tmp[2] / (std::min(tmp[0], tmp[1]) + tmp[2]);
-                }
-                break;
-            case SYMMETRIC_CONTAINMENT_DIST:
-                #pragma omp parallel for schedule(dynamic)
-                for(size_t j = 0; j < nr; ++j) {
-                    auto tmp = set_triple(hlls[j], hlls[qi]);
-                    arr[qind * nr + j] = dist_index(tmp[2] / (std::min(tmp[0], tmp[1]) + tmp[2]), ksinv);
-                }
-                break;
-            default: throw std::runtime_error("Value not found");
-#undef DO_LOOP
-#undef dist_sim
-#undef cont_sim
-#undef fulldist_sim
-#undef fullcont_sim
-        }
+        fill_query_row(hlls, nr, qi, result_type, ksinv, arr + qind * nr, arena);
         switch(emit_fmt) {
             case BINARY:
                 if(write_future.valid()) write_future.get();
-                write_future = std::async(std::launch::async, [ptr=arr + (qi - nr) * nq, nb=sizeof(float) * nr](const int fn) {
+                write_future = std::async(std::launch::async, [ptr=arr + (qi - nr) * nr, nb=sizeof(float) * nr](const int fn) {
                     if(unlikely(::write(fn, ptr, nb) != ssize_t(nb))) RUNTIME_ERROR("Error writing to binary file");
                 }, ::fileno(ofp));
                 break;
@@ -603,6 +857,8 @@ int hll_main(int argc, char *argv[]);
 int union_main(int argc, char *argv[]);
 int view_main(int argc, char *argv[]);
 int dt_print_main(int argc, char *argv[]);
+int merge_shards_main(int argc, char *argv[]);
+int pack_main(int argc, char *argv[]);
 }
 
 #endif /* DASHING_H__ */
@@ -1,5 +1,7 @@
 #include "dashing.h"
 #include "sketch_and_cmp.h"
+#include <fstream>
+#include <unordered_set>
 
 namespace bns {
 #define DISTEXT(sketchtype) \
@@ -84,6 +86,22 @@ static option_struct dist_long_options[] = {\
     LO_ARG("wj-cm-sketch-size", 140)\
     LO_ARG("wj-cm-nhashes", 141)\
     LO_FLAG("wj", 142, weighted_jaccard, true)\
+    LO_FLAG("split-files", 143, split_files, true)\
+    LO_ARG("io-threads", 144)\
+    LO_ARG("compute-threads", 145)\
+    LO_ARG("tile-cache", 146)\
+    LO_FLAG("huge-pages", 147, huge_pages, true)\
+    LO_ARG("topk", 148)\
+    LO_ARG("min-similarity", 149)\
+    LO_ARG("max-dist", 150)\
+    LO_ARG("lsh-threshold", 151)\
+    LO_ARG("shard", 152)\
+    LO_ARG("extend-matrix", 153)\
+    LO_ARG("stream-queries", 154)\
+    LO_ARG("memory-budget", 155)\
+    LO_ARG("scratch-dir", 156)\
+    LO_ARG("cache-dir", 157)\
+    LO_ARG("cache-max-bytes", 158)\
     {0,0,0,0}\
 };
 
@@ -91,7 +109,8 @@ int dist_main(int argc, char *argv[]) {
     int wsz(0), k(31), sketch_size(10), use_scientific(false), co, cache_sketch(false),
         nthreads(1), mincount(5), nhashes(4), cmsketchsize(-1);
     int canon(true), presketched_only(false), entropy_minimization(false),
-         avoid_fsorting(false), weighted_jaccard(false);
+         avoid_fsorting(false), weighted_jaccard(false), split_files(false), huge_pages(false);
+    bool threshold_is_similarity = false;
     Sketch sketch_type = HLL;
          // bool sketch_query_by_seq(true);
     EmissionFormat emit_fmt = UT_TSV;
@@ -99,7 +118,7 @@ int dist_main(int argc, char *argv[]) {
     EmissionType result_type(JI);
     hll::EstimationMethod estim = hll::EstimationMethod::ERTL_MLE;
     hll::JointEstimationMethod jestim = static_cast<hll::JointEstimationMethod>(hll::EstimationMethod::ERTL_MLE);
-    std::string spacing, paths_file, suffix, prefix, pairofp_labels, pairofp_path;
+    std::string spacing, paths_file, suffix, prefix, pairofp_path;
     FILE *ofp(stdout), *pairofp(stdout);
     sketching_method sm = EXACT;
     std::vector<std::string> querypaths;
@@ -138,15 +157,24 @@ int dist_main(int argc, char *argv[]) {
             case 'w': wsz      = std::atoi(optarg);         break;
             case 'W': cache_sketch = true; break;
             case 'x': suffix   = optarg;                 break;
-            case 'O': if((pairofp = fopen(optarg, "wb")) == nullptr)
-                          LOG_EXIT("Could not open file at %s for writing.\n", optarg);
-                      pairofp_labels = std::string(optarg) + ".labels";
-                      pairofp_path = optarg;
-                      break;
+            case 'O': pairofp_path = optarg; break; // Opened once options are checked, so that a rejected run leaves it untouched
             case 140:
                 gargs.weighted_jaccard_cmsize  = std::atoi(optarg); weighted_jaccard = true; break;
             case 141:
                 gargs.weighted_jaccard_nhashes = std::atoi(optarg); weighted_jaccard = true; break;
+            case 144: gargs.io_threads = std::atoi(optarg); break;
+            case 145: gargs.compute_threads = std::atoi(optarg); break;
+            case 146: gargs.tile_cache_bytes = std::strtoull(optarg, nullptr, 10); break;
+            case 148: gargs.topk = std::strtoull(optarg, nullptr, 10); break;
+            case 151: gargs.lsh_threshold = std::atof(optarg); break;
+            case 152: std::tie(gargs.shard, gargs.nshards) = parse_shard_spec(optarg); break;
+            case 153: gargs.extend_matrix = optarg; break;
+            case 154: gargs.query_window = std::strtoull(optarg, nullptr, 10); break;
+            case 155: gargs.memory_budget = std::strtoull(optarg, nullptr, 10); break;
+            case 156: gargs.scratch_dir = optarg; break;
+            case 157: gargs.cache_dir = optarg; cache_sketch = true; break;
+            case 158: gargs.cache_max_bytes = std::strtoull(optarg, nullptr, 10); break;
+            case 149: case 150: gargs.edges = true; gargs.edge_threshold = std::atof(optarg); threshold_is_similarity = co == 149; break;
             case 'h': case '?': dist_usage(*argv);
         }
     }
@@ -154,13 +182,62 @@ int dist_main(int argc, char *argv[]) {
         RUNTIME_ERROR("k must be <= 32 for non-rolling hashes.");
     if(k > 32 && spacing.size())
         RUNTIME_ERROR("kmers must be unspaced for k > 32");
+    if(gargs.multik.size()) {
+        if(enct == BONSAI && *std::max_element(gargs.multik.begin(), gargs.multik.end()) > 32)
+            RUNTIME_ERROR("k must be <= 32 for non-rolling hashes.");
+        if(presketched_only || cache_sketch || sm != EXACT || spacing.size())
+            RUNTIME_ERROR("Sketching several k-mer lengths at once does not support presketched or cached sketches, count-min filtering, or spacing.");
+        if(gargs.topk || gargs.edges || gargs.lsh_threshold > 0)
+            RUNTIME_ERROR("--multik writes a full matrix per k for flattening, and cannot be combined with --topk, --min-similarity, --max-dist or --lsh-threshold.");
+    }
+    if(gargs.topk && result_type == SIZES)
+        RUNTIME_ERROR("--topk ranks neighbours by a similarity or distance, not by union size.");
+    if(gargs.nshards && (gargs.topk || gargs.edges || gargs.lsh_threshold > 0 || gargs.multik.size() || querypaths.size()))
+        RUNTIME_ERROR("--shard writes part of the full all-pairs matrix, and cannot be combined with queries, --topk, --min-similarity, --max-dist, --lsh-threshold or --multik.");
+    if(gargs.lsh_threshold > 0) {
+        if(gargs.lsh_threshold > 1) RUNTIME_ERROR("--lsh-threshold is a Jaccard similarity, in (0, 1].");
+        if(gargs.topk || gargs.edges) RUNTIME_ERROR("--lsh-threshold cannot be combined with --topk, --min-similarity or --max-dist.");
+    }
+    if(gargs.edges) {
+        if(gargs.topk) RUNTIME_ERROR("--topk and --min-similarity/--max-dist are mutually exclusive.");
+        if(result_type == SIZES || threshold_is_similarity != is_similarity(result_type))
+            RUNTIME_ERROR(std::string(threshold_is_similarity ? "--min-similarity applies to similarities": "--max-dist applies to distances") + ", not " + emt2str(result_type) + ".");
+    }
+    if(gargs.extend_matrix.size()) {
+        if(gargs.nshards || gargs.topk || gargs.edges || gargs.lsh_threshold > 0 || gargs.multik.size() || querypaths.size() || !is_symmetric(result_type))
+            RUNTIME_ERROR("--extend-matrix extends a full symmetric all-pairs matrix, and cannot be combined with queries, --shard, --topk, --min-similarity, --max-dist, --lsh-threshold or --multik.");
+        if(emit_fmt != BINARY) RUNTIME_ERROR("--extend-matrix extends a binary matrix into one of the same format, so it requires -b.");
+    }
+    if(gargs.query_window) {
+        if(querypaths.empty() || gargs.topk || gargs.edges || gargs.lsh_threshold > 0 || gargs.multik.size())
+            RUNTIME_ERROR("--stream-queries streams queries (-Q) against the references, and cannot be combined with --topk, --min-similarity, --max-dist, --lsh-threshold or --multik.");
+    }
+    if(gargs.memory_budget) {
+        if(gargs.nshards || gargs.topk || gargs.edges || gargs.lsh_threshold > 0 || gargs.multik.size() || gargs.extend_matrix.size() || querypaths.size() || !is_symmetric(result_type))
+            RUNTIME_ERROR("--memory-budget computes the full symmetric all-pairs matrix, and cannot be combined with queries, --shard, --topk, --min-similarity, --max-dist, --lsh-threshold, --extend-matrix or --multik.");
+    }
+    if(pairofp_path.size()) {
+        struct stat outst, oldst;
+        if(gargs.extend_matrix.size() && ::stat(pairofp_path.data(), &outst) == 0 && ::stat(gargs.extend_matrix.data(), &oldst) == 0
+           && outst.st_dev == oldst.st_dev && outst.st_ino == oldst.st_ino)
+            RUNTIME_ERROR("-O " + pairofp_path + " is the matrix being extended, which writing would destroy; give -O a different path.");
+        if((pairofp = fopen(pairofp_path.data(), "wb")) == nullptr)
+            LOG_EXIT("Could not open file at %s for writing.\n", pairofp_path.data());
+    }
+    if(gargs.cache_max_bytes && gargs.cache_dir.empty())
+        RUNTIME_ERROR("--cache-max-bytes bounds the sketch cache, which requires --cache-dir.");
     if(nthreads < 0) nthreads = 1;
+    gargs.split_files = split_files;
+    gargs.huge_pages = huge_pages;
+    if(gargs.cache_dir.size() && !presketched_only) gargs.cache = std::make_shared<SketchCache>(gargs.cache_dir, gargs.cache_max_bytes);
     std::vector<std::string> inpaths(paths_file.size() ? get_paths(paths_file.data())
                                                        : std::vector<std::string>(argv + optind, argv + argc));
     if(inpaths.empty())
         std::fprintf(stderr, "No paths. See usage.\n"), dist_usage(*argv);
     omp_set_num_threads(nthreads);
     Spacer sp(k, wsz, parse_spacing(spacing.data(), k));
+    gargs.multik_window = wsz; // sp's window is at least k, so each k's spacer is built from the window as given
+    gargs.sketch_bytes = size_t(1) << sketch_size;
     size_t nq = querypaths.size();
     if(nq == 0 && !is_symmetric(result_type)) {
         querypaths = inpaths;
@@ -168,9 +245,25 @@ int dist_main(int argc, char *argv[]) {
         LOG_WARNING("Note: No query files provided, but an asymmetric distance was requested. Switching to a query/reference format with all references as queries.\n"
                     "In the future, this will throw an error.\nYou must provide query and reference paths (-Q/-F) to calculate asymmetric distances.\n");
     }
-    if(!presketched_only && !avoid_fsorting) {
-        detail::sort_paths_by_fsize(inpaths);
-        detail::sort_paths_by_fsize(querypaths);
+    // Shards must agree on the order of inputs, so it is left as given.
+    if(!presketched_only && !avoid_fsorting && !gargs.nshards) {
+        detail::sort_paths_by_work(inpaths);
+        detail::sort_paths_by_work(querypaths);
+    }
+    if(gargs.extend_matrix.size()) {
+        // The existing matrix's inputs come first, in their original order; only the new ones (sorted or not) follow.
+        std::vector<std::string> old = get_paths((gargs.extend_matrix + ".labels").data());
+        std::ifstream typefile(gargs.extend_matrix + ".result_type");
+        std::string oldtype;
+        if(!std::getline(typefile, oldtype))
+            LOG_WARNING("%s.result_type is missing, so %s cannot be checked to hold %s values.\n", gargs.extend_matrix.data(), gargs.extend_matrix.data(), emt2str(result_type));
+        else if(oldtype != emt2str(result_type))
+            RUNTIME_ERROR(gargs.extend_matrix + " holds " + oldtype + " values, not " + emt2str(result_type) + ".");
+        const std::unordered_set<std::string> oldset(old.begin(), old.end());
+        for(const auto &path: inpaths)
+            if(oldset.count(path)) LOG_WARNING("%s is already in %s, and will be compared again as a new input.\n", path.data(), gargs.extend_matrix.data());
+        gargs.extend_nold = old.size();
+        inpaths.insert(inpaths.begin(), std::make_move_iterator(old.begin()), std::make_move_iterator(old.end()));
     }
     inpaths.reserve(inpaths.size() + querypaths.size());
     for(auto &p: querypaths)
@@ -179,6 +272,23 @@ int dist_main(int argc, char *argv[]) {
         decltype(querypaths) tmp;
         std::swap(tmp, querypaths);
     }
+    if(presketched_only) {
+        gargs.packed = expand_packs(inpaths, nq);
+        std::unordered_set<const SketchPack *> checked;
+        for(const auto &member: gargs.packed) {
+            const SketchPack *pack = member.first.get();
+            if(pack == nullptr || !checked.insert(pack).second) continue;
+            const PackHeader &h = pack->header();
+            if(h.sketch_type != sketch_type)
+                RUNTIME_ERROR(pack->path() + " holds " + sketch_names[h.sketch_type] + " sketches, not " + sketch_names[sketch_type] + ".");
+            if(int(h.k) != k)
+                RUNTIME_ERROR(ks::sprintf("%s was sketched with k = %u, but -k is %d.", pack->path().data(), h.k, k).data());
+            if(h.w != sp.w_ || pack->spacing() != spacing || h.encoding != unsigned(enct))
+                LOG_WARNING("%s was sketched with a different window size, spacing or encoding than given to dist.\n", pack->path().data());
+        }
+    } else if(std::any_of(inpaths.begin(), inpaths.end(), SketchPack::is_pack_path)) {
+        RUNTIME_ERROR(std::string("Inputs ending in ") + PACK_SUFFIX + " are sketch packs, which require --presketched.");
+    }
     std::vector<CountingSketch> cms;
     KSeqBufferHolder kseqs(nthreads);
     switch(sm) {
@@ -189,7 +299,7 @@ int dist_main(int argc, char *argv[]) {
             }
             cms.reserve(nthreads);
             while(cms.size() < static_cast<unsigned>(nthreads))
-                cms.emplace_back(cmsketchsize, nhashes, 1.08, (cms.size() ^ seedseedseed) * 1337uL);
+                cms.emplace_back(cmsketchsize, nhashes, (cms.size() ^ seedseedseed) * 1337uL);
             break;
         }
         case EXACT: default: break;
@@ -222,16 +332,26 @@ int dist_main(int argc, char *argv[]) {
                 RUNTIME_ERROR(buf);
         }
     }
+    if(gargs.cache) gargs.cache->save();
 
     std::future<void> label_future;
     if(emit_fmt == BINARY) {
-        if(pairofp_labels.empty()) pairofp_labels = "unspecified";
-        label_future = std::async(std::launch::async, [&inpaths](const std::string &labels) {
-            std::FILE *fp = std::fopen(labels.data(), "wb");
-            if(fp == nullptr) RUNTIME_ERROR(std::string("Could not open file at ") + labels);
-            for(const auto &path: inpaths) std::fwrite(path.data(), path.size(), 1, fp), std::fputc('\n', fp);
-            std::fclose(fp);
-        }, pairofp_labels);
+        // Beside each binary matrix, its labels and its result type (which --extend-matrix checks).
+        std::vector<std::string> matrices(gargs.multik_paths);
+        if(matrices.empty()) matrices.push_back(pairofp_path); // Empty for stdout, whose labels go to "unspecified"
+        label_future = std::async(std::launch::async, [&inpaths,result_type](const std::vector<std::string> &matrices) {
+            for(const auto &matrix: matrices) {
+                const std::string label = matrix.empty() ? std::string("unspecified"): matrix + ".labels";
+                std::FILE *fp = std::fopen(label.data(), "wb");
+                if(fp == nullptr) RUNTIME_ERROR(std::string("Could not open file at ") + label);
+                for(const auto &path: inpaths) std::fwrite(path.data(), path.size(), 1, fp), std::fputc('\n', fp);
+                std::fclose(fp);
+                if(matrix.empty()) continue;
+                if((fp = std::fopen((matrix + ".result_type").data(), "w")) == nullptr) RUNTIME_ERROR(std::string("Could not open file at ") + matrix + ".result_type");
+                std::fprintf(fp, "%s\n", emt2str(result_type));
+                std::fclose(fp);
+            }
+        }, std::move(matrices));
     }
     if(pairofp != stdout) std::fclose(pairofp);
     if(label_future.valid()) label_future.get();
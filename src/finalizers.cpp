@@ -1,28 +1,69 @@
 #include "dashing.h"
+#include <mutex>
+#include <unordered_map>
 
 namespace bns {
 //template<> void sketch_finalize<khset64_t>(khset64_t &x) {x.cvt2shs();}
 namespace detail {
-void sort_paths_by_fsize(std::vector<std::string> &paths) {
-    if(paths.size() < 2) return;
-    uint32_t *fsizes = static_cast<uint32_t *>(std::malloc(paths.size() * sizeof(uint32_t)));
-    if(!fsizes) throw std::bad_alloc();
-    #pragma omp parallel for
+static constexpr size_t WORK_SAMPLE_BYTES = 1 << 20;
+
+// Uncompressed bytes in one file. For compressed files, the first WORK_SAMPLE_BYTES are inflated,
+// and the compression ratio observed there is applied to the whole file.
+static size_t estimate_file_work(const char *path) {
+    struct stat st;
+    if(::stat(path, &st) || !S_ISREG(st.st_mode)) return 0; // Streams can't be read ahead.
+    size_t ret = st.st_size;
+    gzFile fp = gzopen(path, "rb");
+    if(fp == nullptr) return ret;
+    if(!gzdirect(fp)) {
+        std::vector<char> buf(WORK_SAMPLE_BYTES);
+        const int nread = gzread(fp, buf.data(), buf.size());
+        const z_off_t consumed = gzoffset(fp);
+        if(nread >= 0 && size_t(nread) < buf.size()) ret = nread; // Inflated it all
+        else if(nread > 0 && consumed > 0) ret = double(nread) / consumed * st.st_size;
+    }
+    gzclose(fp);
+    return ret;
+}
+
+size_t estimate_work(const std::string &path) {
+    static std::unordered_map<std::string, size_t> cache;
+    static std::mutex mut;
+    {
+        std::lock_guard<std::mutex> lock(mut);
+        auto it = cache.find(path);
+        if(it != cache.end()) return it->second;
+    }
+    size_t ret = 0;
+    for_each_substr([&ret](const char *s) {ret += estimate_file_work(s);}, path, FNAME_SEP);
+    std::lock_guard<std::mutex> lock(mut);
+    cache.emplace(path, ret);
+    return ret;
+}
+
+std::vector<size_t> estimate_work(const std::vector<std::string> &paths) {
+    std::vector<size_t> ret(paths.size());
+    #pragma omp parallel for schedule(dynamic)
     for(size_t i = 0; i < paths.size(); ++i)
-        fsizes[i] = posix_fsizes(paths[i].data());
+        ret[i] = estimate_work(paths[i]);
+    return ret;
+}
+
+void sort_paths_by_work(std::vector<std::string> &paths) {
+    if(paths.size() < 2) return;
+    const std::vector<size_t> work = estimate_work(paths);
     std::vector<path_size> ps(paths.size());
     #pragma omp parallel for
     for(size_t i = 0; i < paths.size(); ++i)
-        ps[i] = path_size(paths[i], fsizes[i]);
-    std::free(fsizes);
-    std::sort(ps.begin(), ps.end(), [](const auto &x, const auto &y) {return x.size > y.size;});
+        ps[i] = path_size(paths[i], work[i]);
+    std::stable_sort(ps.begin(), ps.end(), [](const auto &x, const auto &y) {return x.size > y.size;});
     paths.clear();
-    for(const auto &p: ps) paths.emplace_back(std::move(p.path));
+    for(auto &p: ps) paths.emplace_back(std::move(p.path));
 }
 } // detail
 size_t posix_fsizes(const std::string &path, const char sep) {
     size_t ret = 0;
-    for_each_substr([&ret](const char *s) {struct stat st; ::stat(s, &st); ret += st.st_size;}, path, sep);
+    for_each_substr([&ret](const char *s) {struct stat st; if(::stat(s, &st) == 0) ret += st.st_size;}, path, sep);
     return ret;
 }
 
@@ -0,0 +1,676 @@
+#pragma once
+#include "dashing.h"
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <cctype>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef SPLIT_BATCH_BASES
+#define SPLIT_BATCH_BASES (1u << 20)
+#endif
+
+namespace bns {
+
+// Streams (standard input, named pipes, process substitution) can only be read once, front to back.
+inline bool is_stream_path(const char *path) {
+    struct stat st;
+    return is_stdin_path(path) || (::stat(path, &st) == 0 && !S_ISREG(st.st_mode));
+}
+// gzopen, with "-" opening standard input. Plain text passes through zlib unchanged.
+inline gzFile gzopen_input(const char *path) {
+    return is_stdin_path(path) ? gzdopen(::dup(STDIN_FILENO), "rb"): gzopen(path, "rb");
+}
+
+/*
+ * Returns field `field` of s split at any character in delims, counting back from the last field if negative,
+ * as a pointer and length. The length is 0 if there is no such field.
+ * For example, field 0 of "sampleA_read17" with delimiter '_' is "sampleA", and field -1 of the Illumina
+ * comment "1:N:0:ACGTACGT" with delimiter ':' is the barcode.
+ */
+inline std::pair<const char *, size_t> demux_key(const char *s, size_t l, const std::string &delims, int field) {
+    auto isdelim = [&](char c) {return std::memchr(delims.data(), c, delims.size()) != nullptr;};
+    if(field < 0) {
+        int nfields = 1;
+        for(size_t i = 0; i < l; nfields += isdelim(s[i++]));
+        if((field += nfields) < 0) return {s, 0};
+    }
+    size_t start = 0, i = 0;
+    for(; i < l; ++i) {
+        if(!isdelim(s[i])) continue;
+        if(field-- == 0) break;
+        start = i + 1;
+    }
+    return {s + start, field > 0 ? 0: i - start};
+}
+
+// Whole records, concatenated into one buffer so that a batch costs a single allocation once warmed up.
+struct SeqBatch {
+    std::string seq_;
+    std::vector<uint64_t> ends_;
+    void clear() {seq_.clear(); ends_.clear();}
+    bool empty() const {return ends_.empty();}
+    size_t size() const {return ends_.size();}
+    size_t nbases() const {return seq_.size();}
+    void add(const char *s, size_t l) {
+        seq_.append(s, l);
+        ends_.push_back(seq_.size());
+    }
+    // For records arriving in pieces (e.g., multi-line fasta), append each piece and then end the record.
+    void append(const char *s, size_t l) {seq_.append(s, l);}
+    void end_record() {ends_.push_back(seq_.size());}
+    template<typename Func>
+    void for_each(const Func &func) const {
+        uint64_t start = 0;
+        for(const auto end: ends_) {
+            func(seq_.data() + start, size_t(end - start));
+            start = end;
+        }
+    }
+};
+
+/*
+ * Reads fixed-size groups of records from a single path.
+ * fill is not thread-safe; callers sharing a reader must serialize access to it.
+ */
+class KSeqBatchReader {
+    gzFile fp_;
+    kseq_t *ks_;
+public:
+    KSeqBatchReader(const char *path): fp_(gzopen_input(path)) {
+        if(fp_ == nullptr) RUNTIME_ERROR(std::string("Could not open file at ") + path);
+        ks_ = kseq_init(fp_);
+    }
+    KSeqBatchReader(const KSeqBatchReader &) = delete;
+    ~KSeqBatchReader() {
+        kseq_destroy(ks_);
+        gzclose(fp_);
+    }
+    // For callers that need read names or comments rather than batches of sequence.
+    kseq_t *kseq() {return ks_;}
+    // Returns false once the input is exhausted. batch may still hold the final records.
+    bool fill(SeqBatch &batch, size_t minbases=SPLIT_BATCH_BASES) {
+        batch.clear();
+        int rc;
+        while((rc = kseq_read(ks_)) >= 0) {
+            batch.add(ks_->seq.s, ks_->seq.l);
+            if(batch.nbases() >= minbases) return true;
+        }
+        if(rc < -1) RUNTIME_ERROR(ks::sprintf("Malformed or truncated sequence file (kseq code %d)", rc).data());
+        return false;
+    }
+};
+
+// Serializes a KSeqBatchReader for use as a batch source shared by several threads.
+class LockedBatchReader {
+    KSeqBatchReader reader_;
+    std::mutex m_;
+    bool more_ = true;
+    std::exception_ptr err_;
+public:
+    LockedBatchReader(const char *path): reader_(path) {}
+    // Returns false once no records remain. Errors are deferred to check() so that this can be called from OpenMP workers.
+    bool next(SeqBatch &batch) {
+        std::lock_guard<std::mutex> lock(m_);
+        batch.clear();
+        if(!more_) return false;
+        try {
+            more_ = reader_.fill(batch);
+        } catch(...) {
+            err_ = std::current_exception();
+            more_ = false;
+            batch.clear();
+        }
+        return !batch.empty();
+    }
+    // Called by each worker thread; func(const char *seq, size_t len) is called for every record it is handed.
+    template<typename Func>
+    void consume(const Func &func) {
+        SeqBatch batch;
+        while(next(batch)) batch.for_each(func);
+    }
+    void check() const {if(err_) std::rethrow_exception(err_);}
+};
+
+template<typename T>
+class BoundedQueue {
+    std::deque<T> items_;
+    std::mutex m_;
+    std::condition_variable not_empty_, not_full_;
+    const size_t cap_;
+    bool closed_ = false;
+public:
+    BoundedQueue(size_t cap): cap_(std::max(cap, size_t(1))) {}
+    // Blocks while full. Returns false if the queue was closed.
+    bool push(T &&x) {
+        std::unique_lock<std::mutex> lock(m_);
+        not_full_.wait(lock, [&]() {return closed_ || items_.size() < cap_;});
+        if(closed_) return false;
+        items_.push_back(std::move(x));
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+    bool try_push(T &&x) {
+        std::unique_lock<std::mutex> lock(m_);
+        if(closed_ || items_.size() >= cap_) return false;
+        items_.push_back(std::move(x));
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+    // Blocks while empty. Returns false once the queue is closed and drained.
+    bool pop(T &x) {
+        std::unique_lock<std::mutex> lock(m_);
+        not_empty_.wait(lock, [&]() {return closed_ || !items_.empty();});
+        if(items_.empty()) return false;
+        x = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+    bool try_pop(T &x) {
+        std::unique_lock<std::mutex> lock(m_);
+        if(items_.empty()) return false;
+        x = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(m_);
+            closed_ = true;
+        }
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+};
+
+/*
+ * Streaming fasta/fastq parser which accepts arbitrary chunks of text.
+ * Sequence lines are appended straight into the current batch, which is handed off
+ * whenever it is full at a record boundary. Leading text before the first header is skipped, as in kseq.
+ */
+class FastxParser {
+    enum State {EXPECT_HEADER, SEQ, QUAL};
+    State state_ = EXPECT_HEADER;
+    bool fastq_ = false;
+    size_t curlen_ = 0, qual_left_ = 0;
+    std::string partial_;
+    const size_t batch_bases_;
+    template<typename Func>
+    void end_record(SeqBatch &batch, const Func &on_full) {
+        batch.end_record();
+        if(batch.nbases() >= batch_bases_) on_full(batch);
+    }
+    template<typename Func>
+    void line(const char *s, size_t l, SeqBatch &batch, const Func &on_full) {
+        if(l && s[l - 1] == '\r') --l;
+        switch(state_) {
+            case EXPECT_HEADER:
+                if(l == 0) break;
+                if(*s == '>' || *s == '@') fastq_ = *s == '@', state_ = SEQ, curlen_ = 0;
+                break;
+            case SEQ:
+                if(l && *s == (fastq_ ? '+': '>')) {
+                    if(fastq_) {
+                        state_ = QUAL;
+                        qual_left_ = curlen_;
+                    } else {
+                        end_record(batch, on_full);
+                        curlen_ = 0;
+                    }
+                } else {
+                    batch.append(s, l);
+                    curlen_ += l;
+                }
+                break;
+            case QUAL:
+                if(l >= qual_left_) {
+                    end_record(batch, on_full);
+                    state_ = EXPECT_HEADER;
+                } else qual_left_ -= l;
+                break;
+        }
+    }
+public:
+    FastxParser(size_t batch_bases=SPLIT_BATCH_BASES): batch_bases_(batch_bases) {}
+    // on_full(SeqBatch &) is called with each full batch and must leave it empty (e.g., by swapping in a fresh one).
+    template<typename Func>
+    void feed(const char *p, size_t n, SeqBatch &batch, const Func &on_full) {
+        const char *const end = p + n, *nl;
+        if(!partial_.empty()) {
+            if((nl = static_cast<const char *>(std::memchr(p, '\n', n))) == nullptr) {
+                partial_.append(p, n);
+                return;
+            }
+            partial_.append(p, nl);
+            line(partial_.data(), partial_.size(), batch, on_full);
+            partial_.clear();
+            p = nl + 1;
+        }
+        while(p < end) {
+            if((nl = static_cast<const char *>(std::memchr(p, '\n', end - p))) == nullptr) {
+                partial_.assign(p, end);
+                return;
+            }
+            line(p, nl - p, batch, on_full);
+            p = nl + 1;
+        }
+    }
+    // Flushes a final unterminated line and record. The last batch is left in batch for the caller.
+    template<typename Func>
+    void finish(SeqBatch &batch, const Func &on_full) {
+        if(!partial_.empty()) {
+            line(partial_.data(), partial_.size(), batch, on_full);
+            partial_.clear();
+        }
+        if(state_ == SEQ) {
+            if(fastq_) RUNTIME_ERROR("Truncated fastq record: no quality string");
+            end_record(batch, on_full);
+        } else if(state_ == QUAL) RUNTIME_ERROR("Truncated fastq record: quality string shorter than sequence");
+        state_ = EXPECT_HEADER;
+    }
+};
+
+namespace bgzf {
+static constexpr size_t HEADER_SIZE = 12, TRAILER_SIZE = 8;
+// Returns the total block size (BSIZE + 1) if extra holds a BGZF 'BC' subfield, 0 otherwise.
+inline size_t block_size(const unsigned char *extra, size_t xlen) {
+    for(size_t i = 0; i + 4 <= xlen;) {
+        const size_t slen = extra[i + 2] | (extra[i + 3] << 8);
+        if(extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2 && i + 6 <= xlen)
+            return size_t(extra[i + 4] | (extra[i + 5] << 8)) + 1;
+        i += 4 + slen;
+    }
+    return 0;
+}
+inline bool is_gzip_header(const unsigned char *h) {
+    return h[0] == 31 && h[1] == 139 && h[2] == 8;
+}
+inline bool is_bgzf(const char *path) {
+    std::FILE *fp = std::fopen(path, "rb");
+    if(!fp) return false;
+    unsigned char buf[HEADER_SIZE + 64];
+    const size_t n = std::fread(buf, 1, sizeof(buf), fp);
+    std::fclose(fp);
+    if(n < HEADER_SIZE || !is_gzip_header(buf) || (buf[3] & 4) == 0) return false; // FEXTRA
+    const size_t xlen = buf[10] | (buf[11] << 8);
+    return HEADER_SIZE + xlen <= n && block_size(buf + HEADER_SIZE, xlen);
+}
+} // namespace bgzf
+
+/*
+ * Decompression and parsing run on their own threads and hand fixed-size batches of records
+ * to the hashing threads through a bounded queue, so a slow zlib stream no longer throttles hashing.
+ * BGZF inputs (bgzip, htslib) are inflated block-by-block on io_threads threads; other inputs, including
+ * streams, are read by a single decompression thread. Chunks are parsed in order by one parser thread.
+ */
+class PipelinedBatchReader {
+    struct Chunk {
+        std::string cdata, data;
+        std::promise<void> done;
+        std::future<void> ready;
+        Chunk(): ready(done.get_future()) {}
+    };
+    using ChunkPtr = std::shared_ptr<Chunk>;
+    static constexpr size_t GZ_CHUNK_SIZE = 1u << 20;
+    BoundedQueue<ChunkPtr> work_, order_;
+    BoundedQueue<SeqBatch> full_, free_;
+    std::vector<std::thread> threads_;
+    std::exception_ptr err_;
+    std::mutex err_mutex_;
+
+    void fail(std::exception_ptr e) {
+        {
+            std::lock_guard<std::mutex> lock(err_mutex_);
+            if(!err_) err_ = e;
+        }
+        work_.close(); order_.close(); full_.close(); free_.close();
+    }
+    void read_bgzf(std::string path) {
+        std::FILE *fp = std::fopen(path.data(), "rb");
+        try {
+            if(fp == nullptr) RUNTIME_ERROR(std::string("Could not open file at ") + path);
+            unsigned char hdr[bgzf::HEADER_SIZE];
+            std::vector<unsigned char> extra;
+            size_t n;
+            while((n = std::fread(hdr, 1, sizeof(hdr), fp)) == sizeof(hdr)) {
+                const size_t xlen = hdr[10] | (hdr[11] << 8);
+                extra.resize(xlen);
+                size_t bsize;
+                if(!bgzf::is_gzip_header(hdr) || std::fread(extra.data(), 1, xlen, fp) != xlen
+                   || (bsize = bgzf::block_size(extra.data(), xlen)) < bgzf::HEADER_SIZE + xlen + bgzf::TRAILER_SIZE)
+                    RUNTIME_ERROR(std::string("Malformed BGZF block in ") + path);
+                auto chunk = std::make_shared<Chunk>();
+                chunk->cdata.resize(bsize - bgzf::HEADER_SIZE - xlen);
+                if(std::fread(&chunk->cdata[0], 1, chunk->cdata.size(), fp) != chunk->cdata.size())
+                    RUNTIME_ERROR(std::string("Truncated BGZF block in ") + path);
+                ChunkPtr tmp(chunk);
+                if(!order_.push(std::move(tmp))) break;
+                if(!work_.push(std::move(chunk))) {
+                    // Already queued for parsing, so it must not be left pending.
+                    chunk->done.set_exception(std::make_exception_ptr(std::runtime_error("Pipeline closed")));
+                    break;
+                }
+            }
+            if(n && n != sizeof(hdr)) RUNTIME_ERROR(std::string("Truncated BGZF block in ") + path);
+        } catch(...) {
+            fail(std::current_exception());
+        }
+        if(fp) std::fclose(fp);
+        work_.close();
+        order_.close();
+    }
+    void inflate_blocks() {
+        z_stream strm;
+        std::memset(&strm, 0, sizeof(strm));
+        if(inflateInit2(&strm, -15) != Z_OK) {
+            fail(std::make_exception_ptr(std::runtime_error("Could not initialize zlib stream")));
+            return;
+        }
+        ChunkPtr chunk;
+        while(work_.pop(chunk)) {
+            try {
+                const auto &cd = chunk->cdata;
+                const unsigned char *trailer = reinterpret_cast<const unsigned char *>(cd.data()) + cd.size() - bgzf::TRAILER_SIZE;
+                const uint32_t crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | (uint32_t(trailer[3]) << 24);
+                const uint32_t isize = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | (uint32_t(trailer[7]) << 24);
+                chunk->data.resize(isize);
+                if(isize) {
+                    inflateReset(&strm);
+                    strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(cd.data()));
+                    strm.avail_in = cd.size() - bgzf::TRAILER_SIZE;
+                    strm.next_out = reinterpret_cast<Bytef *>(&chunk->data[0]);
+                    strm.avail_out = isize;
+                    if(inflate(&strm, Z_FINISH) != Z_STREAM_END || strm.avail_out
+                       || crc32(0, reinterpret_cast<const Bytef *>(chunk->data.data()), isize) != crc)
+                        RUNTIME_ERROR("Corrupt BGZF block");
+                }
+                std::string().swap(chunk->cdata);
+                chunk->done.set_value();
+            } catch(...) {
+                chunk->done.set_exception(std::current_exception());
+            }
+        }
+        inflateEnd(&strm);
+    }
+    void read_gz(std::string path) {
+        gzFile fp = gzopen_input(path.data());
+        try {
+            if(fp == nullptr) RUNTIME_ERROR(std::string("Could not open file at ") + path);
+            for(;;) {
+                auto chunk = std::make_shared<Chunk>();
+                chunk->data.resize(GZ_CHUNK_SIZE);
+                const int n = gzread(fp, &chunk->data[0], GZ_CHUNK_SIZE);
+                if(n < 0) RUNTIME_ERROR(std::string("Error decompressing ") + path);
+                if(n == 0) break;
+                chunk->data.resize(n);
+                chunk->done.set_value();
+                if(!order_.push(std::move(chunk))) break;
+            }
+        } catch(...) {
+            fail(std::current_exception());
+        }
+        if(fp) gzclose(fp);
+        order_.close();
+    }
+    void parse(size_t batch_bases) {
+        try {
+            FastxParser parser(batch_bases);
+            SeqBatch batch;
+            auto on_full = [&](SeqBatch &b) {
+                SeqBatch fresh;
+                free_.try_pop(fresh);
+                std::swap(b, fresh);
+                full_.push(std::move(fresh));
+            };
+            ChunkPtr chunk;
+            while(order_.pop(chunk)) {
+                chunk->ready.get();
+                parser.feed(chunk->data.data(), chunk->data.size(), batch, on_full);
+            }
+            parser.finish(batch, on_full);
+            if(!batch.empty()) full_.push(std::move(batch));
+        } catch(...) {
+            fail(std::current_exception());
+        }
+        full_.close();
+    }
+public:
+    PipelinedBatchReader(const char *path, unsigned io_threads, unsigned compute_threads, size_t batch_bases=SPLIT_BATCH_BASES):
+        work_(8 * std::max(io_threads, 1u)), order_(16 * std::max(io_threads, 1u)),
+        full_(2 * compute_threads + 2), free_(2 * compute_threads + 2)
+    {
+        std::string p(path);
+        if(!is_stream_path(path) && bgzf::is_bgzf(path)) {
+            threads_.emplace_back(&PipelinedBatchReader::read_bgzf, this, p);
+            for(unsigned i = 0; i < std::max(io_threads, 1u); ++i)
+                threads_.emplace_back(&PipelinedBatchReader::inflate_blocks, this);
+        } else {
+            threads_.emplace_back(&PipelinedBatchReader::read_gz, this, p);
+        }
+        threads_.emplace_back(&PipelinedBatchReader::parse, this, batch_bases);
+    }
+    PipelinedBatchReader(const PipelinedBatchReader &) = delete;
+    ~PipelinedBatchReader() {
+        work_.close(); order_.close(); full_.close(); free_.close();
+        for(auto &t: threads_) t.join();
+    }
+    // Thread-safe. Returns false once all batches have been consumed or the pipeline failed (see check()).
+    bool next(SeqBatch &batch) {
+        batch.clear();
+        free_.try_push(std::move(batch));
+        batch = SeqBatch();
+        return full_.pop(batch);
+    }
+    template<typename Func>
+    void consume(const Func &func) {
+        SeqBatch batch;
+        while(next(batch)) batch.for_each(func);
+    }
+    void check() {
+        std::lock_guard<std::mutex> lock(err_mutex_);
+        if(err_) std::rethrow_exception(err_);
+    }
+};
+
+/*
+ * Zero-copy reader for uncompressed fasta/fastq.
+ * The file is mapped read-only, and record and line boundaries are found with memchr (vectorized in libc),
+ * so single-line sequences (all typical fastq and most RefSeq-style fasta past the first line) are handed to the
+ * encoder in place. Sequences wrapped over several lines must be stitched, which reuses a caller-provided buffer.
+ */
+class MappedSeqFile {
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    bool fastq_ = false;
+    static const char *line_end(const char *p, const char *e) {
+        const char *nl = static_cast<const char *>(std::memchr(p, '\n', e - p));
+        return nl ? nl: e;
+    }
+    static size_t trimmed(const char *p, const char *le) {return le - p - (le > p && le[-1] == '\r');}
+public:
+    // Maps path if it is a nonempty regular file starting with a fasta/fastq header; check mapped() afterwards.
+    // Standard input is mapped when redirected from a regular file. Pipes are never opened here, as that could block or consume them.
+    MappedSeqFile(const char *path) {
+        struct stat st;
+        const bool in = is_stdin_path(path);
+        if((in ? ::fstat(STDIN_FILENO, &st): ::stat(path, &st)) || !S_ISREG(st.st_mode) || st.st_size <= 0
+           || (in && ::lseek(STDIN_FILENO, 0, SEEK_CUR) != 0))
+            return;
+        const int fd = in ? STDIN_FILENO: ::open(path, O_RDONLY);
+        if(fd < 0) return;
+        void *p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p != MAP_FAILED) {
+            const char *c = static_cast<const char *>(p), *e = c + st.st_size;
+            while(c < e && std::isspace(*c)) ++c;
+            if(c < e && (*c == '>' || *c == '@')) {
+                data_ = static_cast<const char *>(p);
+                size_ = st.st_size;
+                fastq_ = *c == '@';
+                ::madvise(p, size_, MADV_SEQUENTIAL);
+            } else ::munmap(p, st.st_size);
+        }
+        if(!in) ::close(fd);
+    }
+    MappedSeqFile(const MappedSeqFile &) = delete;
+    ~MappedSeqFile() {if(data_) ::munmap(const_cast<char *>(data_), size_);}
+    bool mapped() const {return data_ != nullptr;}
+    bool is_fastq() const {return fastq_;}
+    const char *begin() const {return data_;}
+    const char *end() const {return data_ + size_;}
+
+    // Calls func(seq, len) for each record beginning in [b, e), which must start at a record boundary or the file start.
+    template<typename Func>
+    void for_each_seq(const char *b, const char *e, const Func &func, std::string &scratch) const {
+        const char *p = b, *const fe = end(), *le;
+        const char hdr = fastq_ ? '@': '>';
+        while(p < e && *p != hdr) p = line_end(p, fe) + 1;
+        while(p < e) {
+            p = line_end(p, fe) + 1; // Skip header
+            const char *sb = p;
+            if(p >= fe) {
+                if(fastq_) RUNTIME_ERROR("Truncated fastq record: no sequence");
+                func(fe, 0);
+                break;
+            }
+            if(!fastq_ && *p == '>') {
+                func(p, 0);
+                continue;
+            }
+            le = line_end(p, fe);
+            size_t len = trimmed(p, le);
+            p = le + 1;
+            const char stop = fastq_ ? '+': '>';
+            if(p < fe && *p != stop) {
+                scratch.assign(sb, len);
+                do {
+                    le = line_end(p, fe);
+                    scratch.append(p, trimmed(p, le));
+                    p = le + 1;
+                } while(p < fe && *p != stop);
+                func(scratch.data(), scratch.size());
+                len = scratch.size();
+            } else func(sb, len);
+            if(fastq_) {
+                if(p >= fe) RUNTIME_ERROR("Truncated fastq record: no quality string");
+                p = line_end(p, fe) + 1; // Skip '+' line
+                for(size_t qlen = 0; qlen < len;) {
+                    if(p >= fe) RUNTIME_ERROR("Truncated fastq record: quality string shorter than sequence");
+                    le = line_end(p, fe);
+                    qlen += trimmed(p, le);
+                    p = le + 1;
+                }
+                if(len == 0 && p < fe && *p != '@') p = line_end(p, fe) + 1; // Empty quality line
+            }
+        }
+    }
+    template<typename Func>
+    void for_each_seq(const Func &func, std::string &scratch) const {for_each_seq(begin(), end(), func, scratch);}
+
+    // Returns nparts + 1 boundaries, each at the start of a record, splitting the file into similarly-sized pieces.
+    // Fastq records are found by the usual '@' line followed two lines later by a '+' line; multi-line fastq is not split.
+    std::vector<const char *> partition(size_t nparts) const {
+        std::vector<const char *> ret{begin()};
+        const char *const fe = end();
+        bool splittable = true;
+        if(fastq_) {
+            const char *p = line_end(begin(), fe) + 1;
+            p = line_end(std::min(p, fe), fe) + 1;
+            splittable = p < fe && *p == '+';
+        }
+        for(size_t i = 1; splittable && i < nparts; ++i) {
+            const char *p = std::max(begin() + size_ / nparts * i, ret.back());
+            p = std::min(line_end(p, fe) + 1, fe);
+            while(p < fe) {
+                if(!fastq_) {
+                    if(*p == '>') break;
+                } else if(*p == '@') {
+                    const char *l2 = line_end(p, fe) + 1, *l3 = l2 < fe ? line_end(l2, fe) + 1: fe;
+                    if(l3 < fe && *l3 == '+' && *l2 != '@') break;
+                }
+                p = std::min(line_end(p, fe) + 1, fe);
+            }
+            if(p > ret.back()) ret.push_back(p);
+        }
+        ret.push_back(fe);
+        return ret;
+    }
+};
+
+// Buffer for stitching wrapped sequences, reused by every mapped file a thread reads.
+inline std::string &stitch_buffer() {
+    static thread_local std::string buf;
+    return buf;
+}
+
+// Hands out record-aligned pieces of a mapped file to worker threads; records are never copied unless wrapped.
+class MappedChunkSource {
+    std::vector<const char *> bounds_;
+    std::atomic<size_t> next_;
+    const MappedSeqFile &file_;
+    std::mutex m_;
+    std::exception_ptr err_;
+public:
+    static constexpr size_t TARGET_CHUNK_SIZE = 16u << 20;
+    MappedChunkSource(const MappedSeqFile &file, unsigned nthreads):
+        bounds_(file.partition(std::max(size_t(nthreads) * 4, size_t(file.end() - file.begin()) / TARGET_CHUNK_SIZE + 1))),
+        next_(0), file_(file) {}
+    // Called by each worker thread. Errors (e.g., a truncated record) stop every thread from taking more pieces and are deferred to check().
+    template<typename Func>
+    void consume(const Func &func) {
+        std::string &scratch = stitch_buffer();
+        try {
+            for(size_t i; (i = next_++) + 1 < bounds_.size();)
+                file_.for_each_seq(bounds_[i], bounds_[i + 1], func, scratch);
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(m_);
+            if(!err_) err_ = std::current_exception();
+            next_ = bounds_.size();
+        }
+    }
+    void check() const {if(err_) std::rethrow_exception(err_);}
+};
+
+/*
+ * Calls func with a thread-safe record source for path, whose consume(func) is called once per worker thread.
+ * Uncompressed files are mapped; otherwise the source is pipelined if io_threads is nonzero, or a locked kseq reader.
+ */
+template<typename Func>
+void with_batch_source(const char *path, unsigned io_threads, unsigned compute_threads, const Func &func) {
+    MappedSeqFile mapped(path);
+    if(mapped.mapped()) {
+        MappedChunkSource source(mapped, compute_threads);
+        func(source);
+        source.check();
+    } else if(io_threads) {
+        PipelinedBatchReader reader(path, io_threads, compute_threads);
+        func(reader);
+        reader.check();
+    } else {
+        LockedBatchReader reader(path);
+        func(reader);
+        reader.check();
+    }
+}
+
+// Calls func(seq, len) for every record in path and returns true if path could be mapped, false otherwise.
+// Throws on a malformed record, so callers in a parallel loop must catch (as for_each_scheduled does).
+template<typename Func>
+bool for_each_mapped_seq(const char *path, const Func &func) {
+    MappedSeqFile mapped(path);
+    if(!mapped.mapped()) return false;
+    mapped.for_each_seq(func, stitch_buffer());
+    return true;
+}
+
+} // namespace bns
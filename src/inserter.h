@@ -0,0 +1,71 @@
+#pragma once
+#include "dashing.h"
+
+#ifndef BATCH_INSERT_SIZE
+#define BATCH_INSERT_SIZE 16
+#endif
+
+namespace bns {
+
+// How a buffer of k-mers (or, if prehashed, of hash values) is applied to a sketch. By default, one at a time.
+template<typename SketchType, bool prehashed>
+struct BatchInsert {
+    static void apply(SketchType &sketch, const uint64_t *vals, size_t n) {
+        for(size_t i = 0; i < n; sketch.addh(vals[i++]));
+    }
+};
+template<typename SketchType>
+struct BatchInsert<SketchType, true> {
+    static void apply(SketchType &sketch, const uint64_t *vals, size_t n) {
+        for(size_t i = 0; i < n; sketch.add(vals[i++]));
+    }
+};
+
+/*
+ * HLL registers are hashed for the whole buffer first (the loop vectorizes, as WangHash is shifts and adds),
+ * then every target register is prefetched, and only then are registers updated.
+ * For large sketches this overlaps the cache misses instead of taking them one k-mer at a time.
+ */
+inline void prefetch_and_add(hll::hll_t &sketch, const uint64_t *hv, size_t n) {
+    const auto regs = sketch.core().data();
+    const unsigned shift = 64 - sketch.p();
+    for(size_t i = 0; i < n; ++i) __builtin_prefetch(regs + (hv[i] >> shift), 1);
+    for(size_t i = 0; i < n; ++i) sketch.add(hv[i]);
+}
+template<>
+struct BatchInsert<hll::hll_t, false> {
+    static void apply(hll::hll_t &sketch, const uint64_t *vals, size_t n) {
+        uint64_t hv[BATCH_INSERT_SIZE];
+        for(size_t i = 0; i < n; ++i) hv[i] = sketch.hash(vals[i]);
+        prefetch_and_add(sketch, hv, n);
+    }
+};
+template<>
+struct BatchInsert<hll::hll_t, true> {
+    static void apply(hll::hll_t &sketch, const uint64_t *vals, size_t n) {prefetch_and_add(sketch, vals, n);}
+};
+
+/*
+ * Collects values from an encoder callback and hands them to the sketch BATCH_INSERT_SIZE at a time.
+ * Anything still buffered is applied when the inserter goes out of scope, so keep it scoped to the sketching pass.
+ */
+template<typename SketchType, bool prehashed=false>
+class BatchInserter {
+    SketchType &sketch_;
+    uint64_t buf_[BATCH_INSERT_SIZE];
+    unsigned n_ = 0;
+public:
+    BatchInserter(SketchType &sketch): sketch_(sketch) {}
+    BatchInserter(const BatchInserter &) = delete;
+    ~BatchInserter() {flush();}
+    void add(uint64_t val) {
+        buf_[n_++] = val;
+        if(n_ == BATCH_INSERT_SIZE) flush();
+    }
+    void flush() {
+        BatchInsert<SketchType, prehashed>::apply(sketch_, buf_, n_);
+        n_ = 0;
+    }
+};
+
+} // namespace bns
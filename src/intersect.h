@@ -0,0 +1,76 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <x86intrin.h>
+
+namespace bns {
+
+/*
+ * Sizes of intersections of sorted, duplicate-free arrays of 64-bit keys (full k-mer hash sets).
+ * Sets of similar size are merged four keys against four at a time with AVX2, comparing every pair in a block at once
+ * and advancing whichever block ends lower; what remains is merged without branches.
+ * When one set is GALLOP_RATIO times larger than the other, each key of the smaller one is instead found in the larger
+ * by exponential search from the previous match, costing O(small * log(large / small)) rather than O(small + large).
+ */
+namespace isect {
+
+static constexpr size_t GALLOP_RATIO = 32;
+
+// Branchless merge: advances past the smaller key (or both when equal) every iteration.
+inline size_t merge_scalar(const uint64_t *a, size_t na, const uint64_t *b, size_t nb) {
+    size_t i = 0, j = 0, ret = 0;
+    while(i < na && j < nb) {
+        const uint64_t x = a[i], y = b[j];
+        ret += x == y;
+        i += x <= y;
+        j += y <= x;
+    }
+    return ret;
+}
+
+inline size_t merge(const uint64_t *a, size_t na, const uint64_t *b, size_t nb) {
+    size_t i = 0, j = 0, ret = 0;
+#if __AVX2__
+    if(na >= 4 && nb >= 4) {
+        const size_t na4 = na & ~size_t(3), nb4 = nb & ~size_t(3);
+        while(i < na4 && j < nb4) {
+            const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+            const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + j));
+            // Compare a's block against every rotation of b's block, so each a lane meets each b lane once.
+            __m256i eq = _mm256_cmpeq_epi64(va, vb);
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x39)));
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x4E)));
+            eq = _mm256_or_si256(eq, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x93)));
+            ret += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(eq)));
+            const uint64_t amax = a[i + 3], bmax = b[j + 3];
+            i += (amax <= bmax) << 2;
+            j += (bmax <= amax) << 2;
+        }
+    }
+#endif
+    return ret + merge_scalar(a + i, na - i, b + j, nb - j);
+}
+
+// Counts keys of small found in large, where small is much shorter.
+inline size_t gallop(const uint64_t *small, size_t ns, const uint64_t *large, size_t nl) {
+    size_t ret = 0, lo = 0;
+    for(size_t i = 0; i < ns && lo < nl; ++i) {
+        const uint64_t x = small[i];
+        size_t step = 1, hi = lo;
+        while(hi < nl && large[hi] < x) lo = hi + 1, hi += step, step <<= 1;
+        lo = std::lower_bound(large + lo, large + std::min(hi + 1, nl), x) - large;
+        ret += lo < nl && large[lo] == x;
+    }
+    return ret;
+}
+
+} // namespace isect
+
+inline size_t intersection_size(const uint64_t *a, size_t na, const uint64_t *b, size_t nb) {
+    if(na > nb) std::swap(a, b), std::swap(na, nb);
+    if(na == 0) return 0;
+    return nb / na >= isect::GALLOP_RATIO ? isect::gallop(a, na, b, nb): isect::merge(a, na, b, nb);
+}
+
+} // namespace bns
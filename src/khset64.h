@@ -1,9 +1,13 @@
 #pragma once
 #include "dashing.h"
+#include "compactset.h"
+#include "sortedset.h"
 
 namespace bns {
 struct khset64_t: public kh::khset64_t {
-    // TODO: change to sorted hash sets for faster comparisons, implement parallel merge sort.
+    // Once finalized (cvt2shs), the keys are a sorted array and flags is null.
+    // Sets read from compact files instead keep their keys on disk (mapped) in compact_, with keys null, until decompress().
+    std::shared_ptr<CompactSetFile> compact_;
     using final_type = khset64_t;
     void addh(uint64_t v) {this->insert(v);}
     void add(uint64_t v) {this->insert(v);}
@@ -31,15 +35,21 @@ struct khset64_t: public kh::khset64_t {
         assert(i == this->n_occupied);
         std::free(this->flags);
         this->flags = nullptr;
-        std::sort(newp, newp + i);
+        radix_sort(newp, i);
     }
     void read(const std::string &s) {read(s.data());}
     void read(const char *s) {
+        if(auto f = CompactSetFile::open(s)) {
+            adopt(std::move(f));
+            return;
+        }
         gzFile fp = gzopen(s, "rb");
         this->read(fp);
         gzclose(fp);
     }
+    // Reads the format written by older versions: the number of keys, then the keys.
     void read(gzFile fp) {
+        compact_.reset();
         uint64_t nelem;
         if(gzread(fp, &nelem, sizeof(nelem)) != sizeof(nelem))
             throw std::runtime_error("Failure to read");
@@ -48,49 +58,75 @@ struct khset64_t: public kh::khset64_t {
             throw std::bad_alloc();
         if(gzread(fp, this->keys, nelem * sizeof(uint64_t)) != ssize_t(nelem * sizeof(uint64_t)))
             throw std::runtime_error("Failure to read");
+        std::free(this->flags);
+        this->flags = nullptr;
+        set_size(nelem);
+        uint64_t *p = reinterpret_cast<uint64_t *>(this->keys);
+        if(!std::is_sorted(p, p + nelem)) radix_sort(p, nelem);
+    }
+    // Uses a compact set (mapped, or in a sketch pack) in place of this set's keys.
+    void adopt(std::shared_ptr<CompactSetFile> f) {
+        std::free(this->keys);
+        std::free(this->flags);
+        this->keys = nullptr;
+        this->flags = nullptr;
+        compact_ = std::move(f);
+        set_size(compact_->view().size());
+    }
+    // Decodes a set read from a compact file into a sorted array of keys.
+    void decompress() {
+        if(!compact_) return;
+        const CompactSetView &v = compact_->view();
+        if((this->keys = static_cast<khint64_t *>(std::realloc(this->keys, std::max(v.size(), size_t(1)) * sizeof(uint64_t)))) == nullptr)
+            throw std::bad_alloc();
+        v.decode_all(reinterpret_cast<uint64_t *>(this->keys));
+        compact_.reset();
+    }
+    void clear() {
+        compact_.reset();
+        kh::khset64_t::clear();
     }
     void free() {
+        compact_.reset();
         auto ptr = reinterpret_cast<kh::khash_t(set64) *>(this);
         std::free(ptr->keys);
         std::free(ptr->flags);
-        std::memset(ptr, 0, sizeof(*this));
+        std::memset(ptr, 0, sizeof(*ptr));
     }
     void write(const std::string &s) const {write(s.data());}
     void write(const char *s) const {
-        gzFile fp = gzopen(s, "wb");
+        gzFile fp = gzopen(s, "wT"); // Uncompressed, so that it can be mapped
+        if(fp == nullptr) throw std::runtime_error(std::string("Could not open ") + s + " for writing");
         this->write(fp);
         gzclose(fp);
     }
     void write(gzFile fp) const {
-        uint64_t nelem = this->n_occupied;
-        std::vector<uint64_t> tmp(nelem);
-        auto it = tmp.begin();
-        for(khiter_t ki = 0; ki != this->n_buckets; ++ki)
-            if(kh_exist(this, ki))
-                *it++ = kh_key(this, ki);
-        std::sort(tmp.begin(), tmp.end());
-        if(gzwrite(fp, &nelem, sizeof(nelem)) != sizeof(nelem)) throw std::runtime_error("Failed to write khash set to disk.");
-        if(gzwrite(fp, this->keys, sizeof(*this->keys) * nelem) != ssize_t(sizeof(*this->keys) * nelem))
-            throw std::runtime_error("Failed to write khash set to disk.");
-    }
-    struct Counter
-    {
-      struct value_type { template<typename T> value_type(const T&) { } };
-      void push_back(const value_type &x) { ++count; }
-      Counter(): count(0) {}
-      size_t count;
-    };
+        CompactSetWriter writer(fp);
+        if(compact_) {
+            const CompactSetView &v = compact_->view();
+            uint64_t buf[COMPACT_MAX_BLOCK_SIZE];
+            for(size_t b = 0; b < v.nblocks(); ++b) writer.add(buf, v.decode(b, buf));
+        } else if(flags == nullptr) {
+            writer.add(reinterpret_cast<const uint64_t *>(this->keys), this->n_occupied);
+        } else {
+            std::vector<uint64_t> tmp(this->n_occupied);
+            auto it = tmp.begin();
+            for(khiter_t ki = 0; ki != this->n_buckets; ++ki)
+                if(kh_exist(this, ki))
+                    *it++ = kh_key(this, ki);
+            radix_sort(tmp.data(), tmp.size());
+            writer.add(tmp.data(), tmp.size());
+        }
+        writer.finish();
+    }
     std::array<double, 3> full_set_comparison(const khset64_t &other) const {
         if(flags) throw std::runtime_error("flags must be null by now\n");
         if(other.flags) throw std::runtime_error("flags must be null by now (other)\n");
-        Counter c;
-        assert(std::is_sorted(this->keys, this->keys + this->n_occupied));
-        assert(std::is_sorted(other.keys, other.keys + other.n_occupied));
-        assert(c.count == 0);
-        std::set_intersection(this->keys, this->keys + this->n_occupied,
-                              other.keys, other.keys + other.n_occupied,
-                              std::back_inserter(c));
-        double is = c.count;
+        const auto keys = [](const khset64_t &x) {return reinterpret_cast<const uint64_t *>(x.keys);};
+        const double is = compact_ && other.compact_ ? intersection_size(compact_->view(), other.compact_->view())
+                        : compact_                   ? intersection_size(compact_->view(), keys(other), other.n_occupied)
+                        : other.compact_             ? intersection_size(other.compact_->view(), keys(*this), this->n_occupied)
+                                                     : intersection_size(keys(*this), this->n_occupied, keys(other), other.n_occupied);
         return std::array<double, 3>{this->n_occupied - is, other.n_occupied - is, is};
     }
     double jaccard_index(const khset64_t &other) const {
@@ -106,12 +142,34 @@ struct khset64_t: public kh::khset64_t {
         return double(cmps[2]) / (std::min(cmps[0], cmps[1]) + 1e-20 + cmps[2]);
     }
     khset64_t &operator+=(const khset64_t &o) {
-        throw NotImplementedError("This shouldn't be called.");
+        if(o.flags) throw std::runtime_error("flags must be null by now (other)\n");
+        cvt2shs();
+        decompress();
+        std::vector<uint64_t> odecoded;
+        if(o.compact_) {
+            odecoded.resize(o.n_occupied);
+            o.compact_->view().decode_all(odecoded.data());
+        }
+        std::vector<uint64_t> merged = union_sorted({{reinterpret_cast<const uint64_t *>(this->keys), this->n_occupied},
+                                                     {o.compact_ ? odecoded.data(): reinterpret_cast<const uint64_t *>(o.keys), o.n_occupied}});
+        if(merged.size() > std::numeric_limits<decltype(this->n_occupied)>::max())
+            throw std::runtime_error("Union is too large for a khash set; use dashing union -H, which does not build one.");
+        if((this->keys = static_cast<khint64_t *>(std::realloc(this->keys, merged.size() * sizeof(uint64_t)))) == nullptr)
+            throw std::bad_alloc();
+        std::copy(merged.begin(), merged.end(), reinterpret_cast<uint64_t *>(this->keys));
+        set_size(merged.size());
+        return *this;
     }
     uint64_t union_size(const khset64_t &other) const {
         auto cmps = full_set_comparison(other);
         return cmps[0] + cmps[1] + cmps[2];
     }
+private:
+    // Sizes a finalized set holding n keys.
+    void set_size(size_t n) {
+        auto ptr = reinterpret_cast<kh::khash_t(set64) *>(this);
+        ptr->n_buckets = ptr->size = ptr->n_occupied = ptr->upper_bound = n;
+    }
 };
 
 
@@ -0,0 +1,100 @@
+#include "simdenc.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <random>
+#include <string>
+#include <vector>
+
+// Compares the bulk k-mer kernel against base-at-a-time encoding, and shared multi-k encoding against per-k passes,
+// for correctness and throughput.
+// Build with `make kmerbench` (or one of the -mavx2/-mavx512bw flag sets used for the dashing_256/512 builds).
+
+using namespace bns;
+
+int usage(const char *arg) {
+    std::fprintf(stderr, "Usage: %s <flags>\n-n\tMegabases of random sequence [64]\n-N\tFraction of ambiguous bases [0.0001]\n-r\tRead length; 0 for a single sequence [0]\n-k\tAdd a k-mer length to test; repeatable [15,21,31,32]\n-s\tSeed [13]\n", arg);
+    return EXIT_FAILURE;
+}
+
+struct Digest {
+    uint64_t n = 0, sum = 0, x = 0;
+    void add(uint64_t kmer) {++n; sum += kmer; x ^= kmer * 0x9E3779B97F4A7C15ull;}
+    bool operator==(const Digest &o) const {return n == o.n && sum == o.sum && x == o.x;}
+};
+
+template<typename F>
+double time_pass(const F &f) {
+    auto start = std::chrono::high_resolution_clock::now();
+    f();
+    return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+int main(int argc, char *argv[]) {
+    size_t mbases = 64, readlen = 0;
+    double nfrac = 1e-4;
+    uint64_t seed = 13;
+    std::vector<unsigned> ks;
+    for(int c; (c = getopt(argc, argv, "n:N:r:k:s:h?")) >= 0;) {
+        switch(c) {
+            case 'n': mbases = std::strtoull(optarg, nullptr, 10); break;
+            case 'N': nfrac = std::atof(optarg); break;
+            case 'r': readlen = std::strtoull(optarg, nullptr, 10); break;
+            case 'k': ks.push_back(std::atoi(optarg)); break;
+            case 's': seed = std::strtoull(optarg, nullptr, 10); break;
+            case 'h': case '?': return usage(*argv);
+        }
+    }
+    if(ks.empty()) ks = {15, 21, 31, 32};
+    std::mt19937_64 mt(seed);
+    std::string seq(mbases << 20, 'A');
+    static const char bases[] = "ACGTacgt";
+    std::uniform_real_distribution<double> urd;
+    for(auto &c: seq) c = urd(mt) < nfrac ? 'N': bases[mt() & 7];
+    const size_t step = readlen ? readlen: seq.size();
+    const double gb = seq.size() / double(1 << 30);
+    std::fprintf(stderr, "%zu bases, %s\n", seq.size(), readlen ? ("reads of length " + std::to_string(readlen)).data(): "one sequence");
+    int ret = EXIT_SUCCESS;
+    for(const unsigned k: ks) {
+        for(const bool canon: {false, true}) {
+            KmerKernel kernel(k, canon);
+            if(!kernel.enabled()) {
+                std::fprintf(stderr, "k = %u is not supported by the bulk kernel\n", k);
+                return EXIT_FAILURE;
+            }
+            Digest scalar, bulk;
+            const double ts = time_pass([&]() {
+                for(size_t i = 0; i < seq.size(); i += step)
+                    kernel.for_each_scalar([&](uint64_t kmer) {scalar.add(kmer);}, seq.data() + i, std::min(step, seq.size() - i));
+            });
+            const double tb = time_pass([&]() {
+                for(size_t i = 0; i < seq.size(); i += step)
+                    kernel.for_each([&](uint64_t kmer) {bulk.add(kmer);}, seq.data() + i, std::min(step, seq.size() - i));
+            });
+            const bool match = scalar == bulk;
+            std::fprintf(stdout, "k=%u\tcanon=%d\tkmers=%zu\tscalar=%.3f GB/s\tbulk=%.3f GB/s\tspeedup=%.2f\t%s\n",
+                         k, canon, size_t(bulk.n), gb / ts, gb / tb, ts / tb, match ? "identical": "MISMATCH");
+            if(!match) ret = EXIT_FAILURE;
+        }
+    }
+    // One encoding shared by every k (as in mkdist --multik) against a separate pass per k.
+    MultiKmerKernel multi(ks, true);
+    std::vector<Digest> separate(ks.size()), shared(ks.size());
+    const double ts = time_pass([&]() {
+        for(size_t ki = 0; ki < ks.size(); ++ki) {
+            KmerKernel kernel(ks[ki], true);
+            for(size_t i = 0; i < seq.size(); i += step)
+                kernel.for_each([&](uint64_t kmer) {separate[ki].add(kmer);}, seq.data() + i, std::min(step, seq.size() - i));
+        }
+    });
+    const double tb = time_pass([&]() {
+        for(size_t i = 0; i < seq.size(); i += step)
+            multi.for_each([&](size_t ki, uint64_t kmer) {shared[ki].add(kmer);}, seq.data() + i, std::min(step, seq.size() - i));
+    });
+    const bool match = separate == shared;
+    std::fprintf(stdout, "multi-k (%zu values)\tper-k passes=%.3f GB/s\tshared encoding=%.3f GB/s\tspeedup=%.2f\t%s\n",
+                 ks.size(), gb / ts, gb / tb, ts / tb, match ? "identical": "MISMATCH");
+    if(!match) ret = EXIT_FAILURE;
+    return ret;
+}
@@ -0,0 +1,133 @@
+#pragma once
+#include "dashing.h"
+
+namespace bns {
+
+/*
+ * Locality-sensitive hashing (banding) over minhash signatures, for --lsh-threshold.
+ * A signature of m positions is cut into `bands` bands of `rows` positions; two inputs become a candidate pair
+ * when all positions of at least one band agree. If a position agrees with probability p, a pair is found with
+ * probability 1 - (1 - p^rows)^bands, which rises steeply around the threshold, so far fewer than n^2 / 2 pairs
+ * need an exact comparison.
+ */
+struct LshParams {
+    unsigned bands = 0, rows = 0;
+    double recall = 0.; // Probability of finding a pair whose positions agree with probability p_at_threshold
+};
+
+inline double lsh_recall(double p, unsigned bands, unsigned rows) {
+    return 1. - std::pow(1. - std::pow(p, rows), bands);
+}
+
+/*
+ * Chooses the longest bands (hence the fewest spurious candidates) whose recall at the threshold is at least target_recall,
+ * using as many bands of that length as fit in npositions. Falls back to bands of one position.
+ */
+inline LshParams choose_lsh_params(size_t npositions, double p_at_threshold, double target_recall=0.95) {
+    LshParams ret;
+    for(unsigned rows = 1; rows <= npositions; ++rows) {
+        const unsigned bands = npositions / rows;
+        const double recall = lsh_recall(p_at_threshold, bands, rows);
+        if(rows > 1 && recall < target_recall) break;
+        ret.bands = bands, ret.rows = rows, ret.recall = recall;
+    }
+    return ret;
+}
+
+/*
+ * Positional signatures for sketch types that support banding. LSH_EMPTY marks a position with no value; bands containing one
+ * are not indexed. match_probability(t) is the chance that a position agrees for inputs with Jaccard similarity t.
+ */
+template<typename T>
+struct LshSignature {
+    static constexpr bool enabled = false;
+};
+static constexpr uint64_t LSH_EMPTY = UINT64_MAX;
+
+// b-bit one-permutation minhash: registers are stored as b bit planes per block of 64 registers.
+template<>
+struct LshSignature<mh::FinalBBitMinHash> {
+    static constexpr bool enabled = true;
+    static size_t size(const mh::FinalBBitMinHash *sketches, size_t n) {return n ? size_t(1) << sketches[0].p_: 0;}
+    static double match_probability(const mh::FinalBBitMinHash *sketches, size_t n, double t) {
+        return n ? t + (1. - t) / std::ldexp(1., sketches[0].b_): t; // b-bit registers also agree by chance
+    }
+    static void fill(const mh::FinalBBitMinHash &s, size_t m, uint64_t *out) {
+        const unsigned b = s.b_;
+        for(size_t r = 0; r < m; ++r) {
+            const uint64_t *planes = s.core_.data() + (r / 64) * b;
+            uint64_t v = 0;
+            for(unsigned q = 0; q < b; ++q) v |= ((planes[q] >> (r % 64)) & 1) << q;
+            out[r] = v;
+        }
+    }
+};
+
+/*
+ * Bottom-k minhash keeps the k smallest hashes of a set rather than one value per position, so positions are made
+ * by bucketing: position r holds the smallest kept hash h with h % m == r. Buckets are rarely empty with m = k / 2,
+ * and for sets of similar size the bucket minima agree with probability close to their Jaccard similarity.
+ */
+template<>
+struct LshSignature<RMFinal> {
+    static constexpr bool enabled = true;
+    static size_t size(const RMFinal *sketches, size_t n) {
+        size_t k = 0;
+        for(size_t i = 0; i < n; ++i) k = std::max(k, sketches[i].first.size());
+        return std::max(k / 2, size_t(1));
+    }
+    static double match_probability(const RMFinal *, size_t, double t) {return t;}
+    static void fill(const RMFinal &s, size_t m, uint64_t *out) {
+        std::fill(out, out + m, LSH_EMPTY);
+        for(const uint64_t h: s.first) {
+            uint64_t &o = out[h % m];
+            o = std::min(o, h);
+        }
+    }
+};
+
+/*
+ * Returns candidate pairs (i < j, packed as i << 32 | j) among sketches[0, n) sharing a band, sorted and deduplicated.
+ * With nq queries (the last nq sketches), only pairs of a reference and a query are returned.
+ */
+template<typename SketchType>
+std::vector<uint64_t> lsh_candidates(const SketchType *sketches, size_t n, size_t nq, const LshParams &params, size_t m) {
+    using Sig = LshSignature<SketchType>;
+    const size_t nr = n - nq;
+    std::vector<uint64_t> sigs(n * m);
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t i = 0; i < n; ++i) Sig::fill(sketches[i], m, sigs.data() + i * m);
+    std::vector<std::vector<uint64_t>> found(omp_get_max_threads());
+    #pragma omp parallel for schedule(dynamic)
+    for(unsigned band = 0; band < params.bands; ++band) {
+        auto &out = found[omp_get_thread_num()];
+        std::vector<std::pair<uint64_t, uint32_t>> keys;
+        keys.reserve(n);
+        for(size_t i = 0; i < n; ++i) {
+            const uint64_t *p = sigs.data() + i * m + band * params.rows;
+            uint64_t h = band;
+            bool empty = false;
+            for(unsigned r = 0; r < params.rows; ++r) {
+                empty |= p[r] == LSH_EMPTY;
+                h = (h ^ p[r]) * 0x9E3779B97F4A7C15ull;
+                h ^= h >> 29;
+            }
+            if(!empty) keys.emplace_back(h, i);
+        }
+        std::sort(keys.begin(), keys.end());
+        for(size_t g0 = 0, g1; g0 < keys.size(); g0 = g1) {
+            for(g1 = g0 + 1; g1 < keys.size() && keys[g1].first == keys[g0].first; ++g1);
+            for(size_t a = g0; a < g1; ++a)
+                for(size_t b = a + 1; b < g1; ++b) // keys are sorted by index within a group
+                    if(!nq || (keys[a].second < nr) != (keys[b].second < nr))
+                        out.push_back(uint64_t(keys[a].second) << 32 | keys[b].second);
+        }
+    }
+    std::vector<uint64_t> ret;
+    for(auto &f: found) ret.insert(ret.end(), f.begin(), f.end()), std::vector<uint64_t>().swap(f);
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+}
+
+} // namespace bns
@@ -23,6 +23,8 @@ int main(int argc, char *argv[]) {
     else if(std::strcmp(argv[1], "flatten") == 0) return flatten_main(argc - 1, argv + 1);
     else if(std::strcmp(argv[1], "printmat") == 0) return print_binary_main(argc - 1, argv + 1);
     else if(std::strcmp(argv[1], "dt_print") == 0) return dt_print_main(argc - 1, argv + 1);
+    else if(std::strcmp(argv[1], "merge-shards") == 0) return merge_shards_main(argc - 1, argv + 1);
+    else if(std::strcmp(argv[1], "pack") == 0) return pack_main(argc - 1, argv + 1);
 	else {
         for(const char *const *p(argv + 1); *p; ++p) {
             std::string v(*p);
@@ -31,7 +33,7 @@ int main(int argc, char *argv[]) {
             if(v == "-v" || v == "--version") version_info(argv);
         }
         std::fprintf(stderr, "Usage: %s <subcommand> [options...]. Use %s <subcommand> for more options.\n"
-                             "Subcommands:\nsketch\ndist\nhll\nunion\nprintmat\nview\nmkdist\nflatten\n\ncmp is also now a synonym for dist, which will be deprecated in the future.\n", *argv, *argv);
+                             "Subcommands:\nsketch\ndist\nhll\nunion\nprintmat\nview\nmkdist\nflatten\nmerge-shards\npack\n\ncmp is also now a synonym for dist, which will be deprecated in the future.\n", *argv, *argv);
         RUNTIME_ERROR(std::string("Invalid subcommand ") + argv[1] + " provided.");
     }
 }
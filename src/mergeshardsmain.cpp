@@ -0,0 +1,132 @@
+#include "dashing.h"
+#include "sketch_and_cmp.h"
+
+namespace bns {
+
+namespace {
+
+void merge_shards_usage [[noreturn]] (const char *ex) {
+    std::fprintf(stderr, "Usage: %s merge-shards <opts> shard0 shard1 ... [all N shards written by dist --shard i/N, in any order]\n"
+                         "Flags:\n"
+                         "-o\tWrite the matrix to this file [stdout]\n"
+                         "-b\tEmit the binary distance matrix format, with its .labels and .result_type files (as dist -b)\n"
+                         "-T\tEmit a full (square) TSV (as dist -T)\n"
+                         "-U\tEmit PHYLIP upper triangular format (as dist -U)\n"
+                         "-e\tEmit in scientific notation\n"
+                         "Default: human-readable upper-triangular TSV, as dist.\n",
+                 ex);
+    std::exit(EXIT_FAILURE);
+}
+
+struct ShardFile {
+    std::string path;
+    std::FILE *fp = nullptr;
+    ShardHeader hdr;
+    std::vector<std::string> names;
+};
+
+void read_or_die(std::FILE *fp, void *data, size_t nb, const std::string &path) {
+    if(nb && std::fread(data, 1, nb, fp) != nb) RUNTIME_ERROR(std::string("Truncated shard at ") + path);
+}
+
+ShardFile open_shard(const std::string &path) {
+    ShardFile ret;
+    ret.path = path;
+    if((ret.fp = std::fopen(path.data(), "rb")) == nullptr) RUNTIME_ERROR(std::string("Could not open shard at ") + path);
+    read_or_die(ret.fp, &ret.hdr, sizeof(ret.hdr), path);
+    if(ret.hdr.magic != ShardHeader::MAGIC) RUNTIME_ERROR(path + " is not a shard written by dist --shard");
+    ret.names.resize(ret.hdr.n);
+    for(auto &name: ret.names) {
+        uint64_t l;
+        read_or_die(ret.fp, &l, sizeof(l), path);
+        name.resize(l);
+        read_or_die(ret.fp, &name[0], l, path);
+    }
+    return ret;
+}
+
+} // anonymous namespace
+
+/*
+ * Reassembles the all-pairs matrix from the shards written by `dist --shard i/N`.
+ * Shards are checked to come from the same inputs and comparison, and to cover every row exactly once.
+ * TSV outputs are streamed a row at a time; binary and full TSV build the matrix in memory, as dist does.
+ */
+int merge_shards_main(int argc, char *argv[]) {
+    EmissionFormat emit_fmt = UT_TSV;
+    bool use_scientific = false;
+    std::FILE *ofp = stdout;
+    std::string opath;
+    for(int c; (c = getopt(argc, argv, "o:bTUeh?")) >= 0;) {
+        switch(c) {
+            case 'o': opath = optarg; if((ofp = std::fopen(optarg, "wb")) == nullptr) LOG_EXIT("Could not open file at %s for writing.\n", optarg); break;
+            case 'b': emit_fmt = BINARY; break;
+            case 'T': emit_fmt = FULL_TSV; break;
+            case 'U': emit_fmt = UPPER_TRIANGULAR; break;
+            case 'e': use_scientific = true; break;
+            case 'h': case '?': merge_shards_usage(*argv);
+        }
+    }
+    if(optind == argc) merge_shards_usage(*argv);
+    std::vector<ShardFile> shards;
+    for(int i = optind; i < argc; ++i) shards.push_back(open_shard(argv[i]));
+    std::sort(shards.begin(), shards.end(), [](const ShardFile &a, const ShardFile &b) {return a.hdr.row_begin < b.hdr.row_begin;});
+    const ShardHeader &first = shards.front().hdr;
+    const size_t n = first.n;
+    if(shards.size() != first.nshards)
+        RUNTIME_ERROR(ks::sprintf("Expected %u shards, got %zu", first.nshards, shards.size()).data());
+    for(size_t i = 0; i < shards.size(); ++i) {
+        const ShardFile &s = shards[i];
+        if(s.hdr.n != n || s.hdr.nshards != first.nshards || s.hdr.result_type != first.result_type || s.names != shards.front().names)
+            RUNTIME_ERROR(s.path + " was computed from different inputs or with different options than " + shards.front().path);
+        if(s.hdr.row_begin != (i ? shards[i - 1].hdr.row_end: 0))
+            RUNTIME_ERROR(ks::sprintf("Shards do not cover row %zu exactly once (missing or duplicated shard?)", size_t(i ? shards[i - 1].hdr.row_end: 0)).data());
+    }
+    if(shards.back().hdr.row_end != n) RUNTIME_ERROR("Shards do not cover the last rows of the matrix (missing shard?)");
+    const std::vector<std::string> &names = shards.front().names;
+    LOG_INFO("Merging %zu shards of a %zu x %zu %s matrix\n", shards.size(), n, n, emt2str(static_cast<EmissionType>(first.result_type)));
+    if(emit_fmt == BINARY || emit_fmt == FULL_TSV) {
+        dm::DistanceMatrix<float> dm(n);
+        for(auto &s: shards)
+            for(size_t i = s.hdr.row_begin; i < s.hdr.row_end; ++i)
+                read_or_die(s.fp, dm.row_span(i).first, sizeof(float) * (n - i - 1), s.path);
+        if(emit_fmt == FULL_TSV) dm.printf(ofp, use_scientific, &names);
+        else                     dm.write(ofp);
+    } else {
+        ks::string str;
+        if(emit_fmt == UT_TSV) {
+            str.sprintf("##Names\t");
+            for(const auto &name: names) str.sprintf("%s\t", name.data());
+            str.back() = '\n';
+            str.write(fileno(ofp)); str.free();
+        } else {
+            std::fprintf(ofp, "%zu\n", n);
+            std::fflush(ofp);
+        }
+        std::vector<float> row(n);
+        for(auto &s: shards) {
+            for(size_t i = s.hdr.row_begin; i < s.hdr.row_end; ++i) {
+                read_or_die(s.fp, row.data(), sizeof(float) * (n - i - 1), s.path);
+                submit_emit_dists<float>(fileno(ofp), row.data(), n, i, str, names, emit_fmt, use_scientific);
+            }
+        }
+    }
+    for(auto &s: shards) std::fclose(s.fp);
+    if(ofp != stdout) std::fclose(ofp);
+    if(emit_fmt == BINARY) {
+        // Labels and result type beside the matrix, as dist writes them (and --extend-matrix expects them).
+        const std::string label = opath.empty() ? std::string("unspecified"): opath + ".labels";
+        std::FILE *fp = std::fopen(label.data(), "wb");
+        if(fp == nullptr) RUNTIME_ERROR(std::string("Could not open file at ") + label);
+        for(const auto &name: names) std::fwrite(name.data(), name.size(), 1, fp), std::fputc('\n', fp);
+        std::fclose(fp);
+        if(opath.size()) {
+            if((fp = std::fopen((opath + ".result_type").data(), "w")) == nullptr) RUNTIME_ERROR(std::string("Could not open file at ") + opath + ".result_type");
+            std::fprintf(fp, "%s\n", emt2str(static_cast<EmissionType>(first.result_type)));
+            std::fclose(fp);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+} // namespace bns
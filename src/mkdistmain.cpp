@@ -2,6 +2,11 @@
 
 namespace bns {
 
+/*
+ * Computes binary distance matrices for every k in [start, end) and flattens them into <outpref>.bin.
+ * All k-mer lengths are sketched from one pass over each input by a single dist_main call,
+ * rather than re-reading every file once per k.
+ */
 int mkdist_main(int argc, char *argv[]) {
     auto it = std::find_if(argv, argv + argc, [](auto x) {return std::strcmp("--multik", x) == 0;});
     std::string _outpref;
@@ -15,30 +20,32 @@ int mkdist_main(int argc, char *argv[]) {
     s = std::atoi(++pos);
     const char *outpref = _outpref.data();
     std::fprintf(stderr, "outpref: %s\n", _outpref.data());
+    if(!(pos = std::strchr(pos, ','))) RUNTIME_ERROR("Ill-formatted");
     e = std::atoi(++pos);
     if((pos = std::strchr(pos, ','))) {
         step = std::atoi(++pos);
-        assert(step > 0 ? e > s: e < s);
+        if(step == 0 || (step > 0) != (e > s)) RUNTIME_ERROR("step must be nonzero and move from start toward end");
     } else step = e > s ? 1: -1;
-    std::vector<std::string> ea(2);
-    for(auto &i: ea) i.resize(_outpref.size() + 32);
-    std::vector<char *> args(argv, argv + argc);
-    size_t nk = 0;
     std::vector<std::string> fpaths;
+    gargs.multik.clear();
+    gargs.multik_paths.clear();
     for(int ind = s; (e > s ? ind < e: ind > e); ind += step) {
+        if(ind <= 0) RUNTIME_ERROR("k must be positive");
         char buf[256]{0};
-        ea[0] = std::string(buf, std::sprintf(buf, "-bO_%s_%d", outpref, ind));
-        ea[1] = std::string(buf, std::sprintf(buf, "-k%d", ind));
         fpaths.push_back(std::string(buf, std::sprintf(buf, "_%s_%d", outpref, ind)));
-        size_t j = std::find_if(argv, argv + argc, [](auto x) {return std::strcmp("--multik", x) == 0;}) - argv;
-        assert(j != size_t(argc));
-        args[j] = &ea[0][0];
-        args[1] = &ea[1][0];
-        dist_main(args.size(), args.data());
-        ++nk;
+        gargs.multik.push_back(ind);
+        gargs.multik_paths.push_back(fpaths.back());
     }
+    if(fpaths.empty()) RUNTIME_ERROR("No k-mer lengths in range");
+    // Replace "--multik <spec>" with "-b" so that every matrix is written in binary for flattening.
+    char binflag[] = "-b";
+    std::vector<char *> args(argv, it - 1);
+    args.push_back(binflag);
+    args.insert(args.end(), it + 1, argv + argc);
+    args.push_back(nullptr);
+    if(int rc = dist_main(args.size() - 1, args.data())) return rc;
     std::string outpath = outpref;
     outpath += ".bin";
-    return flatten_all(fpaths, nk, outpath);
+    return flatten_all(fpaths, fpaths.size(), outpath);
 }
 } // namespace bns
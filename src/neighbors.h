@@ -0,0 +1,169 @@
+#pragma once
+#include "dashing.h"
+
+namespace bns {
+
+/*
+ * The k best-scoring neighbours of each of n rows, for --topk.
+ * Each row keeps a bounded heap of (score, neighbour) with its worst entry on top, so a candidate costs one comparison
+ * unless it displaces that entry. Memory is O(n * k) regardless of how many candidates are offered.
+ * Ties are broken in favour of the lower neighbour index, so results do not depend on the order of candidates.
+ */
+class NeighborHeaps {
+public:
+    using Entry = std::pair<float, uint32_t>;
+private:
+    std::vector<Entry> entries_;
+    std::vector<uint32_t> sizes_;
+    const size_t k_;
+    const bool larger_is_better_;
+
+    bool better(const Entry &a, const Entry &b) const {
+        if(a.first != b.first) return larger_is_better_ ? a.first > b.first: a.first < b.first;
+        return a.second < b.second;
+    }
+public:
+    NeighborHeaps(size_t nrows, size_t k, bool larger_is_better):
+        entries_(nrows * k), sizes_(nrows), k_(k), larger_is_better_(larger_is_better) {}
+    size_t k() const {return k_;}
+    size_t size() const {return sizes_.size();}
+    void push(size_t row, uint32_t neighbor, float score) {
+        if(std::isnan(score)) return;
+        const auto cmp = [this](const Entry &a, const Entry &b) {return better(a, b);};
+        Entry *const heap = entries_.data() + row * k_;
+        const Entry e(score, neighbor);
+        uint32_t &sz = sizes_[row];
+        if(sz < k_) {
+            heap[sz++] = e;
+            std::push_heap(heap, heap + sz, cmp);
+        } else if(better(e, heap[0])) {
+            std::pop_heap(heap, heap + sz, cmp);
+            heap[sz - 1] = e;
+            std::push_heap(heap, heap + sz, cmp);
+        }
+    }
+    // Offers row i of an all-pairs upper triangle (dists[j - i - 1] for j in (i, n)) to row i and, symmetrically, to each row j.
+    void add_upper_row(size_t i, const float *dists, size_t n) {
+        for(size_t j = i + 1; j < n; ++j) {
+            push(i, j, dists[j - i - 1]);
+            push(j, i, dists[j - i - 1]);
+        }
+    }
+    // Offers scores[j] for every j in [0, n) to row, skipping neighbour skip (e.g., the query itself).
+    void add_row(size_t row, const float *scores, size_t n, size_t skip=SIZE_MAX) {
+        for(size_t j = 0; j < n; ++j)
+            if(j != skip) push(row, j, scores[j]);
+    }
+    // Sorts every row best-first. Afterwards, rows(i) lists row i's neighbours in order.
+    void finalize() {
+        const auto cmp = [this](const Entry &a, const Entry &b) {return better(a, b);};
+        for(size_t i = 0; i < sizes_.size(); ++i)
+            std::sort_heap(entries_.data() + i * k_, entries_.data() + i * k_ + sizes_[i], cmp);
+    }
+    std::pair<const Entry *, size_t> row(size_t i) const {return {entries_.data() + i * k_, sizes_[i]};}
+    /*
+     * Writes the neighbours of every row, after finalize(). Row i is named names[row_offset + i]; neighbour j is names[j].
+     * TSV emits one line per (row, neighbour) pair, best first: "name\tneighbour\tscore\trank".
+     * Binary emits, for every row, k records of {uint32_t neighbour; float score}, padded with {UINT32_MAX, NaN}.
+     */
+    void write(std::FILE *ofp, const std::vector<std::string> &names, size_t row_offset, EmissionFormat emit_fmt, bool use_scientific, EmissionType result_type) const {
+        const int fn = ::fileno(ofp);
+        std::fflush(ofp);
+        if(emit_fmt == BINARY) {
+            struct __attribute__((packed)) Record {uint32_t id; float score;};
+            std::vector<Record> buf(k_);
+            for(size_t i = 0; i < sizes_.size(); ++i) {
+                const auto r = row(i);
+                for(size_t j = 0; j < k_; ++j)
+                    buf[j] = j < r.second ? Record{r.first[j].second, r.first[j].first}: Record{UINT32_MAX, std::numeric_limits<float>::quiet_NaN()};
+                const ssize_t nb = sizeof(Record) * k_;
+                if(::write(fn, buf.data(), nb) != nb) RUNTIME_ERROR("Error writing nearest neighbours to binary file");
+            }
+            return;
+        }
+        ks::string str;
+        str.sprintf("#Query\tNeighbor\t%s\tRank\n", emt2str(result_type));
+        const char *fmt = use_scientific ? "%s\t%s\t%e\t%zu\n": "%s\t%s\t%f\t%zu\n";
+        for(size_t i = 0; i < sizes_.size(); ++i) {
+            const auto r = row(i);
+            for(size_t j = 0; j < r.second; ++j) {
+                str.sprintf(fmt, names[row_offset + i].data(), names[r.first[j].second].data(), r.first[j].first, j + 1);
+                if(str.size() >= BUFFER_FLUSH_SIZE) str.flush(fn);
+            }
+        }
+        str.flush(fn);
+    }
+};
+
+/*
+ * Pairs whose value passes a threshold (at least --min-similarity, or at most --max-dist), written as an edge list.
+ * filter() runs on compute threads, one row at a time, into per-row buffers for one of two alternating blocks of rows,
+ * so rejected pairs never reach write(), which formats one block while the next is computed.
+ * TSV emits "name1\tname2\tvalue" lines; binary emits {uint32_t i; uint32_t j; float value} records (COO).
+ */
+class EdgeFilter {
+public:
+    struct __attribute__((packed)) Edge {
+        uint32_t i, j;
+        float value;
+    };
+private:
+    std::array<std::vector<std::vector<Edge>>, 2> blocks_;
+    const size_t block_rows_;
+    const float threshold_;
+    const bool larger_is_better_;
+    size_t nedges_ = 0;
+    ks::string str_;
+
+    bool keep(float v) const {return larger_is_better_ ? v >= threshold_: v <= threshold_;} // NaN never passes
+    std::vector<Edge> &slot(size_t i0, size_t i) {return blocks_[(i0 / block_rows_) & 1][i - i0];}
+public:
+    EdgeFilter(float threshold, bool larger_is_better, size_t block_rows):
+        block_rows_(std::max(block_rows, size_t(1))), threshold_(threshold), larger_is_better_(larger_is_better)
+    {
+        for(auto &b: blocks_) b.resize(block_rows_);
+    }
+    size_t nedges() const {return nedges_;}
+    // Row i of an all-pairs upper triangle (dists[j - i - 1] for j in (i, n)), in the block starting at row i0.
+    void filter_upper_row(size_t i0, size_t i, const float *dists, size_t n) {
+        auto &edges = slot(i0, i);
+        edges.clear();
+        for(size_t j = i + 1; j < n; ++j)
+            if(keep(dists[j - i - 1])) edges.push_back(Edge{uint32_t(i), uint32_t(j), dists[j - i - 1]});
+    }
+    // A query's values against every reference, as its own block of one row.
+    void filter_row(size_t row, const float *values, size_t n) {
+        auto &edges = slot(row, row);
+        edges.clear();
+        for(size_t j = 0; j < n; ++j)
+            if(keep(values[j])) edges.push_back(Edge{uint32_t(row), uint32_t(j), values[j]});
+    }
+    static void write_header(std::FILE *ofp, EmissionFormat emit_fmt, EmissionType result_type) {
+        if(emit_fmt == BINARY) return;
+        std::fprintf(ofp, "#Path1\tPath2\t%s\n", emt2str(result_type));
+        std::fflush(ofp);
+    }
+    // Writes rows [i0, i1) of the block starting at i0. Edge (i, j) is named names[row_offset + i], names[j].
+    void write(int fn, size_t i0, size_t i1, const std::vector<std::string> &names, size_t row_offset, EmissionFormat emit_fmt, bool use_scientific) {
+        for(size_t i = i0; i < i1; ++i) {
+            const auto &edges = slot(i0, i);
+            nedges_ += edges.size();
+            write_edges(fn, edges.data(), edges.size(), names, row_offset, emit_fmt, use_scientific, str_);
+        }
+        str_.flush(fn);
+    }
+    static void write_edges(int fn, const Edge *edges, size_t n, const std::vector<std::string> &names, size_t row_offset, EmissionFormat emit_fmt, bool use_scientific, ks::string &str) {
+        if(emit_fmt == BINARY) {
+            const ssize_t nb = sizeof(Edge) * n;
+            if(nb && ::write(fn, edges, nb) != nb) RUNTIME_ERROR("Error writing edges to binary file");
+            return;
+        }
+        const char *fmt = use_scientific ? "%s\t%s\t%e\n": "%s\t%s\t%f\n";
+        for(size_t i = 0; i < n; ++i) {
+            str.sprintf(fmt, names[row_offset + edges[i].i].data(), names[edges[i].j].data(), edges[i].value);
+            if(str.size() >= BUFFER_FLUSH_SIZE) str.flush(fn);
+        }
+    }
+};
+
+} // namespace bns
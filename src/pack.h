@@ -0,0 +1,256 @@
+#pragma once
+#include "dashing.h"
+#include <unordered_map>
+
+namespace bns {
+
+/*
+ * A sketch pack (`dashing pack`) holds many presketched sketches of one type and parameter set in a single file:
+ *   PackHeader
+ *   payloads, each aligned to PACK_ALIGN: the bytes a sketch's own write() produces, uncompressed
+ *   index: a PackEntry per sketch, in the order given to pack
+ *   strings: the spacing, then every name
+ * dist --presketched maps a pack once, and reads each sketch from its payload instead of opening a file per sketch.
+ * Full hash sets (compact format) are used in place; other sketch types are read through zlib from the pack's file.
+ * A payload which happens to begin with the gzip magic number is stored as a gzip stream of stored (uncompressed) blocks,
+ * so that zlib does not mistake it for a compressed one.
+ */
+struct PackHeader {
+    static constexpr uint64_t MAGIC = 0x4b43415048534144ull; // "DASHPACK", little-endian
+    static constexpr uint32_t VERSION = 1;
+    uint64_t magic = MAGIC;
+    uint32_t version = VERSION;
+    int32_t sketch_type = HLL;
+    uint32_t k = 0, w = 0, sketch_size = 0, encoding = BONSAI; // As in the sketches' file names (see make_fname); w is at least the k-mer span
+    uint64_t n = 0, index_offset = 0, strings_offset = 0, spacing_bytes = 0;
+};
+struct PackEntry {
+    static constexpr uint32_t GZIP_WRAPPED = 1;
+    uint64_t offset, bytes, name_offset;
+    uint32_t name_bytes, flags;
+};
+static constexpr size_t PACK_ALIGN = 64;
+static constexpr const char *PACK_SUFFIX = ".dpk"; // dist reads inputs with this suffix as packs
+
+class SketchPack: public std::enable_shared_from_this<SketchPack> {
+    std::string path_;
+    void *map_ = nullptr;
+    size_t maplen_ = 0;
+    PackHeader hdr_;
+    const PackEntry *index_ = nullptr;
+    const char *strings_ = nullptr;
+    std::vector<int> fds_; // One per thread, so that each can seek independently
+    SketchPack() {}
+public:
+    SketchPack(const SketchPack &) = delete;
+    SketchPack &operator=(const SketchPack &) = delete;
+    ~SketchPack() {
+        if(map_) ::munmap(map_, maplen_);
+        for(const int fd: fds_) if(fd >= 0) ::close(fd);
+    }
+    static bool is_pack_path(const std::string &path) {
+        const size_t l = std::strlen(PACK_SUFFIX);
+        return path.size() > l && path.compare(path.size() - l, l, PACK_SUFFIX) == 0;
+    }
+    static std::shared_ptr<SketchPack> open(const std::string &path) {
+        std::shared_ptr<SketchPack> ret(new SketchPack);
+        ret->path_ = path;
+        const int fd = ::open(path.data(), O_RDONLY);
+        if(fd < 0) RUNTIME_ERROR(std::string("Could not open sketch pack at ") + path);
+        struct stat st;
+        if(::fstat(fd, &st) || size_t(st.st_size) < sizeof(PackHeader) || ::pread(fd, &ret->hdr_, sizeof(PackHeader), 0) != ssize_t(sizeof(PackHeader))) {
+            ::close(fd);
+            RUNTIME_ERROR(std::string("Could not read sketch pack header at ") + path);
+        }
+        const PackHeader &h = ret->hdr_;
+        if(h.magic != PackHeader::MAGIC) {::close(fd); RUNTIME_ERROR(path + " is not a sketch pack written by dashing pack");}
+        if(h.version != PackHeader::VERSION) {::close(fd); RUNTIME_ERROR(path + ": sketch pack version " + std::to_string(h.version) + " is not supported by this version of dashing");}
+        if(h.sketch_type < 0 || size_t(h.sketch_type) >= sizeof(sketch_names) / sizeof(char *)) {::close(fd); RUNTIME_ERROR(path + " is a corrupt sketch pack: unknown sketch type " + std::to_string(h.sketch_type));}
+        if(h.encoding > CYCLIC) {::close(fd); RUNTIME_ERROR(path + " is a corrupt sketch pack: unknown encoding " + std::to_string(h.encoding));}
+        ret->maplen_ = st.st_size;
+        ret->map_ = ::mmap(nullptr, ret->maplen_, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if(ret->map_ == MAP_FAILED) {ret->map_ = nullptr; RUNTIME_ERROR(std::string("Could not map sketch pack at ") + path);}
+        if(h.index_offset + h.n * sizeof(PackEntry) > ret->maplen_ || h.strings_offset > ret->maplen_)
+            RUNTIME_ERROR(path + " is a truncated sketch pack");
+        ret->index_ = reinterpret_cast<const PackEntry *>(static_cast<const char *>(ret->map_) + h.index_offset);
+        ret->strings_ = static_cast<const char *>(ret->map_) + h.strings_offset;
+        for(size_t i = 0; i < h.n; ++i)
+            if(ret->index_[i].offset + ret->index_[i].bytes > ret->maplen_ || h.strings_offset + ret->index_[i].name_offset + ret->index_[i].name_bytes > ret->maplen_)
+                RUNTIME_ERROR(path + " is a truncated sketch pack");
+        ret->fds_.assign(omp_get_max_threads(), -1);
+        return ret;
+    }
+    const std::string &path() const {return path_;}
+    const PackHeader &header() const {return hdr_;}
+    size_t size() const {return hdr_.n;}
+    std::string name(size_t i) const {return std::string(strings_ + index_[i].name_offset, index_[i].name_bytes);}
+    std::string spacing() const {return std::string(strings_, hdr_.spacing_bytes);}
+    const void *payload(size_t i) const {return static_cast<const char *>(map_) + index_[i].offset;}
+    size_t payload_bytes(size_t i) const {return index_[i].bytes;}
+    bool wrapped(size_t i) const {return index_[i].flags & PackEntry::GZIP_WRAPPED;}
+    // A stream over payload i, for the sketch types' own readers. Close it with gzclose.
+    gzFile open_payload(size_t i) {
+        int &fd = fds_.at(omp_get_thread_num());
+        if(fd < 0 && (fd = ::open(path_.data(), O_RDONLY)) < 0) RUNTIME_ERROR(std::string("Could not open sketch pack at ") + path_);
+        int dfd;
+        if(::lseek(fd, index_[i].offset, SEEK_SET) < 0 || (dfd = ::dup(fd)) < 0) RUNTIME_ERROR(std::string("Could not seek in sketch pack at ") + path_);
+        gzFile fp = gzdopen(dfd, "rb"); // Reads from the current offset
+        if(fp == nullptr) RUNTIME_ERROR(std::string("Could not read sketch pack at ") + path_);
+        return fp;
+    }
+};
+
+/*
+ * Writes a sketch pack. Payloads are appended in the order given; finish() writes the index and names, then the completed header.
+ */
+class PackWriter {
+    std::string path_;
+    int fd_ = -1;
+    PackHeader hdr_;
+    uint64_t offset_ = sizeof(PackHeader);
+    std::vector<PackEntry> index_;
+    std::string strings_;
+    void write_or_die(const void *data, size_t nb) {
+        for(const char *p = static_cast<const char *>(data); nb;) {
+            const ssize_t w = ::write(fd_, p, nb);
+            if(w <= 0) RUNTIME_ERROR(std::string("Could not write to ") + path_);
+            p += w, nb -= w;
+        }
+    }
+    // Writes sketch at the current offset through zlib in mode, returning the offset after it.
+    template<typename SketchType>
+    off_t write_sketch(const SketchType &sketch, const char *mode) {
+        const int dfd = ::dup(fd_); // Shares fd_'s offset
+        gzFile fp = dfd < 0 ? nullptr: gzdopen(dfd, mode);
+        if(fp == nullptr) RUNTIME_ERROR(std::string("Could not write to ") + path_);
+        sketch.write(fp);
+        const off_t end = gzclose(fp) == Z_OK ? ::lseek(fd_, 0, SEEK_CUR): -1;
+        if(end < 0) RUNTIME_ERROR(std::string("Could not write to ") + path_);
+        return end;
+    }
+    void align() {
+        static const char zeros[PACK_ALIGN] {0};
+        const size_t pad = (PACK_ALIGN - offset_ % PACK_ALIGN) % PACK_ALIGN;
+        write_or_die(zeros, pad);
+        offset_ += pad;
+    }
+public:
+    PackWriter(const std::string &path, const PackHeader &hdr, const std::string &spacing): path_(path), hdr_(hdr), strings_(spacing) {
+        if((fd_ = ::open(path.data(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) RUNTIME_ERROR(std::string("Could not open ") + path + " for writing");
+        hdr_.spacing_bytes = spacing.size();
+        write_or_die(&hdr_, sizeof(hdr_)); // Rewritten by finish(), once the index's position is known
+    }
+    PackWriter(const PackWriter &) = delete;
+    PackWriter &operator=(const PackWriter &) = delete;
+    ~PackWriter() {if(fd_ >= 0) ::close(fd_);}
+    const std::string &path() const {return path_;}
+    size_t size() const {return index_.size();}
+    uint64_t bytes() const {return offset_;}
+    void add(const std::string &name, const void *data, size_t nb, uint32_t flags=0) {
+        align();
+        index_.push_back(PackEntry{offset_, nb, strings_.size(), uint32_t(name.size()), flags});
+        strings_ += name;
+        write_or_die(data, nb);
+        offset_ += nb;
+    }
+    // Appends what sketch.write(gzFile) writes, uncompressed; wrapped (see GZIP_WRAPPED) only if it begins with the gzip magic number.
+    template<typename SketchType>
+    void add_sketch(const std::string &name, const SketchType &sketch) {
+        align();
+        uint32_t flags = 0;
+        off_t end = write_sketch(sketch, "wT");
+        uint8_t magic[2];
+        if(end - offset_ >= 2 && ::pread(fd_, magic, 2, offset_) == 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+            if(::ftruncate(fd_, offset_) || ::lseek(fd_, offset_, SEEK_SET) < 0) RUNTIME_ERROR(std::string("Could not write to ") + path_);
+            end = write_sketch(sketch, "wb0");
+            flags = PackEntry::GZIP_WRAPPED;
+        }
+        index_.push_back(PackEntry{offset_, uint64_t(end) - offset_, strings_.size(), uint32_t(name.size()), flags});
+        strings_ += name;
+        offset_ = end;
+    }
+    // Returns the pack's size in bytes.
+    uint64_t finish() {
+        align();
+        hdr_.n = index_.size();
+        hdr_.index_offset = offset_;
+        hdr_.strings_offset = hdr_.index_offset + index_.size() * sizeof(PackEntry);
+        write_or_die(index_.data(), index_.size() * sizeof(PackEntry));
+        write_or_die(strings_.data(), strings_.size());
+        if(::pwrite(fd_, &hdr_, sizeof(hdr_), 0) != ssize_t(sizeof(hdr_)) || ::close(fd_)) {fd_ = -1; RUNTIME_ERROR(std::string("Could not write to ") + path_);}
+        fd_ = -1;
+        return hdr_.strings_offset + strings_.size();
+    }
+};
+
+/*
+ * Replaces each pack in paths (presketched inputs ending in PACK_SUFFIX) with the names of its sketches,
+ * returning, for every resulting path, the pack and index holding its sketch (null for ordinary sketch files).
+ * The last nq paths are queries; nq is updated to count the queries after expansion.
+ */
+inline std::vector<std::pair<std::shared_ptr<SketchPack>, size_t>> expand_packs(std::vector<std::string> &paths, size_t &nq) {
+    std::vector<std::pair<std::shared_ptr<SketchPack>, size_t>> members;
+    if(std::none_of(paths.begin(), paths.end(), SketchPack::is_pack_path)) return members;
+    std::unordered_map<std::string, std::shared_ptr<SketchPack>> packs;
+    std::vector<std::string> expanded;
+    size_t nq_expanded = 0;
+    for(size_t i = 0; i < paths.size(); ++i) {
+        const bool is_query = i >= paths.size() - nq;
+        if(!SketchPack::is_pack_path(paths[i])) {
+            expanded.push_back(std::move(paths[i]));
+            members.emplace_back(nullptr, 0);
+            nq_expanded += is_query;
+            continue;
+        }
+        auto &pack = packs[paths[i]];
+        if(!pack) {
+            pack = SketchPack::open(paths[i]);
+            const PackHeader &h = pack->header();
+            LOG_INFO("Sketch pack %s: %zu %s sketches, k = %u, w = %u, sketch size %u%s%s\n", paths[i].data(), pack->size(),
+                     sketch_names[h.sketch_type], h.k, h.w, h.sketch_size,
+                     pack->spacing().size() ? ", spacing ": "", pack->spacing().data());
+        }
+        for(size_t j = 0; j < pack->size(); ++j) {
+            expanded.push_back(pack->name(j));
+            members.emplace_back(pack, j);
+        }
+        nq_expanded += is_query * pack->size();
+    }
+    paths = std::move(expanded);
+    nq = nq_expanded;
+    return members;
+}
+
+namespace detail {
+template<typename SketchType, typename FinalType>
+void read_packed(SketchType &sketch, FinalType *, SketchPack &pack, size_t i, std::true_type) {
+    gzFile fp = pack.open_payload(i);
+    sketch.read(fp);
+    gzclose(fp);
+}
+template<typename FinalType>
+void read_packed(khset64_t &sketch, FinalType *, SketchPack &pack, size_t i, std::true_type) {
+    if(!pack.wrapped(i) && CompactSetView::has_magic(pack.payload(i), pack.payload_bytes(i))) {
+        sketch.adopt(CompactSetFile::borrow(pack.shared_from_this(), pack.payload(i), pack.payload_bytes(i)));
+        return;
+    }
+    gzFile fp = pack.open_payload(i);
+    sketch.read(fp);
+    gzclose(fp);
+}
+template<typename SketchType, typename FinalType>
+void read_packed(SketchType &, FinalType *dest, SketchPack &pack, size_t i, std::false_type) {
+    gzFile fp = pack.open_payload(i);
+    new(dest) FinalType(fp);
+    gzclose(fp);
+}
+} // namespace detail
+
+// Loads sketch i of pack into sketch (when it is its own final type) or constructs it at dest, as dist does from a path.
+template<typename SketchType, typename FinalType>
+void read_packed(SketchType &sketch, FinalType *dest, SketchPack &pack, size_t i) {
+    detail::read_packed(sketch, dest, pack, i, std::is_same<SketchType, FinalType>());
+}
+
+} // namespace bns
@@ -0,0 +1,191 @@
+#include "dashing.h"
+#include "pack.h"
+
+namespace bns {
+
+namespace {
+
+void pack_usage [[noreturn]] (const char *ex) {
+    std::fprintf(stderr, "Usage: %s pack <opts> -o out%s sketch1 sketch2 ... [sketches written by dashing sketch, all of one type]\n"
+                         "Flags:\n"
+                         "-o\tWrite the pack to this path (required). dist --presketched reads inputs ending in %s as packs.\n"
+                         "-F\tRead sketch paths from this file, one per line\n"
+                         "-p\tNumber of threads reading sketches [1]\n"
+                         "The sketch type is taken from the sketches' suffix (.hll, .khs, .rmh, ...). Sketches are named by their paths, as in dist.\n"
+                         "k, window, spacing, encoding and sketch size, which the pack records and dist checks, are read from the sketches' file names\n"
+                         "as dashing sketch writes them (e.g., genome.fa.w.31.spacing.10.hll); every sketch must have been made with the same ones.\n",
+                 ex, PACK_SUFFIX, PACK_SUFFIX);
+    std::exit(EXIT_FAILURE);
+}
+
+const std::pair<const char *, Sketch> sketch_suffixes[] {
+    {SketchFileSuffix<hll::hll_t>::suffix, HLL},
+    {SketchFileSuffix<bf::bf_t>::suffix, BLOOM_FILTER},
+    {SketchFileSuffix<mh::RangeMinHash<uint64_t>>::suffix, RANGE_MINHASH},
+    {SketchFileSuffix<khset64_t>::suffix, FULL_KHASH_SET},
+    {SketchFileSuffix<mh::CountingRangeMinHash<uint64_t>>::suffix, COUNTING_RANGE_MINHASH},
+    {SketchFileSuffix<mh::BBitMinHasher<uint64_t>>::suffix, BB_MINHASH},
+    {SketchFileSuffix<SuperMinHashType>::suffix, BB_SUPERMINHASH},
+    {SketchFileSuffix<CBBMinHashType>::suffix, COUNTING_BB_MINHASH},
+};
+
+bool ends_with(const std::string &path, const char *suffix) {
+    const size_t l = std::strlen(suffix);
+    return path.size() > l && path.compare(path.size() - l, l, suffix) == 0;
+}
+
+Sketch sketch_from_suffix(const std::string &path) {
+    for(const auto &s: sketch_suffixes)
+        if(ends_with(path, s.first)) return s.second;
+    RUNTIME_ERROR(std::string("Could not tell the sketch type of ") + path + " from its suffix");
+}
+
+/*
+ * The parameters make_fname writes into a sketch's file name:
+ *   <input>.w[window].<k>.spacing<spacing>.[nt.|cyclic.][suf<suffix>.]<sketch size><type suffix>
+ * The window is written only when it exceeds the k-mer span, so window is 0 for unwindowed sketches.
+ */
+struct NameParams {
+    unsigned k = 0, window = 0, sketch_size = 0;
+    EncodingType enct = BONSAI;
+    std::string spacing;
+    bool operator==(const NameParams &o) const {
+        return k == o.k && window == o.window && sketch_size == o.sketch_size && enct == o.enct && spacing == o.spacing;
+    }
+};
+
+// The start of the run of digits ending at end in s.
+size_t digits_before(const std::string &s, size_t end) {
+    while(end && std::isdigit(static_cast<unsigned char>(s[end - 1]))) --end;
+    return end;
+}
+
+// Parses the parameters from path, a sketch of type, into ret. Returns false if its name is not of make_fname's form.
+bool parse_sketch_name(const std::string &path, Sketch type, NameParams &ret) {
+    const char *suffix = nullptr;
+    for(const auto &t: sketch_suffixes)
+        if(t.second == type && ends_with(path, t.first)) {suffix = t.first; break;}
+    if(suffix == nullptr) return false;
+    const std::string s = path.substr(0, path.size() - std::strlen(suffix));
+    const size_t size_begin = digits_before(s, s.size());
+    if(size_begin == s.size() || size_begin == 0 || s[size_begin - 1] != '.') return false;
+    const size_t sp = s.rfind(".spacing", size_begin - 1);
+    if(sp == std::string::npos) return false;
+    const size_t k_begin = digits_before(s, sp);
+    if(k_begin == sp || k_begin == 0 || s[k_begin - 1] != '.') return false;
+    const size_t w_begin = digits_before(s, k_begin - 1);
+    if(w_begin < 2 || s.compare(w_begin - 2, 2, ".w")) return false;
+    const size_t spacing_begin = sp + std::strlen(".spacing"), spacing_end = s.find('.', spacing_begin);
+    if(spacing_end >= size_begin) return false;
+    std::string rest = s.substr(spacing_end + 1, size_begin - spacing_end - 1); // Encoding and suffix, each ending in '.'
+    ret.enct = BONSAI;
+    if(rest.compare(0, 3, "nt.") == 0)          ret.enct = NTHASH, rest.erase(0, 3);
+    else if(rest.compare(0, 7, "cyclic.") == 0) ret.enct = CYCLIC, rest.erase(0, 7);
+    if(rest.size() && rest.compare(0, 3, "suf")) return false;
+    ret.k = std::strtoul(s.data() + k_begin, nullptr, 10);
+    ret.window = w_begin == k_begin - 1 ? 0: std::strtoul(s.data() + w_begin, nullptr, 10);
+    ret.sketch_size = std::strtoul(s.data() + size_begin, nullptr, 10);
+    ret.spacing = s.substr(spacing_begin, spacing_end - spacing_begin);
+    return true;
+}
+
+// A sketch file's contents, decompressed if they were written compressed.
+std::string slurp(const std::string &path) {
+    gzFile fp = gzopen(path.data(), "rb");
+    if(fp == nullptr) RUNTIME_ERROR(std::string("Could not open sketch at ") + path);
+    std::string ret;
+    static constexpr size_t CHUNK = size_t(1) << 16;
+    for(int nr;;) {
+        const size_t l = ret.size();
+        ret.resize(l + CHUNK);
+        if((nr = gzread(fp, &ret[l], CHUNK)) < 0) {gzclose(fp); RUNTIME_ERROR(std::string("Could not read sketch at ") + path);}
+        ret.resize(l + nr);
+        if(size_t(nr) < CHUNK) break;
+    }
+    gzclose(fp);
+    return ret;
+}
+
+// Wraps data in a gzip stream of stored blocks, so that zlib returns it as is even though it begins with the gzip magic number.
+std::string gzip_stored(const std::string &data) {
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if(deflateInit2(&zs, 0, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) RUNTIME_ERROR("Could not initialize zlib");
+    std::string ret(deflateBound(&zs, data.size()), '\0');
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+    zs.avail_in = data.size();
+    zs.next_out = reinterpret_cast<Bytef *>(&ret[0]);
+    zs.avail_out = ret.size();
+    const int rc = deflate(&zs, Z_FINISH);
+    ret.resize(zs.total_out);
+    deflateEnd(&zs);
+    if(rc != Z_STREAM_END) RUNTIME_ERROR("Could not wrap sketch payload");
+    return ret;
+}
+
+} // anonymous namespace
+
+/*
+ * Writes presketched sketches into one sketch pack (see PackHeader), which dist --presketched reads with one open and one mapping.
+ * Sketches are read a batch at a time in parallel and written in the order given.
+ */
+int pack_main(int argc, char *argv[]) {
+    const char *opath = nullptr;
+    std::vector<std::string> paths;
+    PackHeader hdr;
+    int nthreads = 1;
+    for(int c; (c = getopt(argc, argv, "o:F:p:h?")) >= 0;) {
+        switch(c) {
+            case 'o': opath = optarg; break;
+            case 'F': paths = get_paths(optarg); break;
+            case 'p': nthreads = std::max(std::atoi(optarg), 1); break;
+            case 'h': case '?': pack_usage(*argv);
+        }
+    }
+    std::for_each(argv + optind, argv + argc, [&](const char *s){paths.emplace_back(s);});
+    if(opath == nullptr || paths.empty()) pack_usage(*argv);
+    if(!SketchPack::is_pack_path(opath)) LOG_WARNING("%s does not end in %s, so dist will not recognize it as a sketch pack.\n", opath, PACK_SUFFIX);
+    hdr.sketch_type = sketch_from_suffix(paths.front());
+    NameParams params;
+    for(const auto &path: paths) {
+        NameParams p;
+        if(sketch_from_suffix(path) != hdr.sketch_type)
+            RUNTIME_ERROR(path + " is a different type of sketch than " + paths.front() + "; a pack holds sketches of one type.");
+        if(!parse_sketch_name(path, Sketch(hdr.sketch_type), p))
+            RUNTIME_ERROR(path + " is not named as dashing sketch names sketches, so the parameters it was made with are unknown.");
+        if(&path == &paths.front()) params = p;
+        else if(!(p == params))
+            RUNTIME_ERROR(path + " was sketched with different parameters than " + paths.front() + "; a pack holds sketches of one parameter set.");
+    }
+    const std::string &spacing = params.spacing;
+    hdr.k = params.k;
+    hdr.w = Spacer(params.k, params.window, parse_spacing(spacing.data(), params.k)).w_;
+    hdr.sketch_size = params.sketch_size;
+    hdr.encoding = params.enct;
+    omp_set_num_threads(nthreads);
+    PackWriter writer(opath, hdr, spacing);
+    const size_t batch_size = std::max(size_t(nthreads) * 16, size_t(256));
+    std::vector<std::string> payloads(batch_size);
+    for(size_t b0 = 0; b0 < paths.size(); b0 += batch_size) {
+        const size_t b1 = std::min(b0 + batch_size, paths.size());
+        std::vector<uint32_t> flags(b1 - b0);
+        #pragma omp parallel for schedule(dynamic)
+        for(size_t i = b0; i < b1; ++i) {
+            std::string &p = payloads[i - b0];
+            p = slurp(paths[i]);
+            if(p.size() >= 2 && uint8_t(p[0]) == 0x1f && uint8_t(p[1]) == 0x8b)
+                p = gzip_stored(p), flags[i - b0] = PackEntry::GZIP_WRAPPED;
+        }
+        for(size_t i = b0; i < b1; ++i) {
+            std::string &p = payloads[i - b0];
+            writer.add(paths[i], p.data(), p.size(), flags[i - b0]);
+            std::string().swap(p);
+        }
+        LOG_DEBUG("Packed %zu/%zu sketches\n", b1, paths.size());
+    }
+    const uint64_t nbytes = writer.finish();
+    LOG_INFO("Packed %zu %s sketches into %s (%zu bytes)\n", paths.size(), sketch_names[hdr.sketch_type], opath, size_t(nbytes));
+    return EXIT_SUCCESS;
+}
+
+} // namespace bns
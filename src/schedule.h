@@ -0,0 +1,95 @@
+#pragma once
+#include "dashing.h"
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+
+namespace bns {
+
+/*
+ * Predicted and observed load balance of a pass over inputs.
+ * The prediction assigns each input's estimated work (detail::estimate_work), in processing order, to the least-loaded thread,
+ * which is what schedule(dynamic) does if run time is proportional to the estimate; split inputs load every thread equally.
+ * The observation is the wall time each thread spent on inputs.
+ * Imbalance is the busiest thread's load over the mean load, so 1 is perfect balance.
+ */
+class ScheduleReport {
+    std::vector<double> predicted_, busy_;
+public:
+    ScheduleReport(unsigned nthreads): predicted_(std::max(nthreads, 1u)), busy_(predicted_.size()) {}
+    void plan(size_t work, bool split) {
+        if(split) for(auto &p: predicted_) p += double(work) / predicted_.size();
+        else      *std::min_element(predicted_.begin(), predicted_.end()) += work;
+    }
+    template<typename Func>
+    void time(unsigned tid, const Func &func) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        busy_[tid] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    template<typename Func>
+    void time_all(const Func &func) {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        const double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        for(auto &b: busy_) b += t;
+    }
+    static double imbalance(const std::vector<double> &loads) {
+        const double mean = std::accumulate(loads.begin(), loads.end(), 0.) / loads.size();
+        return mean > 0. ? *std::max_element(loads.begin(), loads.end()) / mean: 1.;
+    }
+    void report(const char *what) const {
+        LOG_INFO("%s load imbalance over %zu threads (max/mean; 1 is perfect): predicted %.3f, actual %.3f\n",
+                 what, busy_.size(), imbalance(predicted_), imbalance(busy_));
+    }
+};
+
+/*
+ * Chooses which inputs to split across all threads (see SplitFiller) when splitting was requested:
+ * those with more than a fair share (1 / nthreads) of the total estimated work, which would otherwise finish last.
+ * The rest are still sketched one per thread. With a single thread, every input is split, since only the
+ * pipeline can add parallelism.
+ */
+inline std::vector<bool> choose_split_inputs(const std::vector<size_t> &work, unsigned nthreads, bool split) {
+    std::vector<bool> ret(work.size(), split && nthreads <= 1);
+    if(split && nthreads > 1) {
+        const double total = std::accumulate(work.begin(), work.end(), 0.);
+        for(size_t i = 0; i < work.size(); ++i) ret[i] = work[i] * double(nthreads) > total;
+    }
+    return ret;
+}
+
+/*
+ * Calls func(i, split) for every input: first each split input in turn, with all threads available to it,
+ * then the others in parallel, largest-first if inputs were sorted by detail::sort_paths_by_work.
+ * Records planned and observed loads in report.
+ * An exception thrown by func for an input run in parallel cannot leave the parallel region, so the first is kept,
+ * the inputs not yet started are skipped, and it is rethrown once the region ends.
+ */
+template<typename Func>
+void for_each_scheduled(const std::vector<size_t> &work, const std::vector<bool> &split, ScheduleReport &report, const Func &func) {
+    for(size_t i = 0; i < split.size(); ++i)
+        if(split[i]) report.plan(work[i], true);
+    for(size_t i = 0; i < split.size(); ++i)
+        if(!split[i]) report.plan(work[i], false);
+    for(size_t i = 0; i < split.size(); ++i)
+        if(split[i]) report.time_all([&]() {func(i, true);});
+    std::mutex m;
+    std::exception_ptr err;
+    std::atomic<bool> failed(false);
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t i = 0; i < split.size(); ++i) {
+        if(split[i] || failed) continue;
+        try {
+            report.time(omp_get_thread_num(), [&]() {func(i, false);});
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(m);
+            if(!err) err = std::current_exception();
+            failed = true;
+        }
+    }
+    if(err) std::rethrow_exception(err);
+}
+
+} // namespace bns
@@ -0,0 +1,132 @@
+#include "compactset.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+// Compares intersection_size (used by full khash set comparisons) against std::set_intersection, for correctness and throughput,
+// on .khs files written by `dashing sketch --use-full-khash-sets` or on random sets of genome size.
+// Also times the intersection of the same sets stored in the compact (mapped) format, and reports its size.
+// Build with `make setbench` (add -mavx2 for the SIMD merge).
+
+using namespace bns;
+
+int usage(const char *arg) {
+    std::fprintf(stderr, "Usage: %s <flags> [a.khs b.khs ...: compare every pair of these sets instead of random ones]\n"
+                         "-n\tKeys in the larger random set [5000000]\n-r\tRatios of larger to smaller random set; repeatable [1,4,100]\n"
+                         "-j\tFraction of the smaller random set shared with the larger [0.9]\n-R\tRepetitions [5]\n-s\tSeed [13]\n", arg);
+    return EXIT_FAILURE;
+}
+
+// The implementation replaced by intersection_size.
+struct Counter {
+    struct value_type { template<typename T> value_type(const T &) {} };
+    void push_back(const value_type &) {++count;}
+    size_t count = 0;
+};
+size_t std_intersection_size(const std::vector<uint64_t> &a, const std::vector<uint64_t> &b) {
+    Counter c;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(c));
+    return c.count;
+}
+
+std::vector<uint64_t> read_khs(const char *path) {
+    if(auto compact = CompactSetFile::open(path)) {
+        std::vector<uint64_t> ret(compact->view().size());
+        compact->view().decode_all(ret.data());
+        return ret;
+    }
+    gzFile fp = gzopen(path, "rb");
+    uint64_t n;
+    if(fp == nullptr || gzread(fp, &n, sizeof(n)) != sizeof(n)) {std::fprintf(stderr, "Could not read %s\n", path); std::exit(EXIT_FAILURE);}
+    std::vector<uint64_t> ret(n);
+    if(gzread(fp, ret.data(), n * sizeof(uint64_t)) != ssize_t(n * sizeof(uint64_t))) {std::fprintf(stderr, "Truncated %s\n", path); std::exit(EXIT_FAILURE);}
+    gzclose(fp);
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+// Writes keys in the compact format to a temporary file and maps it.
+std::shared_ptr<CompactSetFile> to_compact(const std::vector<uint64_t> &keys) {
+    char path[] = "/tmp/setbenchXXXXXX";
+    const int fd = mkstemp(path);
+    if(fd < 0) {std::perror("mkstemp"); std::exit(EXIT_FAILURE);}
+    gzFile fp = gzdopen(fd, "wT");
+    CompactSetWriter writer(fp);
+    writer.add(keys.data(), keys.size());
+    writer.finish();
+    gzclose(fp);
+    auto ret = CompactSetFile::open(path);
+    unlink(path);
+    return ret;
+}
+
+template<typename F>
+double time_pass(unsigned reps, const F &f) {
+    auto start = std::chrono::high_resolution_clock::now();
+    for(unsigned i = 0; i < reps; ++i) f();
+    return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count() / reps;
+}
+
+bool compare(const char *label, const std::vector<uint64_t> &a, const std::vector<uint64_t> &b, unsigned reps) {
+    size_t expected = 0, got = 0, gotc = 0;
+    const double ts = time_pass(reps, [&]() {expected = std_intersection_size(a, b);});
+    const double tk = time_pass(reps, [&]() {got = intersection_size(a.data(), a.size(), b.data(), b.size());});
+    const auto ca = to_compact(a), cb = to_compact(b);
+    const double tc = time_pass(reps, [&]() {gotc = intersection_size(ca->view(), cb->view());});
+    const double mkeys = (a.size() + b.size()) / 1e6;
+    const double bits = 8. * (ca->bytes() + cb->bytes()) / (a.size() + b.size());
+    std::fprintf(stdout, "%s\t|a|=%zu\t|b|=%zu\tshared=%zu\tset_intersection=%.1f Mkeys/s\tkernel=%.1f Mkeys/s\tspeedup=%.2f\t"
+                         "compact=%.1f Mkeys/s\tcompact bits/key=%.1f\t%s\n",
+                 label, a.size(), b.size(), got, mkeys / ts, mkeys / tk, ts / tk, mkeys / tc, bits, expected == got && expected == gotc ? "identical": "MISMATCH");
+    return expected == got && expected == gotc;
+}
+
+int main(int argc, char *argv[]) {
+    size_t n = 5000000;
+    std::vector<double> ratios;
+    double shared = 0.9;
+    unsigned reps = 5;
+    uint64_t seed = 13;
+    for(int c; (c = getopt(argc, argv, "n:r:j:R:s:h?")) >= 0;) {
+        switch(c) {
+            case 'n': n = std::strtoull(optarg, nullptr, 10); break;
+            case 'r': ratios.push_back(std::atof(optarg)); break;
+            case 'j': shared = std::atof(optarg); break;
+            case 'R': reps = std::max(std::atoi(optarg), 1); break;
+            case 's': seed = std::strtoull(optarg, nullptr, 10); break;
+            case 'h': case '?': return usage(*argv);
+        }
+    }
+    int ret = EXIT_SUCCESS;
+    if(optind < argc) {
+        std::vector<std::vector<uint64_t>> sets;
+        for(int i = optind; i < argc; ++i) sets.push_back(read_khs(argv[i]));
+        for(size_t i = 0; i < sets.size(); ++i)
+            for(size_t j = i + 1; j < sets.size(); ++j)
+                if(!compare((std::string(argv[optind + i]) + " x " + argv[optind + j]).data(), sets[i], sets[j], reps)) ret = EXIT_FAILURE;
+        return ret;
+    }
+    if(ratios.empty()) ratios = {1, 4, 100};
+    std::mt19937_64 mt(seed);
+    std::vector<uint64_t> large(n);
+    for(auto &x: large) x = mt();
+    std::sort(large.begin(), large.end());
+    large.erase(std::unique(large.begin(), large.end()), large.end());
+    for(const double ratio: ratios) {
+        const size_t ns = std::max(size_t(large.size() / ratio), size_t(1));
+        std::vector<uint64_t> small;
+        std::uniform_real_distribution<double> urd;
+        std::uniform_int_distribution<size_t> pick(0, large.size() - 1);
+        while(small.size() < ns) small.push_back(urd(mt) < shared ? large[pick(mt)]: mt());
+        std::sort(small.begin(), small.end());
+        small.erase(std::unique(small.begin(), small.end()), small.end());
+        if(!compare(("random, ratio " + std::to_string(ratio)).data(), small, large, reps)) ret = EXIT_FAILURE;
+    }
+    return ret;
+}
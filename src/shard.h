@@ -0,0 +1,68 @@
+#pragma once
+#include "dashing.h"
+
+namespace bns {
+
+/*
+ * A shard (--shard i/N) holds rows [row_begin, row_end) of the upper triangle of an n x n all-pairs matrix:
+ * this header, then n names (each a uint64_t length followed by its bytes), then row i's n - i - 1 floats for each row in turn.
+ * `dashing merge-shards` reassembles the full matrix from all N shards.
+ */
+struct ShardHeader {
+    static constexpr uint64_t MAGIC = 0x3144524148534244ull; // "DBSHARD1", little-endian
+    uint64_t magic = MAGIC;
+    uint64_t n = 0, row_begin = 0, row_end = 0;
+    uint32_t result_type = 0, shard = 0, nshards = 0, reserved = 0;
+};
+
+// Pairs in the upper triangle before row r, i.e., in rows [0, r) of an n x n matrix.
+inline uint64_t pairs_before_row(uint64_t n, uint64_t r) {
+    return r * (n - 1) - r * (r - 1) / 2;
+}
+
+// Rows of shard i of nshards, chosen so that every shard holds about the same number of pairs (not rows).
+inline std::pair<size_t, size_t> shard_rows(size_t n, unsigned i, unsigned nshards) {
+    const auto boundary = [n, nshards](unsigned s) -> size_t {
+        if(s >= nshards) return n;
+        if(n < 2 || s == 0) return 0;
+        const long double target = (long double)pairs_before_row(n, n) * s / nshards;
+        size_t lo = 0, hi = n;
+        while(lo < hi) { // First row whose preceding pairs reach the target
+            const size_t mid = (lo + hi) / 2;
+            if(pairs_before_row(n, mid) < target) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    };
+    return {boundary(i), boundary(i + 1)};
+}
+
+// Parses "i/N" (0 <= i < N).
+inline std::pair<unsigned, unsigned> parse_shard_spec(const char *s) {
+    char *end;
+    const unsigned long i = std::strtoul(s, &end, 10);
+    if(*end != '/') RUNTIME_ERROR(std::string("Shard must be formatted as i/N, not ") + s);
+    const unsigned long nshards = std::strtoul(end + 1, &end, 10);
+    if(*end || nshards == 0 || i >= nshards) RUNTIME_ERROR(std::string("Shard must be formatted as i/N with 0 <= i < N, not ") + s);
+    return {unsigned(i), unsigned(nshards)};
+}
+
+inline void write_fully(int fn, const void *data, size_t nb) {
+    for(const char *p = static_cast<const char *>(data); nb;) {
+        const ssize_t w = ::write(fn, p, nb);
+        if(w <= 0) RUNTIME_ERROR("Error writing output");
+        p += w, nb -= w;
+    }
+}
+
+inline void write_shard_header(int fn, const ShardHeader &hdr, const std::vector<std::string> &names) {
+    std::string buf(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+    for(const auto &name: names) {
+        const uint64_t l = name.size();
+        buf.append(reinterpret_cast<const char *>(&l), sizeof(l));
+        buf += name;
+    }
+    write_fully(fn, buf.data(), buf.size());
+}
+
+} // namespace bns
@@ -0,0 +1,235 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#if defined(__SSE2__)
+#include <x86intrin.h>
+#endif
+
+namespace bns {
+
+namespace simd {
+
+/*
+ * 2-bit encoding of 32 bases at a time.
+ * Codes match bonsai's lookup table (A/a=0, C/c=1, G/g=2, T/t=3). Since
+ * ((c >> 1) ^ (c >> 2)) & 3 yields exactly those codes for both cases, the codes are computed arithmetically,
+ * and a separate comparison against ACGT flags every other byte as ambiguous.
+ * Codes are packed first-base-least-significant, which makes the complemented stream the reverse complement directly.
+ */
+static inline uint64_t spread_bits(uint32_t x) {
+    uint64_t v = x;
+    v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+    v = (v | (v << 8))  & 0x00FF00FF00FF00FFull;
+    v = (v | (v << 4))  & 0x0F0F0F0F0F0F0F0Full;
+    v = (v | (v << 2))  & 0x3333333333333333ull;
+    v = (v | (v << 1))  & 0x5555555555555555ull;
+    return v;
+}
+static inline uint64_t pack_codes(uint32_t lobits, uint32_t hibits) {
+    return spread_bits(lobits) | (spread_bits(hibits) << 1);
+}
+// Reverses the order of the 32 2-bit fields in x.
+static inline uint64_t reverse_pairs(uint64_t x) {
+    x = __builtin_bswap64(x);
+    x = ((x >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((x & 0x0F0F0F0F0F0F0F0Full) << 4);
+    x = ((x >> 2) & 0x3333333333333333ull) | ((x & 0x3333333333333333ull) << 2);
+    return x;
+}
+
+static inline uint32_t encode32_scalar(const char *s, uint64_t &packed) {
+    uint32_t bad = 0;
+    packed = 0;
+    for(unsigned i = 0; i < 32; ++i) {
+        const unsigned c = static_cast<unsigned char>(s[i]), u = c & 0xDFu;
+        bad |= uint32_t(u != 'A' && u != 'C' && u != 'G' && u != 'T') << i;
+        packed |= uint64_t(((c >> 1) ^ (c >> 2)) & 3u) << (2 * i);
+    }
+    return bad;
+}
+
+#if defined(__AVX512BW__)
+static inline __mmask64 invalid_mask(__m512i v) {
+    const __m512i u = _mm512_and_si512(v, _mm512_set1_epi8(char(0xDF)));
+    return ~(_mm512_cmpeq_epi8_mask(u, _mm512_set1_epi8('A')) | _mm512_cmpeq_epi8_mask(u, _mm512_set1_epi8('C')) |
+             _mm512_cmpeq_epi8_mask(u, _mm512_set1_epi8('G')) | _mm512_cmpeq_epi8_mask(u, _mm512_set1_epi8('T')));
+}
+// Encodes 64 bases into two consecutive blocks.
+static inline void encode64(const char *s, uint64_t *packed, uint32_t *bad) {
+    const __m512i v = _mm512_loadu_si512(reinterpret_cast<const void *>(s));
+    const __m512i c = _mm512_xor_si512(_mm512_srli_epi16(v, 1), _mm512_srli_epi16(v, 2));
+    const uint64_t lo = _mm512_movepi8_mask(_mm512_slli_epi16(c, 7)), hi = _mm512_movepi8_mask(_mm512_slli_epi16(c, 6));
+    const uint64_t n = invalid_mask(v);
+    packed[0] = pack_codes(uint32_t(lo), uint32_t(hi));
+    packed[1] = pack_codes(uint32_t(lo >> 32), uint32_t(hi >> 32));
+    bad[0] = uint32_t(n);
+    bad[1] = uint32_t(n >> 32);
+}
+#define BNS_SIMD_HAS_ENCODE64 1
+#endif
+
+static inline uint32_t encode32(const char *s, uint64_t &packed) {
+#if defined(__AVX2__)
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s));
+    const __m256i u = _mm256_and_si256(v, _mm256_set1_epi8(char(0xDF)));
+    const __m256i ok = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(u, _mm256_set1_epi8('A')), _mm256_cmpeq_epi8(u, _mm256_set1_epi8('C'))),
+                                       _mm256_or_si256(_mm256_cmpeq_epi8(u, _mm256_set1_epi8('G')), _mm256_cmpeq_epi8(u, _mm256_set1_epi8('T'))));
+    // Only bits 0 and 1 of each byte are used, and 16-bit shifts by 1 or 2 never carry into those from the neighbouring byte.
+    const __m256i c = _mm256_xor_si256(_mm256_srli_epi16(v, 1), _mm256_srli_epi16(v, 2));
+    packed = pack_codes(_mm256_movemask_epi8(_mm256_slli_epi16(c, 7)), _mm256_movemask_epi8(_mm256_slli_epi16(c, 6)));
+    return ~uint32_t(_mm256_movemask_epi8(ok));
+#elif defined(__SSE2__)
+    uint32_t lo = 0, hi = 0, good = 0;
+    for(unsigned half = 0; half < 2; ++half) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + 16 * half));
+        const __m128i u = _mm_and_si128(v, _mm_set1_epi8(char(0xDF)));
+        const __m128i ok = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(u, _mm_set1_epi8('A')), _mm_cmpeq_epi8(u, _mm_set1_epi8('C'))),
+                                        _mm_or_si128(_mm_cmpeq_epi8(u, _mm_set1_epi8('G')), _mm_cmpeq_epi8(u, _mm_set1_epi8('T'))));
+        const __m128i c = _mm_xor_si128(_mm_srli_epi16(v, 1), _mm_srli_epi16(v, 2));
+        lo |= uint32_t(_mm_movemask_epi8(_mm_slli_epi16(c, 7))) << (16 * half);
+        hi |= uint32_t(_mm_movemask_epi8(_mm_slli_epi16(c, 6))) << (16 * half);
+        good |= uint32_t(_mm_movemask_epi8(ok)) << (16 * half);
+    }
+    packed = pack_codes(lo, hi);
+    return ~good;
+#else
+    return encode32_scalar(s, packed);
+#endif
+}
+
+// Encodes blocks [first, first + n) of s, padding past the end with ambiguous bases.
+static inline void encode_blocks(const char *s, size_t l, size_t first, size_t n, uint64_t *fwd, uint64_t *rev, uint32_t *bad) {
+    size_t i = 0;
+#ifdef BNS_SIMD_HAS_ENCODE64
+    for(; i + 1 < n && (first + i + 2) * 32 <= l; i += 2)
+        encode64(s + (first + i) * 32, rev + i, bad + i);
+#endif
+    for(; i < n; ++i) {
+        const size_t off = (first + i) * 32;
+        if(off + 32 <= l) {
+            bad[i] = encode32(s + off, rev[i]);
+        } else if(off < l) {
+            char buf[32];
+            std::memset(buf, 'N', sizeof(buf));
+            std::memcpy(buf, s + off, l - off);
+            bad[i] = encode32(buf, rev[i]);
+        } else {
+            rev[i] = 0;
+            bad[i] = UINT32_C(0xFFFFFFFF);
+        }
+    }
+    for(i = 0; i < n; ++i) fwd[i] = reverse_pairs(rev[i]);
+}
+
+// A run of encoded blocks; k-mers may start in the first nb, and block nb holds their overhang.
+struct EncodedChunk {
+    static constexpr size_t CHUNK_BLOCKS = 64;
+    uint64_t fwd[CHUNK_BLOCKS + 1], rev[CHUNK_BLOCKS + 1];
+    uint32_t bad[CHUNK_BLOCKS + 1];
+    size_t first, nb;
+};
+
+} // namespace simd
+
+/*
+ * Bulk k-mer encoder for unspaced, unwindowed k-mers with k <= 32.
+ * Sequence is encoded 32 bases at a time into forward (first base most significant) and reverse (first base least
+ * significant) blocks, after which each k-mer is two independent shifts out of a pair of blocks rather than a
+ * serially-dependent rolling update. K-mers overlapping a non-ACGT base are skipped, as in bonsai's Encoder,
+ * and k-mers are emitted in sequence order, so results are identical to the scalar encoder.
+ */
+class KmerKernel {
+    unsigned k_;
+    bool canon_;
+    uint64_t kmask_, nmask_;
+public:
+    // k == 0 disables the kernel; callers then fall back to bonsai's encoder.
+    KmerKernel(unsigned k, bool canon): k_(k <= 32 ? k: 0), canon_(canon),
+        kmask_(k_ == 32 ? UINT64_C(-1): (UINT64_C(1) << (2 * k_)) - 1),
+        nmask_((UINT64_C(1) << k_) - 1) {}
+    bool enabled() const {return k_ != 0;}
+    unsigned k() const {return k_;}
+    bool canonicalizes() const {return canon_;}
+
+    // Emits the k-mers starting in chunk c, of a sequence of length l.
+    template<typename Func>
+    void for_each_in(const simd::EncodedChunk &c, size_t l, const Func &func) const {
+        if(l < k_) return;
+        const size_t nstarts = l - k_ + 1;
+        const unsigned fshift = 128 - 2 * k_;
+        for(size_t b = 0; b < c.nb && (c.first + b) * 32 < nstarts; ++b) {
+            const unsigned __int128 fw = (static_cast<unsigned __int128>(c.fwd[b]) << 64) | c.fwd[b + 1];
+            const unsigned __int128 rw = (static_cast<unsigned __int128>(c.rev[b + 1]) << 64) | c.rev[b];
+            const uint64_t nw = c.bad[b] | (uint64_t(c.bad[b + 1]) << 32);
+            const unsigned lim = std::min(size_t(32), nstarts - (c.first + b) * 32);
+            for(unsigned i = 0; i < lim; ++i) {
+                if((nw >> i) & nmask_) continue;
+                const uint64_t f = uint64_t(fw >> (fshift - 2 * i)) & kmask_;
+                if(canon_) {
+                    const uint64_t r = ~uint64_t(rw >> (2 * i)) & kmask_;
+                    func(std::min(f, r));
+                } else func(f);
+            }
+        }
+    }
+    // Calls func(chunk) for each encoded chunk of s in which k-mers of length mink or more can start.
+    template<typename Func>
+    static void for_each_chunk(const char *s, size_t l, unsigned mink, const Func &func) {
+        if(l < mink) return;
+        const size_t nblocks = (l - mink + 1 + 31) / 32;
+        simd::EncodedChunk c;
+        for(c.first = 0; c.first < nblocks; c.first += simd::EncodedChunk::CHUNK_BLOCKS) {
+            c.nb = std::min(simd::EncodedChunk::CHUNK_BLOCKS, nblocks - c.first);
+            simd::encode_blocks(s, l, c.first, c.nb + 1, c.fwd, c.rev, c.bad);
+            func(c);
+        }
+    }
+
+    template<typename Func>
+    void for_each(const Func &func, const char *s, size_t l) const {
+        for_each_chunk(s, l, k_, [&](const simd::EncodedChunk &c) {for_each_in(c, l, func);});
+    }
+
+    // Base-at-a-time reference with the same semantics, used to verify and benchmark the bulk path.
+    template<typename Func>
+    void for_each_scalar(const Func &func, const char *s, size_t l) const {
+        uint64_t f = 0, r = 0;
+        unsigned filled = 0;
+        const unsigned rshift = 2 * (k_ - 1);
+        for(size_t i = 0; i < l; ++i) {
+            const unsigned c = static_cast<unsigned char>(s[i]), u = c & 0xDFu;
+            if(u != 'A' && u != 'C' && u != 'G' && u != 'T') {
+                filled = 0; f = r = 0;
+                continue;
+            }
+            const uint64_t code = ((c >> 1) ^ (c >> 2)) & 3u;
+            f = ((f << 2) | code) & kmask_;
+            r = (r >> 2) | ((3u - code) << rshift);
+            if(++filled >= k_) func(canon_ ? std::min(f, r): f);
+        }
+    }
+};
+
+/*
+ * Extracts k-mers for several k (sharing canonicalization) from a single encoding of each sequence, for multi-k sketching.
+ * func(ki, kmer) receives the index of the k-mer's length in the list given at construction.
+ */
+class MultiKmerKernel {
+    std::vector<KmerKernel> kernels_;
+    unsigned mink_;
+public:
+    MultiKmerKernel(const std::vector<unsigned> &ks, bool canon): mink_(ks.empty() ? 0: *std::min_element(ks.begin(), ks.end())) {
+        for(const auto k: ks) kernels_.emplace_back(k, canon);
+    }
+    bool enabled() const {return std::all_of(kernels_.begin(), kernels_.end(), [](const auto &x) {return x.enabled();});}
+    template<typename Func>
+    void for_each(const Func &func, const char *s, size_t l) const {
+        KmerKernel::for_each_chunk(s, l, mink_, [&](const simd::EncodedChunk &c) {
+            for(size_t ki = 0; ki < kernels_.size(); ++ki)
+                kernels_[ki].for_each_in(c, l, [&](uint64_t kmer) {func(ki, kmer);});
+        });
+    }
+};
+
+} // namespace bns
@@ -1,23 +1,34 @@
 #pragma once
 #include "dashing.h"
+#include "ingest.h"
+#include "simdenc.h"
+#include "inserter.h"
+#include "schedule.h"
+#include "neighbors.h"
+#include "lsh.h"
+#include "shard.h"
+#include "pack.h"
+#include "cache.h"
+#include <unordered_map>
 
 #define FILL_SKETCH_MIN(MinType)  \
     {\
         Encoder<MinType> enc(nullptr, 0, sp, nullptr, canon);\
         if(cms.empty()) {\
             auto &h = sketch;\
-            if(enct == BONSAI) for_each_substr([&](const char *s) {enc.for_each([&](u64 kmer){h.addh(kmer);}, s, &kseqs[tid]);}, inpaths[i], FNAME_SEP);\
-            else if(enct == NTHASH) for_each_substr([&](const char *s) {enc.for_each_hash([&](u64 kmer){h.addh(kmer);}, s, &kseqs[tid]);}, inpaths[i], FNAME_SEP);\
-            else for_each_substr([&](const char *s) {rolling_hasher.for_each_hash([&](u64 kmer){h.addh(kmer);}, s, &kseqs[tid]);}, inpaths[i], FNAME_SEP);\
+            if(split_file) SplitFiller<SketchType>::template fill<MinType>(sketch, inpaths[i], sp, canon, enct, split_threads, sketch_size, estim, jestim);\
+            else {\
+                BatchInserter<SketchType> ins(h);\
+                for_each_substr([&](const char *s) {for_each_kmer(enc, rolling_hasher, kernel, enct, s, &kseqs[tid], [&](u64 kmer){ins.add(kmer);});}, inpaths[i], FNAME_SEP);\
+            }\
         } else {\
             CountingSketch &cm = cms.at(tid);\
-            const auto lfunc = [&](u64 kmer){if(cm.addh(kmer) >= mincount) sketch.addh(kmer);};\
-            if(enct == BONSAI)      for_each_substr([&](const char *s) {enc.for_each(lfunc, s, &kseqs[tid]);}, inpaths[i], FNAME_SEP);\
-            else if(enct == NTHASH) for_each_substr([&](const char *s) {enc.for_each_hash(lfunc, s, &kseqs[tid]);}, inpaths[i], FNAME_SEP);\
-            else                    for_each_substr([&](const char *s) {rolling_hasher.for_each_hash(lfunc, s, &kseqs[tid]);}, inpaths[i], FNAME_SEP);\
+            BatchInserter<SketchType> ins(sketch);\
+            const auto lfunc = [&](u64 kmer){if(cm.addh(kmer) >= mincount) ins.add(kmer);};\
+            for_each_substr([&](const char *s) {for_each_kmer(enc, rolling_hasher, kernel, enct, s, &kseqs[tid], lfunc);}, inpaths[i], FNAME_SEP);\
             cm.clear();\
         }\
-        CONST_IF(!samesketch) new(final_sketches + i) final_type(std::move(sketch)); \
+        CONST_IF(!samesketch) new(final_sketches + slot) final_type(std::move(sketch)); \
     }
 
 using ::sketch::hll::EstimationMethod;
@@ -61,6 +72,18 @@ size_t submit_emit_dists(int pairfi, const FType *ptr, u64 hs, size_t index, ks:
 }
 template<typename SketchType>
 void dist_loop(std::FILE *ofp, SketchType *hlls, const std::vector<std::string> &inpaths, const bool use_scientific, const unsigned k, const EmissionType result_type, EmissionFormat emit_fmt, int nthreads, const size_t buffer_flush_size, size_t nq);
+template<typename SketchType>
+void topk_loop(std::FILE *ofp, SketchType *hlls, const std::vector<std::string> &inpaths, const bool use_scientific, const unsigned k, const EmissionType result_type, EmissionFormat emit_fmt, int nthreads, size_t nq);
+template<typename SketchType>
+void edge_loop(std::FILE *ofp, SketchType *hlls, const std::vector<std::string> &inpaths, const bool use_scientific, const unsigned k, const EmissionType result_type, EmissionFormat emit_fmt, int nthreads, size_t nq);
+template<typename SketchType>
+void lsh_loop(std::FILE *ofp, SketchType *hlls, const std::vector<std::string> &inpaths, const bool use_scientific, const unsigned k, const EmissionType result_type, EmissionFormat emit_fmt, int nthreads, size_t nq);
+template<typename SketchType>
+void shard_loop(std::FILE *ofp, SketchType *hlls, const std::vector<std::string> &inpaths, const unsigned k, const EmissionType result_type, int nthreads, size_t nq);
+template<typename SketchType>
+void extend_loop(std::FILE *ofp, SketchType *hlls, const HllArena *arena, const std::vector<std::string> &inpaths, const unsigned k, const EmissionType result_type);
+template<typename SketchType, typename LoadBlock>
+void out_of_core_dist_loop(SketchType *slots, size_t block, const std::vector<std::string> &inpaths, std::FILE *ofp, const bool use_scientific, const unsigned k, const EmissionType result_type, EmissionFormat emit_fmt, const LoadBlock &load);
 using namespace sketch;
 using namespace hll;
 static size_t bytesl2_to_arg(int nblog2, Sketch sketch) {
@@ -83,6 +106,351 @@ static size_t bytesl2_to_arg(int nblog2, Sketch sketch) {
     }
 
 }
+
+// The bulk kernel covers the default BONSAI encoding when k-mers are unspaced and unwindowed.
+inline KmerKernel make_kmer_kernel(const Spacer &sp, bool canon, EncodingType enct) {
+    return KmerKernel(enct == BONSAI && sp.unspaced() && sp.unwindowed() ? sp.k_: 0, canon);
+}
+
+template<typename MinType, typename Func>
+INLINE void encode_seq(Encoder<MinType> &enc, RollingHasher<uint64_t> &rolling_hasher, const KmerKernel &kernel, EncodingType enct, const char *seq, size_t l, const Func &func) {
+    if(kernel.enabled())    kernel.for_each(func, seq, l);
+    else if(enct == BONSAI) enc.for_each(func, seq, l);
+    else if(enct == NTHASH) enc.for_each_hash(func, seq, l);
+    else                    rolling_hasher.for_each_hash(func, seq, l);
+}
+
+// Feeds every record's sequence in path to func, in place for uncompressed files and through kseq otherwise.
+template<typename Func>
+void for_each_record(const char *path, const Func &func) {
+    if(for_each_mapped_seq(path, func)) return;
+    KSeqBatchReader reader(path);
+    SeqBatch batch;
+    bool more;
+    do {
+        more = reader.fill(batch);
+        batch.for_each(func);
+    } while(more);
+}
+
+// Feeds every k-mer (or rolling hash) in path to func, reading uncompressed files in place and anything else through kseq.
+// Streams ("-" or named pipes) are always read here rather than by bonsai, which expects a file it can open by name.
+template<typename MinType, typename KSeqType, typename Func>
+void for_each_kmer(Encoder<MinType> &enc, RollingHasher<uint64_t> &rolling_hasher, const KmerKernel &kernel, EncodingType enct, const char *path, KSeqType *ks, const Func &func) {
+    const auto encfunc = [&](const char *seq, size_t l) {encode_seq(enc, rolling_hasher, kernel, enct, seq, l, func);};
+    if(kernel.enabled() || is_stream_path(path)) {
+        for_each_record(path, encfunc);
+    } else if(for_each_mapped_seq(path, encfunc)) {
+        return;
+    } else if(enct == BONSAI) {
+        enc.for_each(func, path, ks);
+    } else if(enct == NTHASH) {
+        enc.for_each_hash(func, path, ks);
+    } else {
+        rolling_hasher.for_each_hash(func, path, ks);
+    }
+}
+
+// --io-threads implies splitting, since the pipeline only pays off when several threads consume one file.
+inline bool split_requested(unsigned nthreads) {
+    return (gargs.split_files && std::max(nthreads, gargs.compute_threads) > 1) || gargs.io_threads;
+}
+template<typename T> struct is_split_mergeable: std::false_type {};
+template<> struct is_split_mergeable<hll::hll_t>: std::true_type {};
+template<> struct is_split_mergeable<bf::bf_t>: std::true_type {};
+template<> struct is_split_mergeable<mh::RangeMinHash<uint64_t>>: std::true_type {};
+template<> struct is_split_mergeable<mh::BBitMinHasher<uint64_t>>: std::true_type {};
+
+/*
+ * Sketches a single input with nthreads threads by handing batches of whole records to each thread.
+ * Uncompressed inputs are mapped and split into record-aligned pieces; otherwise, with gargs.io_threads set,
+ * batches come from a decompression/parsing pipeline running on its own threads.
+ * Every thread fills a sketch of the same type, and these are merged into the destination at the end.
+ * Since k-mers never span records and merging is exact (register max, bitwise or, or minimizer union)
+ * for the types above, the result is identical to sketching on one thread.
+ */
+template<typename SketchType, bool=is_split_mergeable<SketchType>::value>
+struct SplitFiller {
+    template<typename MinType>
+    static void fill(SketchType &, const std::string &, const Spacer &, bool, EncodingType, unsigned, uint32_t, EstimationMethod, JointEstimationMethod) {
+        RUNTIME_ERROR(std::string("Splitting files across threads is not supported for ") + __PRETTY_FUNCTION__);
+    }
+};
+template<typename SketchType>
+struct SplitFiller<SketchType, true> {
+    template<typename MinType>
+    static void fill(SketchType &sketch, const std::string &path, const Spacer &sp, bool canon, EncodingType enct,
+                     unsigned nthreads, uint32_t sketch_size, EstimationMethod estim, JointEstimationMethod jestim)
+    {
+        std::vector<SketchType> partials;
+        partials.reserve(nthreads - 1);
+        while(partials.size() + 1 < nthreads) {
+            partials.emplace_back(construct<SketchType>(sketch_size));
+            set_estim_and_jestim(partials.back(), estim, jestim);
+        }
+        for_each_substr([&](const char *s) {
+            with_batch_source(s, gargs.io_threads, nthreads, [&](auto &source) {
+                #pragma omp parallel num_threads(nthreads)
+                {
+                    const int tid = omp_get_thread_num();
+                    SketchType &h = tid ? partials[tid - 1]: sketch;
+                    Encoder<MinType> enc(nullptr, 0, sp, nullptr, canon);
+                    RollingHasher<uint64_t> rolling_hasher(sp.k_, canon);
+                    const KmerKernel kernel = make_kmer_kernel(sp, canon, enct);
+                    BatchInserter<SketchType> ins(h);
+                    source.consume([&](const char *seq, size_t l) {encode_seq(enc, rolling_hasher, kernel, enct, seq, l, [&](u64 kmer){ins.add(kmer);});});
+                }
+            });
+        }, path, FNAME_SEP);
+        for(auto &p: partials) sketch += p;
+    }
+};
+
+// Writes the estimated sizes of inputs [begin, end) (size(i) for each) to ofp.
+template<typename SizeFunc>
+void emit_sizes(std::FILE *ofp, const std::vector<std::string> &inpaths, const SizeFunc &size, size_t begin, size_t end) {
+    ks::string str("#Path\tSize (est.)\n");
+    assert(str == "#Path\tSize (est.)\n");
+    str.resize(BUFFER_FLUSH_SIZE);
+    const int fn(fileno(ofp));
+    for(size_t i(begin); i < end; ++i) {
+        str.sprintf("%s\t%zu\n", inpaths[i].data(), size_t(size(i)));
+        if(str.size() >= BUFFER_FLUSH_SIZE) str.flush(fn);
+    }
+    str.flush(fn);
+}
+template<typename SizeFunc>
+void emit_sizes(std::FILE *ofp, const std::vector<std::string> &inpaths, const SizeFunc &size) {
+    emit_sizes(ofp, inpaths, size, 0, inpaths.size());
+}
+
+// Writes the header emit_fmt has before the distances (the reference names, or the number of inputs), if any.
+inline void write_matrix_header(std::FILE *pairofp, const std::vector<std::string> &inpaths, EmissionFormat emit_fmt, size_t nq) {
+    if(emit_fmt == UT_TSV) {
+        ks::string str;
+        str.sprintf("##Names\t");
+        for(size_t i = 0; i < inpaths.size() - nq; ++i)
+            str.sprintf("%s\t", inpaths[i].data());
+        str.back() = '\n';
+        str.write(fileno(pairofp)); str.free();
+    } else if(emit_fmt == UPPER_TRIANGULAR) { // emit_fmt == UPPER_TRIANGULAR
+        std::fprintf(pairofp, "%zu\n", inpaths.size());
+        std::fflush(pairofp);
+    }
+}
+
+// A new, empty file in dir for sketches spilled by --memory-budget, removed when this goes out of scope (including by an exception).
+class ScratchFile {
+    std::string path_;
+public:
+    ScratchFile(const std::string &dir): path_((dir.size() ? dir: std::string(std::getenv("TMPDIR") ? std::getenv("TMPDIR"): "/tmp")) + "/dashing-spill-XXXXXX") {
+        const int fd = ::mkstemp(&path_[0]);
+        if(fd < 0) RUNTIME_ERROR(std::string("Could not create a scratch file at ") + path_);
+        ::close(fd);
+    }
+    ScratchFile(const ScratchFile &) = delete;
+    ScratchFile &operator=(const ScratchFile &) = delete;
+    ~ScratchFile() {
+        if(::unlink(path_.data())) LOG_WARNING("Could not remove scratch file %s\n", path_.data());
+    }
+    const std::string &path() const {return path_;}
+};
+// Sketches per block for out_of_core_dist_loop: two blocks of sketches of sketch_bytes each, and two blocks of rows, in budget bytes.
+inline size_t out_of_core_block_size(size_t n, size_t sketch_bytes, size_t budget) {
+    const size_t per_row = 2 * sketch_bytes + 2 * sizeof(float) * (n - 1);
+    if(budget < per_row) LOG_WARNING("--memory-budget of %zu bytes holds less than a row (%zu bytes); comparing one row at a time.\n", budget, per_row);
+    return std::min(std::max(budget / per_row, size_t(1)), n);
+}
+
+// Writes estimated sizes to ofp, then the header (if any) and the distances for emit_fmt (or, with --topk, nearest neighbours; with a threshold, an edge list) to pairofp.
+template<typename FinalType>
+void emit_sizes_and_dists(FinalType *final_sketches, const std::vector<std::string> &inpaths, std::FILE *ofp, std::FILE *pairofp, bool use_scientific,
+                          unsigned k, EmissionType result_type, EmissionFormat emit_fmt, unsigned nthreads, size_t nq)
+{
+    emit_sizes(ofp, inpaths, [final_sketches](size_t i) {return cardinality_estimate(final_sketches[i]);});
+    if(gargs.topk) {
+        topk_loop<FinalType>(pairofp, final_sketches, inpaths, use_scientific, k, result_type, emit_fmt, nthreads, nq);
+        return;
+    }
+    if(gargs.edges) {
+        edge_loop<FinalType>(pairofp, final_sketches, inpaths, use_scientific, k, result_type, emit_fmt, nthreads, nq);
+        return;
+    }
+    if(gargs.lsh_threshold > 0) {
+        lsh_loop<FinalType>(pairofp, final_sketches, inpaths, use_scientific, k, result_type, emit_fmt, nthreads, nq);
+        return;
+    }
+    write_matrix_header(pairofp, inpaths, emit_fmt, nq);
+    dist_loop<FinalType>(pairofp, final_sketches, inpaths, use_scientific, k, result_type, emit_fmt, nthreads, BUFFER_FLUSH_SIZE, nq);
+}
+
+/*
+ * Query/reference comparison with bounded memory (--stream-queries). The references are final in final_sketches[0, nr);
+ * sketch_window(q0, q1) sketches and finalizes queries [q0, q1) into the slots after them. Each window's rows are computed,
+ * then formatted and written while the next window is sketched, so that memory holds the references, one window of queries,
+ * and two windows of rows, and the first rows are out before the last queries are read.
+ * Rows are emitted as partdist_loop does. Query sizes follow the references' on ofp, unless ofp is also the distance output.
+ */
+template<typename FinalType, typename SketchWindow>
+void stream_query_loop(FinalType *final_sketches, const std::vector<std::string> &inpaths, std::FILE *ofp, std::FILE *pairofp, bool use_scientific,
+                       unsigned k, EmissionType result_type, EmissionFormat emit_fmt, size_t nq, size_t window, const SketchWindow &sketch_window)
+{
+    const size_t nr = inpaths.size() - nq;
+    const float ksinv = 1. / k;
+    const bool query_sizes = ::fileno(ofp) != ::fileno(pairofp);
+    emit_sizes(ofp, inpaths, [final_sketches](size_t i) {return cardinality_estimate(final_sketches[i]);}, 0, nr);
+    if(!query_sizes) LOG_INFO("Not writing query sizes, since sizes and distances share an output. Give -o or -O to write them.\n");
+    write_matrix_header(pairofp, inpaths, emit_fmt, nq);
+    std::array<std::vector<float>, 2> rows;
+    std::array<ks::string, 2> sizes, text;
+    std::vector<double> qsizes;
+    std::future<void> emit_future;
+    for(size_t q0 = nr, w = 0; q0 < inpaths.size(); q0 += window, ++w) {
+        const size_t q1 = std::min(q0 + window, inpaths.size());
+        sketch_window(q0, q1);
+        auto &row = rows[w & 1];
+        auto &sz = sizes[w & 1];
+        // Comparisons use each sketch's cached cardinality, so estimate the window's before comparing, whether or not sizes are written.
+        qsizes.resize(q1 - q0);
+        #pragma omp parallel for
+        for(size_t qi = q0; qi < q1; ++qi) qsizes[qi - q0] = cardinality_estimate(final_sketches[nr + qi - q0]);
+        row.resize((q1 - q0) * nr);
+        for(size_t qi = q0; qi < q1; ++qi)
+            fill_query_row(final_sketches, nr, nr + qi - q0, result_type, ksinv, &row[(qi - q0) * nr], nullptr);
+        if(query_sizes)
+            for(size_t qi = q0; qi < q1; ++qi)
+                sz.sprintf("%s\t%zu\n", inpaths[qi].data(), size_t(qsizes[qi - q0]));
+        if(emit_future.valid()) emit_future.get(); // The previous window's, which uses the other buffers
+        emit_future = std::async(std::launch::async, [&,q0,q1,w]() {
+            const auto &row = rows[w & 1];
+            if(emit_fmt == BINARY) {
+                const ssize_t nb = row.size() * sizeof(float);
+                if(unlikely(::write(::fileno(pairofp), row.data(), nb) != nb)) RUNTIME_ERROR("Error writing to binary file");
+            } else {
+                auto &buffer = text[w & 1];
+                const char *fmt = use_scientific ? "\t%e": "\t%f";
+                for(size_t qi = q0; qi < q1; ++qi) {
+                    buffer += inpaths[qi];
+                    for(const float *p = &row[(qi - q0) * nr], *e = p + nr; p < e; buffer.sprintf(fmt, *p++));
+                    buffer.putc_('\n');
+                    if(buffer.size() >= BUFFER_FLUSH_SIZE) buffer.flush(::fileno(pairofp));
+                }
+                buffer.flush(::fileno(pairofp));
+            }
+            sizes[w & 1].flush(::fileno(ofp));
+        });
+        LOG_DEBUG("Compared queries %zu-%zu of %zu\n", q0 - nr + 1, q1 - nr, nq);
+    }
+    if(emit_future.valid()) emit_future.get();
+}
+
+// Destroys and frees final sketches which were placement-constructed into malloc'd storage.
+template<typename FinalType>
+void destroy_final_sketches(FinalType *final_sketches, size_t n) {
+#if __cplusplus >= 201703L
+    std::destroy_n(
+#  if __cpp_lib_execution
+        std::execution::par_unseq,
+#  endif
+        final_sketches, n);
+#else
+    std::for_each(final_sketches, final_sketches + n, [](auto &sketch) {
+        using destructor_type = typename std::decay<decltype(sketch)>::type;
+        sketch.~destructor_type();
+    });
+#endif
+    std::free(final_sketches);
+}
+
+/*
+ * Fills the ith sketch for every k in gargs.multik from a single parse of path.
+ * When all k-mer lengths qualify for the bulk kernel (BONSAI, unspaced and unwindowed), each sequence is also encoded only once,
+ * and every k is read out of the same 2-bit blocks. Otherwise, each k has its own encoder over the shared records.
+ */
+template<typename SketchType, typename MinType>
+void multik_fill(std::vector<std::vector<SketchType>> &sketches, size_t i, const std::string &path, const std::vector<Spacer> &spacers, bool canon, EncodingType enct) {
+    std::deque<BatchInserter<SketchType>> ins;
+    std::deque<Encoder<MinType>> encs;
+    std::deque<RollingHasher<uint64_t>> rolling_hashers;
+    std::vector<KmerKernel> kernels;
+    for(size_t ki = 0; ki < spacers.size(); ++ki) {
+        ins.emplace_back(sketches[ki][i]);
+        encs.emplace_back(nullptr, 0, spacers[ki], nullptr, canon);
+        rolling_hashers.emplace_back(spacers[ki].k_, canon);
+        kernels.push_back(make_kmer_kernel(spacers[ki], canon, enct));
+    }
+    const MultiKmerKernel multi(gargs.multik, canon);
+    const bool shared_encoding = enct == BONSAI && multi.enabled()
+                                 && std::all_of(spacers.begin(), spacers.end(), [](const Spacer &sp) {return sp.unspaced() && sp.unwindowed();});
+    for_each_substr([&](const char *s) {
+        for_each_record(s, [&](const char *seq, size_t l) {
+            if(shared_encoding) {
+                multi.for_each([&](size_t ki, u64 kmer) {ins[ki].add(kmer);}, seq, l);
+            } else {
+                for(size_t ki = 0; ki < spacers.size(); ++ki)
+                    encode_seq(encs[ki], rolling_hashers[ki], kernels[ki], enct, seq, l, [&](u64 kmer) {ins[ki].add(kmer);});
+            }
+        });
+    }, path, FNAME_SEP);
+}
+
+/*
+ * Sketches every input once for all k in gargs.multik, then emits sizes to ofp (one block per k, headed by "#k=<k>")
+ * and distances to gargs.multik_paths[ki] in emit_fmt.
+ * Sketches for every k are held at once, so peak memory grows with the number of k-mer lengths.
+ * wsz is the window as given (0 if unset), so that each k's spacer matches a separate run with that k.
+ */
+template<typename SketchType>
+void multik_sketch_and_cmp(const std::vector<std::string> &inpaths, std::FILE *ofp, unsigned wsz, unsigned ssarg, EstimationMethod estim, JointEstimationMethod jestim,
+                           EmissionType result_type, EmissionFormat emit_fmt, unsigned nthreads, bool use_scientific, bool canon, bool entropy_minimization,
+                           size_t nq, EncodingType enct)
+{
+    using final_type = typename FinalSketch<SketchType>::final_type;
+    static constexpr bool samesketch = std::is_same<SketchType, final_type>::value;
+    const std::vector<unsigned> &ks = gargs.multik;
+    assert(ks.size() == gargs.multik_paths.size());
+    const uint32_t sketch_size = bytesl2_to_arg(ssarg, SketchEnum<SketchType>::value);
+    std::vector<Spacer> spacers;
+    std::vector<std::vector<SketchType>> sketches(ks.size());
+    for(size_t ki = 0; ki < ks.size(); ++ki) {
+        spacers.emplace_back(ks[ki], wsz, parse_spacing("", ks[ki]));
+        sketches[ki].reserve(inpaths.size());
+        while(sketches[ki].size() < inpaths.size()) {
+            sketches[ki].emplace_back(construct<SketchType>(sketch_size));
+            set_estim_and_jestim(sketches[ki].back(), estim, jestim);
+        }
+    }
+    ScheduleReport report(nthreads);
+    for_each_scheduled(std::vector<size_t>(inpaths.size()), std::vector<bool>(inpaths.size()), report, [&](size_t i, bool) {
+        if(entropy_minimization) multik_fill<SketchType, score::Entropy>(sketches, i, inpaths[i], spacers, canon, enct);
+        else                     multik_fill<SketchType, score::Lex>(sketches, i, inpaths[i], spacers, canon, enct);
+    });
+    report.report("Sketching");
+    for(size_t ki = 0; ki < ks.size(); ++ki) {
+        auto &ksketches = sketches[ki];
+        final_type *final_sketches =
+            samesketch ? reinterpret_cast<final_type *>(ksketches.data())
+                       : static_cast<final_type *>(std::malloc(sizeof(*final_sketches) * inpaths.size()));
+        if(final_sketches == nullptr) throw std::bad_alloc();
+        CONST_IF(!samesketch) {
+            for(size_t i = 0; i < inpaths.size(); ++i)
+                new(final_sketches + i) final_type(std::move(ksketches[i]));
+        }
+        _Pragma("omp parallel for")
+        for(size_t i = 0; i < inpaths.size(); ++i)
+            sketch_finalize(final_sketches[i]);
+        std::fprintf(ofp, "#k=%u\n", ks[ki]);
+        std::fflush(ofp);
+        std::FILE *pairofp = std::fopen(gargs.multik_paths[ki].data(), "wb");
+        if(pairofp == nullptr) RUNTIME_ERROR(std::string("Could not open file at ") + gargs.multik_paths[ki]);
+        emit_sizes_and_dists(final_sketches, inpaths, ofp, pairofp, use_scientific, ks[ki], result_type, emit_fmt, nthreads, nq);
+        std::fclose(pairofp);
+        CONST_IF(!samesketch) destroy_final_sketches(final_sketches, inpaths.size());
+        std::vector<SketchType>().swap(ksketches);
+    }
+    if(ofp != stdout) std::fclose(ofp);
+}
+
 template<typename SketchType>
 void dist_sketch_and_cmp(const std::vector<std::string> &inpaths, std::vector<CountingSketch> &cms, KSeqBufferHolder &kseqs, std::FILE *ofp, std::FILE *pairofp,
                          Spacer sp,
@@ -95,46 +463,82 @@ void dist_sketch_and_cmp(const std::vector<std::string> &inpaths, std::vector<Co
     //       and use the same guts for all portions of the process
     //       except for the final comparison and output.
     assert(nq <= inpaths.size());
+    if(gargs.multik.size()) {
+        kseqs.free();
+        multik_sketch_and_cmp<SketchType>(inpaths, ofp, gargs.multik_window, ssarg, estim, jestim, result_type, emit_fmt, nthreads, use_scientific, canon, entropy_minimization, nq, enct);
+        return;
+    }
     using final_type = typename FinalSketch<SketchType>::final_type;
-    std::vector<SketchType> sketches;
-    sketches.reserve(inpaths.size());
+    // With --stream-queries, only the references and one window of queries have sketches at a time;
+    // with --memory-budget, only as many sketches as fit the budget (see out_of_core_dist_loop).
+    const bool stream = gargs.query_window && nq;
+    const bool out_of_core = gargs.memory_budget && !nq;
+    const size_t nr = inpaths.size() - nq;
     uint32_t sketch_size = bytesl2_to_arg(ssarg, SketchEnum<SketchType>::value);
-    while(sketches.size() < inpaths.size()) {
-        sketches.emplace_back(construct<SketchType>(sketch_size));
-        set_estim_and_jestim(sketches.back(), estim, jestim);
-    }
     static constexpr bool samesketch = std::is_same<SketchType, final_type>::value;
-    final_type *final_sketches =
-        samesketch ? reinterpret_cast<final_type *>(sketches.data())
-                   : static_cast<final_type *>(std::malloc(sizeof(*final_sketches) * inpaths.size()));
-    CONST_IF(samesketch) {
-        if(final_sketches == nullptr) throw std::bad_alloc();
-    }
+    std::vector<SketchType> sketches;
+    final_type *final_sketches = nullptr;
+    std::vector<uint8_t> live; // Whether each slot holds a constructed final sketch, when final sketches are not the sketches themselves
+    // Replaces every (empty) slot with count fresh sketches.
+    const auto resize_slots = [&](size_t count) {
+        std::vector<SketchType>().swap(sketches);
+        sketches.reserve(count);
+        while(sketches.size() < count) {
+            sketches.emplace_back(construct<SketchType>(sketch_size));
+            set_estim_and_jestim(sketches.back(), estim, jestim);
+        }
+        CONST_IF(samesketch) {
+            final_sketches = reinterpret_cast<final_type *>(sketches.data());
+        } else {
+            std::free(final_sketches);
+            if((final_sketches = static_cast<final_type *>(std::malloc(sizeof(*final_sketches) * count))) == nullptr) throw std::bad_alloc();
+        }
+        live.assign(count, 0);
+    };
+    // Empties a slot for its next input.
+    const auto clear_slot = [&](size_t slot) {
+        if(!samesketch && live[slot]) final_sketches[slot].~final_type();
+        live[slot] = 0;
+        sketches[slot].~SketchType();
+        new(&sketches[slot]) SketchType(construct<SketchType>(sketch_size));
+        set_estim_and_jestim(sketches[slot], estim, jestim);
+    };
+    resize_slots(stream      ? nr + std::min(nq, gargs.query_window):
+                 out_of_core ? std::min(inpaths.size(), std::max(size_t(nthreads), gargs.memory_budget / 2 / std::max(gargs.sketch_bytes, size_t(1)))):
+                               inpaths.size());
 
     std::atomic<uint32_t> ncomplete;
     ncomplete.store(0);
     const unsigned k = sp.k_;
     const unsigned wsz = sp.w_;
     RollingHasher<uint64_t> rolling_hasher(k, canon);
-    #pragma omp parallel for schedule(dynamic)
-    for(size_t i = 0; i < sketches.size(); ++i) {
+    const KmerKernel kernel = make_kmer_kernel(sp, canon, enct);
+    const bool split_files = split_requested(nthreads) && !presketched_only && cms.empty() && is_split_mergeable<SketchType>::value;
+    const unsigned split_threads = gargs.compute_threads ? gargs.compute_threads: nthreads;
+    if((gargs.split_files || gargs.io_threads) && !split_files)
+        LOG_WARNING("Not splitting files across threads: requires more than one thread or --io-threads, no count-min filtering, and an HLL, bloom filter, range minhash, or b-bit minhash sketch.\n");
+    // Sketches input i into sketches[slot] (or final_sketches + slot).
+    const auto sketch_input = [&](size_t i, size_t slot, bool split_file) {
         const std::string &path(inpaths[i]);
-        auto &sketch = sketches[i];
-        if(presketched_only)  {
+        auto &sketch = sketches[slot];
+        if(presketched_only && gargs.packed.size() && gargs.packed[i].first) {
+            read_packed(sketch, final_sketches + slot, *gargs.packed[i].first, gargs.packed[i].second);
+            CONST_IF(samesketch) set_estim_and_jestim(sketch, estim, jestim);
+        } else if(presketched_only)  {
             CONST_IF(samesketch) {
                 sketch.read(path);
                 set_estim_and_jestim(sketch, estim, jestim); // HLL is the only type that needs this, and it's the same
-            } else new(final_sketches + i) final_type(path.data()); // Read from path
+            } else new(final_sketches + slot) final_type(path.data()); // Read from path
         } else {
-            const std::string fpath(make_fname<SketchType>(path.data(), sketch_size, wsz, k, sp.c_, spacing, suffix, prefix, enct));
-            const bool isf = isfile(fpath);
-            if(cache_sketch && isf) {
-                LOG_DEBUG("Sketch found at %s with size %zu, %u\n", fpath.data(), size_t(1ull << sketch_size), sketch_size);
+            const CachedSketch cached(cache_sketch ? find_cached<SketchType>(path, sketch_size, wsz, k, sp.c_, spacing, suffix, prefix, enct, canon, cms.empty() ? nullptr: &cms.front(), mincount, true)
+                                                   : CachedSketch());
+            if(cached.found) {
+                LOG_DEBUG("Sketch found at %s with size %zu, %u\n", cached.path.data(), size_t(1ull << sketch_size), sketch_size);
                 CONST_IF(samesketch) {
-                    sketch.read(fpath);
+                    sketch.read(cached.path);
                     set_estim_and_jestim(sketch, estim, jestim);
                 } else {
-                    new(final_sketches + i) final_type(fpath);
+                    new(final_sketches + slot) final_type(cached.path);
                 }
             } else {
                 const int tid = omp_get_thread_num();
@@ -143,58 +547,98 @@ void dist_sketch_and_cmp(const std::vector<std::string> &inpaths, std::vector<Co
                 } else {
                     FILL_SKETCH_MIN(score::Lex);
                 }
-                CONST_IF(samesketch) {
-                    if(cache_sketch && !isf) sketch.write(fpath);
-                } else if(cache_sketch) final_sketches[i].write(fpath);
+                if(cache_sketch) {
+                    CONST_IF(samesketch) sketch.write(cached.write_path());
+                    else                 final_sketches[slot].write(cached.write_path());
+                    cached.insert(path);
+                }
             }
         }
+        live[slot] = 1;
         ++ncomplete; // Atomic
-    }
-    _Pragma("omp parallel for")
-    for(size_t i = 0; i < sketches.size(); ++i) {
-        sketch_finalize(final_sketches[i]);
-    }
-    kseqs.free();
-    ks::string str("#Path\tSize (est.)\n");
-    assert(str == "#Path\tSize (est.)\n");
-    str.resize(BUFFER_FLUSH_SIZE);
-    {
-        const int fn(fileno(ofp));
-        for(size_t i(0); i < sketches.size(); ++i) {
-            double card;
-            CONST_IF(samesketch) card = cardinality_estimate(sketches[i]);
-            else                 card = cardinality_estimate(final_sketches[i]);
-            str.sprintf("%s\t%zu\n", inpaths[i].data(), size_t(card));
-            if(str.size() >= BUFFER_FLUSH_SIZE) str.flush(fn);
+    };
+    // Sketches and finalizes inputs [begin, end) into the slots from slot0, reporting load balance if what is given.
+    const auto sketch_range = [&](size_t begin, size_t end, size_t slot0, const char *what) {
+        const std::vector<size_t> work = presketched_only ? std::vector<size_t>(end - begin)
+                                                          : detail::estimate_work(std::vector<std::string>(inpaths.begin() + begin, inpaths.begin() + end));
+        ScheduleReport report(nthreads);
+        for_each_scheduled(work, choose_split_inputs(work, nthreads, split_files), report, [&](size_t i, bool split_file) {
+            sketch_input(begin + i, slot0 + i, split_file);
+        });
+        if(!presketched_only && what) report.report(what);
+        _Pragma("omp parallel for")
+        for(size_t i = 0; i < end - begin; ++i) {
+            sketch_finalize(final_sketches[slot0 + i]);
+        }
+    };
+    if(stream) {
+        sketch_range(0, nr, 0, "Sketching references");
+        stream_query_loop(final_sketches, inpaths, ofp, pairofp, use_scientific, k, result_type, emit_fmt, nq, gargs.query_window, [&](size_t q0, size_t q1) {
+            for(size_t slot = nr; slot < sketches.size(); ++slot) clear_slot(slot); // Reuse the previous window's slots
+            sketch_range(q0, q1, nr, nullptr);
+        });
+        kseqs.free();
+    } else if(out_of_core) {
+        // Sketch a window at a time, spilling each finalized sketch to a scratch pack.
+        const ScratchFile scratch(gargs.scratch_dir);
+        const std::string &scratch_path = scratch.path();
+        std::vector<double> sizes(inpaths.size());
+        {
+            PackHeader hdr;
+            hdr.sketch_type = SketchEnum<SketchType>::value, hdr.k = k, hdr.w = wsz, hdr.sketch_size = sketch_size, hdr.encoding = enct;
+            PackWriter spill(scratch_path, hdr, spacing);
+            const size_t window = sketches.size();
+            for(size_t b0 = 0; b0 < inpaths.size(); b0 += window) {
+                const size_t b1 = std::min(b0 + window, inpaths.size());
+                if(b0) for(size_t slot = 0; slot < window; ++slot) clear_slot(slot);
+                sketch_range(b0, b1, 0, nullptr);
+                for(size_t i = b0; i < b1; ++i) {
+                    sizes[i] = cardinality_estimate(final_sketches[i - b0]);
+                    spill.add_sketch(inpaths[i], final_sketches[i - b0]);
+                }
+            }
+            LOG_INFO("Spilled %zu sketches (%zu bytes) to %s\n", spill.size(), size_t(spill.finish()), scratch_path.data());
         }
-        str.flush(fn);
+        kseqs.free();
+        for(size_t slot = 0; slot < sketches.size(); ++slot) clear_slot(slot);
+        auto spilled = SketchPack::open(scratch_path);
+        size_t sketch_bytes = 0;
+        for(size_t i = 0; i < spilled->size(); ++i) sketch_bytes = std::max(sketch_bytes, spilled->payload_bytes(i));
+        const size_t block = out_of_core_block_size(inpaths.size(), sketch_bytes, gargs.memory_budget);
+        resize_slots(2 * block);
+        emit_sizes(ofp, inpaths, [&](size_t i) {return sizes[i];});
+        write_matrix_header(pairofp, inpaths, emit_fmt, 0);
+        out_of_core_dist_loop(final_sketches, block, inpaths, pairofp, use_scientific, k, result_type, emit_fmt, [&](size_t begin, size_t end, size_t slot0) {
+            #pragma omp parallel for schedule(dynamic)
+            for(size_t i = begin; i < end; ++i) {
+                const size_t slot = slot0 + i - begin;
+                clear_slot(slot);
+                read_packed(sketches[slot], final_sketches + slot, *spilled, i);
+                CONST_IF(samesketch) set_estim_and_jestim(sketches[slot], estim, jestim);
+                live[slot] = 1;
+                sketch_finalize(final_sketches[slot]);
+                cardinality_estimate(final_sketches[slot]); // Cached for comparisons
+            }
+        });
+    } else if(gargs.nshards) {
+        // A shard's rows are compared only against later inputs, so the inputs before its first row are never sketched (or read).
+        const auto rows = shard_rows(inpaths.size(), gargs.shard, gargs.nshards);
+        sketch_range(rows.first, inpaths.size(), rows.first, "Sketching");
+        kseqs.free();
+        // Comparisons use each sketch's cached cardinality, so estimate them all, including those of later inputs whose sizes are not written.
+        #pragma omp parallel for
+        for(size_t i = rows.second; i < inpaths.size(); ++i) cardinality_estimate(final_sketches[i]);
+        emit_sizes(ofp, inpaths, [&](size_t i) {return cardinality_estimate(final_sketches[i]);}, rows.first, rows.second);
+        shard_loop<final_type>(pairofp, final_sketches + rows.first, inpaths, k, result_type, nthreads, nq);
+    } else {
+        sketch_range(0, inpaths.size(), 0, "Sketching");
+        kseqs.free();
+        emit_sizes_and_dists(final_sketches, inpaths, ofp, pairofp, use_scientific, k, result_type, emit_fmt, nthreads, nq);
     }
     if(ofp != stdout) std::fclose(ofp);
-    str.clear();
-    if(emit_fmt == UT_TSV) {
-        str.sprintf("##Names\t");
-        for(size_t i = 0; i < inpaths.size() - nq; ++i)
-            str.sprintf("%s\t", inpaths[i].data());
-        str.back() = '\n';
-        str.write(fileno(pairofp)); str.free();
-    } else if(emit_fmt == UPPER_TRIANGULAR) { // emit_fmt == UPPER_TRIANGULAR
-        std::fprintf(pairofp, "%zu\n", inpaths.size());
-        std::fflush(pairofp);
-    }
-    dist_loop<final_type>(pairofp, final_sketches, inpaths, use_scientific, k, result_type, emit_fmt, nthreads, BUFFER_FLUSH_SIZE, nq);
     CONST_IF(!samesketch) {
-#if __cplusplus >= 201703L
-        std::destroy_n(
-#  if __cpp_lib_execution
-            std::execution::par_unseq,
-#  endif
-            final_sketches, inpaths.size());
-#else
-        std::for_each(final_sketches, final_sketches + inpaths.size(), [](auto &sketch) {
-            using destructor_type = typename std::decay<decltype(sketch)>::type;
-            sketch.~destructor_type();
-        });
-#endif
+        for(size_t slot = 0; slot < sketches.size(); ++slot)
+            if(live[slot]) final_sketches[slot].~final_type();
         std::free(final_sketches);
     }
 } // dist_sketch_and_cmp
@@ -211,53 +655,236 @@ template void ::bns::dist_sketch_and_cmp<sketch::wj::WeightedSketcher<DS>>(const
                    size_t nq, EncodingType enct);
 
 
+/*
+ * Sketches multiplexed streams in one pass. Each record goes to the sketch of the sample named by a field of its read
+ * name (or comment), per gargs.demux_*, and each sample's sketch is written as if the sample had been its own input file.
+ * Reading the next batch overlaps hashing the current one. Every sample is owned by a single thread, so no merging is needed.
+ */
+template<typename SketchType>
+void demux_sketch(uint32_t sketch_size, unsigned nthreads, uint32_t wsz, const Spacer &sp, const std::vector<std::string> &inpaths,
+                  const std::string &suffix, const std::string &prefix, const std::string &spacing,
+                  EstimationMethod estim, JointEstimationMethod jestim, bool canon, EncodingType enct)
+{
+    struct Batch {
+        SeqBatch seqs;
+        std::vector<std::pair<uint32_t, SketchType *>> dest;
+    };
+    std::deque<SketchType> sketches; // Grows while other threads hash into existing elements, which deque leaves in place.
+    std::vector<std::string> samples;
+    std::unordered_map<std::string, uint32_t> ids;
+    std::string key;
+    size_t unassigned = 0;
+    // Returns false once the input is exhausted.
+    auto fill = [&](KSeqBatchReader &reader, Batch &b) {
+        kseq_t *ks = reader.kseq();
+        b.seqs.clear();
+        b.dest.clear();
+        int rc;
+        while((rc = kseq_read(ks)) >= 0) {
+            const kstring_t &field = gargs.demux_comment ? ks->comment: ks->name;
+            const auto k = demux_key(field.s ? field.s: "", field.l, gargs.demux_delim, gargs.demux_field);
+            if(k.second == 0) {
+                ++unassigned;
+                continue;
+            }
+            key.assign(k.first, k.second);
+            auto it = ids.find(key);
+            if(it == ids.end()) {
+                it = ids.emplace(key, samples.size()).first;
+                samples.push_back(key);
+                for(auto &c: samples.back()) if(c == '/' || c == FNAME_SEP) c = '_';
+                sketches.emplace_back(construct<SketchType>(sketch_size));
+                set_estim_and_jestim(sketches.back(), estim, jestim);
+            }
+            b.seqs.add(ks->seq.s, ks->seq.l);
+            b.dest.emplace_back(it->second, &sketches[it->second]);
+            if(b.seqs.nbases() >= SPLIT_BATCH_BASES) return true;
+        }
+        if(rc < -1) RUNTIME_ERROR(ks::sprintf("Malformed or truncated sequence file (kseq code %d)", rc).data());
+        return false;
+    };
+    auto hash = [&](const Batch &b) {
+        #pragma omp parallel num_threads(nthreads)
+        {
+            const unsigned tid = omp_get_thread_num(), nt = omp_get_num_threads();
+            Encoder<bns::score::Lex> enc(nullptr, 0, sp, nullptr, canon);
+            RollingHasher<uint64_t> rolling_hasher(sp.k_, canon);
+            const KmerKernel kernel = make_kmer_kernel(sp, canon, enct);
+            size_t r = 0;
+            b.seqs.for_each([&](const char *seq, size_t l) {
+                const auto &d = b.dest[r++];
+                if(d.first % nt != tid) return;
+                if(enct == NTHASH) {
+                    BatchInserter<SketchType, true> ins(*d.second);
+                    encode_seq(enc, rolling_hasher, kernel, enct, seq, l, [&](u64 kmer){ins.add(kmer);});
+                } else {
+                    BatchInserter<SketchType> ins(*d.second);
+                    encode_seq(enc, rolling_hasher, kernel, enct, seq, l, [&](u64 kmer){ins.add(kmer);});
+                }
+            });
+        }
+    };
+    for(const auto &path: inpaths) {
+        for_each_substr([&](const char *s) {
+            KSeqBatchReader reader(s);
+            Batch cur, next;
+            bool more = fill(reader, cur);
+            for(;;) {
+                std::future<bool> pending;
+                if(more) pending = std::async(std::launch::async, [&]() {return fill(reader, next);});
+                hash(cur);
+                if(!more) break;
+                more = pending.get();
+                std::swap(cur, next);
+            }
+        }, path, FNAME_SEP);
+    }
+    LOG_INFO("Demultiplexed %zu samples; %zu records had no sample field\n", samples.size(), unassigned);
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t i = 0; i < samples.size(); ++i) {
+        auto &h = sketches[i];
+        sketch_finalize(h);
+        h.write(make_fname<SketchType>(samples[i].data(), sketch_size, wsz, sp.k_, sp.c_, spacing, suffix, prefix, enct).data());
+    }
+}
+
 template<typename SketchType>
 INLINE void sketch_core(uint32_t ssarg, uint32_t nthreads, uint32_t wsz, uint32_t k, const Spacer &sp, const std::vector<std::string> &inpaths, const std::string &suffix, const std::string &prefix, std::vector<CountingSketch> &cms, EstimationMethod estim, JointEstimationMethod jestim, KSeqBufferHolder &kseqs, const std::vector<bool> &use_filter, const std::string &spacing, bool skip_cached, bool canon, uint32_t mincount, bool entropy_minimization, EncodingType enct) {
     std::vector<SketchType> sketches;
     uint32_t sketch_size = bytesl2_to_arg(ssarg, SketchEnum<SketchType>::value);
+    if(gargs.demux) {
+        if(use_filter.size()) RUNTIME_ERROR("Count-min filtering is not supported when demultiplexing.");
+        demux_sketch<SketchType>(sketch_size, nthreads, wsz, sp, inpaths, suffix, prefix, spacing, estim, jestim, canon, enct);
+        return;
+    }
     while(sketches.size() < (u32)nthreads) sketches.push_back(construct<SketchType>(sketch_size)), set_estim_and_jestim(sketches.back(), estim, jestim);
-    std::vector<std::string> fnames(nthreads);
     RollingHasher<uint64_t> rolling_hasher(k, canon);
+    const KmerKernel kernel = make_kmer_kernel(sp, canon, enct);
 
     if(entropy_minimization)
         throw std::runtime_error("Removed.");
-    #pragma omp parallel for schedule(dynamic)
-    for(size_t i = 0; i < inpaths.size(); ++i) {
+    const bool split_files = split_requested(nthreads) && use_filter.empty() && is_split_mergeable<SketchType>::value;
+    const unsigned split_threads = gargs.compute_threads ? gargs.compute_threads: nthreads;
+    if((gargs.split_files || gargs.io_threads) && !split_files)
+        LOG_WARNING("Not splitting files across threads: requires more than one thread or --io-threads, no count-min filtering, and an HLL, bloom filter, range minhash, or b-bit minhash sketch.\n");
+    const std::vector<size_t> work = detail::estimate_work(inpaths);
+    ScheduleReport report(nthreads);
+    for_each_scheduled(work, choose_split_inputs(work, nthreads, split_files), report, [&](size_t i, bool split_file) {
         const int tid = omp_get_thread_num();
-        std::string &fname = fnames[tid];
-        fname = make_fname<SketchType>(inpaths[i].data(), sketch_size, wsz, k, sp.c_, spacing, suffix, prefix, enct);
-        LOG_DEBUG("fname: %s from %s\n", fname.data(), inpaths[i].data());
-        if(skip_cached && isfile(fname)) continue;
+        const CachedSketch cached(find_cached<SketchType>(inpaths[i], sketch_size, wsz, k, sp.c_, spacing, suffix, prefix, enct, canon,
+                                                          use_filter.size() && use_filter[i] ? &cms.front(): nullptr, mincount, skip_cached));
+        LOG_DEBUG("fname: %s from %s\n", cached.path.data(), inpaths[i].data());
+        if(skip_cached && cached.found) return;
         Encoder<bns::score::Lex> enc(nullptr, 0, sp, nullptr, canon);
         auto &h = sketches[tid];
         if(use_filter.size() && use_filter[i]) {
             auto &cm = cms[tid];
             if(enct == NTHASH) {
-                for_each_substr([&](const char *s) {enc.for_each_hash([&](u64 kmer){if(cm.addh(kmer) >= mincount) h.add(kmer);}, s, &kseqs[tid]);}, inpaths[i], FNAME_SEP);
-            } else if(enct == BONSAI) {
-                for_each_substr([&](const char *s) {enc.for_each([&](u64 kmer){if(cm.addh(kmer) >= mincount) h.addh(kmer);}, s, &kseqs[tid]);}, inpaths[i], FNAME_SEP);
+                BatchInserter<SketchType, true> ins(h);
+                for_each_substr([&](const char *s) {for_each_kmer(enc, rolling_hasher, kernel, enct, s, &kseqs[tid], [&](u64 kmer){if(cm.addh(kmer) >= mincount) ins.add(kmer);});}, inpaths[i], FNAME_SEP);
             } else {
-                for_each_substr([&](const char *s) {rolling_hasher.for_each_hash([&](u64 kmer){if(cm.addh(kmer) >= mincount) h.addh(kmer);}, s, &kseqs[tid]);}, inpaths[i], FNAME_SEP);
+                BatchInserter<SketchType> ins(h);
+                for_each_substr([&](const char *s) {for_each_kmer(enc, rolling_hasher, kernel, enct, s, &kseqs[tid], [&](u64 kmer){if(cm.addh(kmer) >= mincount) ins.add(kmer);});}, inpaths[i], FNAME_SEP);
             }
             cm.clear();  
+        } else if(split_file) {
+            SplitFiller<SketchType>::template fill<bns::score::Lex>(h, inpaths[i], sp, canon, enct, split_threads, sketch_size, estim, jestim);
         } else {
             if(enct == NTHASH) {
-                for_each_substr([&](const char *s) {enc.for_each_hash([&](u64 kmer){h.add(kmer);}, inpaths[i].data(), &kseqs[tid]);}, inpaths[i], FNAME_SEP);
-            } else if(enct == BONSAI) {
-                for_each_substr([&](const char *s) {enc.for_each([&](u64 kmer){h.addh(kmer);}, s, &kseqs[tid]);}, inpaths[i], FNAME_SEP);
+                BatchInserter<SketchType, true> ins(h);
+                for_each_substr([&](const char *s) {for_each_kmer(enc, rolling_hasher, kernel, enct, s, &kseqs[tid], [&](u64 kmer){ins.add(kmer);});}, inpaths[i], FNAME_SEP);
             } else {
-                for_each_substr([&](const char *s) {rolling_hasher.for_each_hash([&](u64 kmer){h.addh(kmer);}, s, &kseqs[tid]);}, inpaths[i], FNAME_SEP);
+                BatchInserter<SketchType> ins(h);
+                for_each_substr([&](const char *s) {for_each_kmer(enc, rolling_hasher, kernel, enct, s, &kseqs[tid], [&](u64 kmer){ins.add(kmer);});}, inpaths[i], FNAME_SEP);
             }
         }
         sketch_finalize(h);
-        h.write(fname.data());
+        h.write(cached.write_path().data());
+        cached.insert(inpaths[i]);
         h.clear();
+    });
+    report.report("Sketching");
+}
+// A requested sketch type and its log2 size in bytes, as given to `dashing sketch --sketch-types`.
+using SketchSpec = std::pair<Sketch, uint32_t>;
+// Sketches every input once for all of specs, writing each type to its own file (see sketchcoremulti.cpp).
+void multi_sketch_core(const std::vector<SketchSpec> &specs, uint32_t nthreads, uint32_t wsz, uint32_t k, const Spacer &sp, const std::vector<std::string> &inpaths, const std::string &suffix, const std::string &prefix, std::vector<CountingSketch> &cms, EstimationMethod estim, JointEstimationMethod jestim, KSeqBufferHolder &kseqs, const std::vector<bool> &use_filter, const std::string &spacing, bool skip_cached, bool canon, uint32_t mincount, EncodingType enct);
+
+// Rows and columns per tile of all-pairs comparisons, such that a tile's sketches fit in gargs.tile_cache_bytes.
+// Rows are also capped because each one buffers a full row of distances. {0, 0} compares one row at a time.
+inline std::pair<size_t, size_t> tile_shape(size_t nsketches) {
+    static constexpr size_t MAX_TILE_ROWS = 64;
+    if(gargs.tile_cache_bytes == 0 || gargs.sketch_bytes == 0 || nsketches < 3) return {0, 0};
+    const size_t per_side = std::max(gargs.tile_cache_bytes / 2 / gargs.sketch_bytes, size_t(1));
+    return {std::min(per_side, MAX_TILE_ROWS), per_side};
+}
+// Moves registers into an HllArena when every comparison for result_type is batched, and their layout is uniform.
+// hlls are then left empty: pass the arena to every comparison over them (null is returned, and hlls kept, otherwise).
+template<typename SketchType>
+std::unique_ptr<HllArena> make_comparison_arena(SketchType *, size_t, EmissionType) {return nullptr;}
+inline std::unique_ptr<HllArena> make_comparison_arena(hll::hll_t *hlls, size_t n, EmissionType result_type) {
+    if(n == 0 || hlls[0].get_jestim() == hll::JointEstimationMethod::ERTL_JOINT_MLE
+       || (result_type != JI && result_type != MASH_DIST && result_type != FULL_MASH_DIST))
+        return nullptr;
+    for(size_t i = 1; i < n; ++i)
+        if(hlls[i].core().size() != hlls[0].core().size()) return nullptr;
+    return std::unique_ptr<HllArena>(new HllArena(hlls, n, gargs.huge_pages));
+}
+inline void report_pair_rate(size_t nsketches, std::chrono::steady_clock::time_point start, size_t tile_rows, size_t tile_cols) {
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const double npairs = nsketches * (nsketches - 1) / 2.;
+    if(tile_cols) LOG_INFO("Compared %.0f pairs in %.3fs (%.4g pairs/s) in tiles of %zu rows by %zu columns\n", npairs, secs, npairs / secs, tile_rows, tile_cols);
+    else          LOG_INFO("Compared %.0f pairs in %.3fs (%.4g pairs/s) one row at a time\n", npairs, secs, npairs / secs);
+}
+
+/*
+ * Computes rows [row_begin, row_end) of the upper triangle of all-pairs comparisons a block of rows at a time (tile_rows per block when tiling, else one),
+ * and hands each block to consume(i0, i1, rows), where rows[i - i0][j - i - 1] is the result for (i, j).
+ * Blocks are consumed in order on one thread while the next is computed, so consume may keep state without locking.
+ * If given, filter(i0, i, rows[i - i0]) is first called for each row of the block, in parallel on the compute threads.
+ * arena holds hlls' registers if they were moved into one (see make_comparison_arena), or is null.
+ */
+struct NoRowFilter {
+    void operator()(size_t, size_t, const float *) const {}
+};
+template<typename SketchType, typename Consume, typename Filter=NoRowFilter>
+void for_each_row_block(SketchType *hlls, const HllArena *arena, size_t nsketches, size_t row_begin, size_t row_end, EmissionType result_type, float ksinv, size_t tile_rows, size_t tile_cols, const Consume &consume, const Filter &filter=Filter()) {
+    const size_t block_rows = tile_cols ? tile_rows: 1;
+    std::future<void> consumer;
+    std::array<std::vector<float>, 2> bufs;
+    std::array<std::vector<float *>, 2> rowps;
+    for(size_t i0 = row_begin, b = 0; i0 < row_end; i0 += block_rows, ++b) {
+        const size_t i1 = std::min(i0 + block_rows, row_end);
+        auto &buf = bufs[b & 1];
+        auto &rows = rowps[b & 1];
+        buf.resize(block_rows * (nsketches - 1));
+        rows.resize(i1 - i0);
+        for(size_t i = i0; i < i1; ++i) rows[i - i0] = buf.data() + (i - i0) * (nsketches - 1);
+        if(tile_cols) {
+            auto &dists = rows;
+            const TileBlock block{i0, i1, tile_cols};
+            CORE_ITER_OP(perform_tile_op, block);
+        } else {
+            float *const dists = rows[0];
+            const size_t i = i0;
+            CORE_ITER(_a);
+        }
+        if(!std::is_same<Filter, NoRowFilter>::value) {
+            #pragma omp parallel for schedule(dynamic)
+            for(size_t i = i0; i < i1; ++i) filter(i0, i, rows[i - i0]);
+        }
+        if(consumer.valid()) consumer.get();
+        consumer = std::async(std::launch::async, [&consume, i0, i1, rows = rows.data()]() {consume(i0, i1, rows);});
     }
+    if(consumer.valid()) consumer.get();
 }
+
 template<typename SketchType>
 void dist_loop(std::FILE *ofp, SketchType *hlls, const std::vector<std::string> &inpaths, const bool use_scientific, const unsigned k, const EmissionType result_type, EmissionFormat emit_fmt, int nthreads, const size_t buffer_flush_size, size_t nq) {
+    const auto arena_owner = make_comparison_arena(hlls, inpaths.size(), result_type);
+    const HllArena *const arena = arena_owner.get();
     if(nq) {
-        partdist_loop<SketchType>(ofp, hlls, inpaths, use_scientific, k, result_type, emit_fmt, nthreads, buffer_flush_size, nq);
+        partdist_loop<SketchType>(ofp, hlls, inpaths, use_scientific, k, result_type, emit_fmt, nthreads, buffer_flush_size, nq, arena);
         return;
     }
     if(!is_symmetric(result_type)) {
@@ -265,33 +892,43 @@ void dist_loop(std::FILE *ofp, SketchType *hlls, const std::vector<std::string>
         std::sprintf(buf, "Can't perform symmetric distance comparisons with a symmetric method (%s/%d). To perform an asymmetric distance comparison between a given set and itself, provide the same list of filenames to both -Q and -F.\n", emt2str(result_type), int(result_type));
         RUNTIME_ERROR(buf);
     }
+    if(gargs.extend_nold) {
+        extend_loop<SketchType>(ofp, hlls, arena, inpaths, k, result_type);
+        return;
+    }
     const float ksinv = 1./ k;
     const int pairfi = fileno(ofp);
     omp_set_num_threads(nthreads);
     const size_t nsketches = inpaths.size();
+    const auto shape = tile_shape(nsketches);
+    const size_t tile_rows = shape.first, tile_cols = shape.second;
+    const auto start = std::chrono::steady_clock::now();
     if((emit_fmt & BINARY) == 0) {
-        std::future<size_t> submitter;
-        std::array<std::vector<float>, 2> dps;
-        dps[0].resize(nsketches - 1);
-        dps[1].resize(nsketches - 2);
         ks::string str;
-        for(size_t i = 0; i < nsketches; ++i) {
-            std::vector<float> &dists = dps[i & 1];
-            CORE_ITER(_a);
-            //LOG_DEBUG("Finished chunk %zu of %zu\n", i + 1, nsketches);
-            if(i) submitter.get();
-            submitter = std::async(std::launch::async, submit_emit_dists<float>,
-                                   pairfi, dists.data(), nsketches, i,
-                                   std::ref(str), std::ref(inpaths), emit_fmt, use_scientific, buffer_flush_size);
-        }
-        submitter.get();
+        for_each_row_block(hlls, arena, nsketches, 0, nsketches, result_type, ksinv, tile_rows, tile_cols, [&](size_t i0, size_t i1, float *const *rows) {
+            for(size_t i = i0; i < i1; ++i)
+                submit_emit_dists<float>(pairfi, rows[i - i0], nsketches, i, str, inpaths, emit_fmt, use_scientific, buffer_flush_size);
+        });
+        report_pair_rate(nsketches, start, tile_rows, tile_cols);
     } else {
         dm::DistanceMatrix<float> dm(nsketches);
-        for(size_t i = 0; i < nsketches; ++i) {
-            auto span = dm.row_span(i);
-            auto &dists = span.first;
-            CORE_ITER(_b);
+        if(tile_cols) {
+            std::vector<float *> dists;
+            for(size_t i0 = 0; i0 < nsketches; i0 += tile_rows) {
+                const size_t i1 = std::min(i0 + tile_rows, nsketches);
+                dists.clear();
+                for(size_t i = i0; i < i1; ++i) dists.push_back(dm.row_span(i).first);
+                const TileBlock block{i0, i1, tile_cols};
+                CORE_ITER_OP(perform_tile_op, block);
+            }
+        } else {
+            for(size_t i = 0; i < nsketches; ++i) {
+                auto span = dm.row_span(i);
+                auto &dists = span.first;
+                CORE_ITER(_b);
+            }
         }
+        report_pair_rate(nsketches, start, tile_rows, tile_cols);
         if(emit_fmt == FULL_TSV) dm.printf(ofp, use_scientific, &inpaths);
         else {
             assert(emit_fmt == BINARY);
@@ -300,6 +937,287 @@ void dist_loop(std::FILE *ofp, SketchType *hlls, const std::vector<std::string>
         }
     }
 }
+/*
+ * --memory-budget: all pairs with only two blocks of sketches in memory. load(begin, end, slot0) loads inputs [begin, end)
+ * into slots from slot0: each block of rows goes to slots [block, 2 * block), and is compared against every later block
+ * in turn in slots [0, block), then against itself. Rows are emitted a block at a time, while the next block is compared,
+ * in the same order and format as dist_loop; binary and full TSV output collect the matrix in memory, as dist_loop does.
+ */
+template<typename SketchType, typename LoadBlock>
+void out_of_core_dist_loop(SketchType *slots, size_t block, const std::vector<std::string> &inpaths, std::FILE *ofp, const bool use_scientific, const unsigned k, const EmissionType result_type, EmissionFormat emit_fmt, const LoadBlock &load) {
+    if(!is_symmetric(result_type))
+        RUNTIME_ERROR(std::string("--memory-budget computes symmetric all-pairs comparisons, not ") + emt2str(result_type) + ".");
+    const float ksinv = 1./ k;
+    const size_t n = inpaths.size();
+    const bool to_matrix = emit_fmt == BINARY || emit_fmt == FULL_TSV;
+    std::unique_ptr<dm::DistanceMatrix<float>> dm(to_matrix ? new dm::DistanceMatrix<float>(n): nullptr);
+    std::array<std::vector<float>, 2> bufs;
+    std::array<std::vector<float *>, 2> rowps; // rows[i - i0][j - i - 1] is the result for (i, j)
+    std::future<void> consumer;
+    ks::string str;
+    size_t nloads = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for(size_t i0 = 0, b = 0; i0 < n; i0 += block, ++b) {
+        const size_t i1 = std::min(i0 + block, n), ni = i1 - i0;
+        auto &rows = rowps[b & 1];
+        rows.resize(ni);
+        if(to_matrix) {
+            for(size_t i = i0; i < i1; ++i) rows[i - i0] = dm->row_span(i).first;
+        } else {
+            auto &buf = bufs[b & 1];
+            buf.resize(ni * (n - 1));
+            for(size_t i = i0; i < i1; ++i) rows[i - i0] = buf.data() + (i - i0) * (n - 1);
+        }
+        load(i0, i1, block), ++nloads;
+        for(size_t j0 = i1; j0 < n; j0 += block) {
+            const size_t j1 = std::min(j0 + block, n);
+            load(j0, j1, 0), ++nloads;
+            for(size_t i = i0; i < i1; ++i)
+                fill_query_row(slots, j1 - j0, block + i - i0, result_type, ksinv, rows[i - i0] + (j0 - i - 1), nullptr);
+        }
+        // Last, since all-pairs comparisons free each row's sketch once its row is done
+        const auto shape = tile_shape(ni);
+        for_each_row_block(slots + block, nullptr, ni, 0, ni, result_type, ksinv, shape.first, shape.second, [&](size_t l0, size_t l1, float *const *block_rows) {
+            for(size_t l = l0; l < l1; ++l) std::copy(block_rows[l - l0], block_rows[l - l0] + (ni - l - 1), rows[l]);
+        });
+        if(consumer.valid()) consumer.get();
+        if(!to_matrix)
+            consumer = std::async(std::launch::async, [&,i0,i1,rows = rows.data()]() {
+                for(size_t i = i0; i < i1; ++i)
+                    submit_emit_dists<float>(fileno(ofp), rows[i - i0], n, i, str, inpaths, emit_fmt, use_scientific, BUFFER_FLUSH_SIZE);
+            });
+    }
+    if(consumer.valid()) consumer.get();
+    const double npairs = n * (n - 1) / 2., secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    LOG_INFO("Compared %.0f pairs in %.3fs (%.4g pairs/s) out of core, in blocks of %zu sketches (%zu block loads)\n", npairs, secs, npairs / secs, block, nloads);
+    if(emit_fmt == FULL_TSV) dm->printf(ofp, use_scientific, &inpaths);
+    else if(to_matrix)       dm->write(ofp);
+}
+/*
+ * --topk: keeps each row's gargs.topk best neighbours in NeighborHeaps while comparing, then writes only those.
+ * All pairs (nq == 0) go through for_each_row_block, offering each result to both of its rows; queries are compared
+ * one at a time against the references, excluding any reference with the query's own path.
+ * Memory is O((n + block of rows) * topk) rather than O(n^2).
+ */
+template<typename SketchType>
+void topk_loop(std::FILE *ofp, SketchType *hlls, const std::vector<std::string> &inpaths, const bool use_scientific, const unsigned k, const EmissionType result_type, EmissionFormat emit_fmt, int nthreads, size_t nq) {
+    const auto arena_owner = make_comparison_arena(hlls, inpaths.size(), result_type);
+    const HllArena *const arena = arena_owner.get();
+    const float ksinv = 1./ k;
+    omp_set_num_threads(nthreads);
+    const auto start = std::chrono::steady_clock::now();
+    if(nq) {
+        if(nq >= inpaths.size())
+            RUNTIME_ERROR(ks::sprintf("Wrong number of query/references. (ip size: %zu, nq: %zu\n", inpaths.size(), nq).data());
+        const size_t nr = inpaths.size() - nq;
+        std::unordered_map<std::string, size_t> refidx;
+        for(size_t j = 0; j < nr; ++j) refidx.emplace(inpaths[j], j);
+        NeighborHeaps heaps(nq, std::min(gargs.topk, nr), is_similarity(result_type));
+        std::vector<float> row(nr);
+        for(size_t qi = nr; qi < inpaths.size(); ++qi) {
+            fill_query_row(hlls, nr, qi, result_type, ksinv, row.data(), arena);
+            const auto it = refidx.find(inpaths[qi]);
+            heaps.add_row(qi - nr, row.data(), nr, it == refidx.end() ? SIZE_MAX: it->second);
+        }
+        LOG_INFO("Compared %zu queries against %zu references in %.3fs\n", nq, nr, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        heaps.finalize();
+        heaps.write(ofp, inpaths, nr, emit_fmt, use_scientific, result_type);
+        return;
+    }
+    if(!is_symmetric(result_type))
+        RUNTIME_ERROR(std::string("Nearest neighbours among all inputs need a symmetric comparison, not ") + emt2str(result_type) + ". Provide the same list of filenames to both -Q and -F instead.");
+    const size_t nsketches = inpaths.size();
+    const auto shape = tile_shape(nsketches);
+    NeighborHeaps heaps(nsketches, std::min(gargs.topk, nsketches - 1), is_similarity(result_type));
+    for_each_row_block(hlls, arena, nsketches, 0, nsketches, result_type, ksinv, shape.first, shape.second, [&](size_t i0, size_t i1, float *const *rows) {
+        for(size_t i = i0; i < i1; ++i) heaps.add_upper_row(i, rows[i - i0], nsketches);
+    });
+    report_pair_rate(nsketches, start, shape.first, shape.second);
+    heaps.finalize();
+    heaps.write(ofp, inpaths, 0, emit_fmt, use_scientific, result_type);
+}
+/*
+ * --min-similarity/--max-dist: writes only the pairs passing gargs.edge_threshold, as an edge list (see EdgeFilter).
+ * Rows are filtered on the compute threads as soon as they are computed; only the survivors are formatted and written.
+ */
+template<typename SketchType>
+void edge_loop(std::FILE *ofp, SketchType *hlls, const std::vector<std::string> &inpaths, const bool use_scientific, const unsigned k, const EmissionType result_type, EmissionFormat emit_fmt, int nthreads, size_t nq) {
+    const auto arena_owner = make_comparison_arena(hlls, inpaths.size(), result_type);
+    const HllArena *const arena = arena_owner.get();
+    const float ksinv = 1./ k;
+    const int fn = fileno(ofp);
+    omp_set_num_threads(nthreads);
+    const auto start = std::chrono::steady_clock::now();
+    if(nq) {
+        if(nq >= inpaths.size())
+            RUNTIME_ERROR(ks::sprintf("Wrong number of query/references. (ip size: %zu, nq: %zu\n", inpaths.size(), nq).data());
+        const size_t nr = inpaths.size() - nq;
+        EdgeFilter edges(gargs.edge_threshold, is_similarity(result_type), 1);
+        edges.write_header(ofp, emit_fmt, result_type);
+        std::vector<float> row(nr);
+        std::future<void> writer;
+        for(size_t q = 0; q < nq; ++q) {
+            fill_query_row(hlls, nr, nr + q, result_type, ksinv, row.data(), arena);
+            if(writer.valid()) writer.get();
+            edges.filter_row(q, row.data(), nr);
+            writer = std::async(std::launch::async, [&, q]() {edges.write(fn, q, q + 1, inpaths, nr, emit_fmt, use_scientific);});
+        }
+        if(writer.valid()) writer.get();
+        LOG_INFO("Kept %zu of %zu pairs in %.3fs\n", edges.nedges(), nq * nr, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        return;
+    }
+    if(!is_symmetric(result_type))
+        RUNTIME_ERROR(std::string("Thresholding all pairs needs a symmetric comparison, not ") + emt2str(result_type) + ". Provide the same list of filenames to both -Q and -F instead.");
+    const size_t nsketches = inpaths.size();
+    const auto shape = tile_shape(nsketches);
+    EdgeFilter edges(gargs.edge_threshold, is_similarity(result_type), shape.second ? shape.first: 1);
+    edges.write_header(ofp, emit_fmt, result_type);
+    for_each_row_block(hlls, arena, nsketches, 0, nsketches, result_type, ksinv, shape.first, shape.second,
+        [&](size_t i0, size_t i1, float *const *) {edges.write(fn, i0, i1, inpaths, 0, emit_fmt, use_scientific);},
+        [&](size_t i0, size_t i, const float *row) {edges.filter_upper_row(i0, i, row, nsketches);});
+    report_pair_rate(nsketches, start, shape.first, shape.second);
+    LOG_INFO("Kept %zu of %zu pairs\n", edges.nedges(), nsketches * (nsketches - 1) / 2);
+}
+/*
+ * --lsh-threshold: finds candidate pairs by banding minhash signatures (see lsh.h), then compares only those exactly and
+ * writes the ones with a Jaccard similarity of at least the threshold as an edge list (see EdgeFilter), reported as result_type.
+ * Bands and rows are chosen for 95% recall at the threshold; the expected recall is logged, and given in the TSV header.
+ */
+template<typename SketchType>
+void lsh_loop_impl(std::FILE *ofp, SketchType *hlls, const std::vector<std::string> &inpaths, const bool use_scientific, const unsigned k, const EmissionType result_type, EmissionFormat emit_fmt, int nthreads, size_t nq, std::true_type) {
+    using Sig = LshSignature<SketchType>;
+    using Edge = EdgeFilter::Edge;
+    if(result_type != JI && result_type != MASH_DIST && result_type != FULL_MASH_DIST)
+        RUNTIME_ERROR(std::string("LSH candidate search supports Jaccard similarity and Mash distances, not ") + emt2str(result_type));
+    if(nq >= inpaths.size())
+        RUNTIME_ERROR(ks::sprintf("Wrong number of query/references. (ip size: %zu, nq: %zu\n", inpaths.size(), nq).data());
+    const float ksinv = 1./ k, threshold = gargs.lsh_threshold;
+    const size_t n = inpaths.size(), nr = n - nq, m = Sig::size(hlls, n);
+    omp_set_num_threads(nthreads);
+    const auto start = std::chrono::steady_clock::now();
+    const LshParams params = choose_lsh_params(m, Sig::match_probability(hlls, n, threshold));
+    const std::vector<uint64_t> candidates = lsh_candidates(hlls, n, nq, params, m);
+    std::vector<float> sims(candidates.size());
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for(size_t c = 0; c < candidates.size(); ++c)
+        sims[c] = similarity(hlls[candidates[c] & 0xFFFFFFFFu], hlls[candidates[c] >> 32]);
+    std::vector<Edge> edges;
+    for(size_t c = 0; c < candidates.size(); ++c) {
+        if(!(sims[c] >= threshold)) continue;
+        const float v = result_type == JI ? sims[c]: result_type == MASH_DIST ? dist_index(sims[c], ksinv): full_dist_index(sims[c], ksinv);
+        const uint32_t lo = candidates[c] >> 32, hi = candidates[c] & 0xFFFFFFFFu;
+        // With queries, the lower index is always the reference, and query rows are numbered from 0.
+        edges.push_back(nq ? Edge{uint32_t(hi - nr), lo, v}: Edge{lo, hi, v});
+    }
+    if(nq) std::sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) {return a.i != b.i ? a.i < b.i: a.j < b.j;});
+    const double npairs = nq ? double(nq) * nr: n * (n - 1) / 2.;
+    LOG_INFO("LSH: %u bands of %u rows over %zu positions; expected recall %.4f at similarity %g. Compared %zu candidates (%.3g%% of pairs), kept %zu, in %.3fs\n",
+             params.bands, params.rows, m, params.recall, threshold, candidates.size(), 100. * candidates.size() / npairs, edges.size(),
+             std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    if(emit_fmt != BINARY) {
+        std::fprintf(ofp, "#LSH\tbands=%u\trows=%u\texpected_recall=%f\tthreshold=%f\n", params.bands, params.rows, params.recall, threshold);
+        EdgeFilter::write_header(ofp, emit_fmt, result_type);
+    }
+    ks::string str;
+    EdgeFilter::write_edges(fileno(ofp), edges.data(), edges.size(), inpaths, nq ? nr: 0, emit_fmt, use_scientific, str);
+    str.flush(fileno(ofp));
+}
+template<typename SketchType>
+void lsh_loop_impl(std::FILE *, SketchType *, const std::vector<std::string> &, const bool, const unsigned, const EmissionType, EmissionFormat, int, size_t, std::false_type) {
+    RUNTIME_ERROR("LSH candidate search requires range minhash (--use-range-minhash) or b-bit minhash (--use-bb-minhash, --use-super-minhash) sketches.");
+}
+template<typename SketchType>
+void lsh_loop(std::FILE *ofp, SketchType *hlls, const std::vector<std::string> &inpaths, const bool use_scientific, const unsigned k, const EmissionType result_type, EmissionFormat emit_fmt, int nthreads, size_t nq) {
+    lsh_loop_impl(ofp, hlls, inpaths, use_scientific, k, result_type, emit_fmt, nthreads, nq, std::integral_constant<bool, LshSignature<SketchType>::enabled>());
+}
+/*
+ * --shard i/N: computes only shard i's rows of the all-pairs upper triangle (see shard_rows), and writes them
+ * in the shard format (see ShardHeader) for `dashing merge-shards`.
+ * hlls holds only the inputs those rows are compared against: hlls[0] is the shard's first row, and the last is input n - 1.
+ */
+template<typename SketchType>
+void shard_loop(std::FILE *ofp, SketchType *hlls, const std::vector<std::string> &inpaths, const unsigned k, const EmissionType result_type, int nthreads, size_t nq) {
+    if(nq) RUNTIME_ERROR("--shard splits all-pairs comparisons, and does not support queries.");
+    if(!is_symmetric(result_type))
+        RUNTIME_ERROR(std::string("Sharding all pairs needs a symmetric comparison, not ") + emt2str(result_type));
+    const size_t nsketches = inpaths.size();
+    const auto rows = shard_rows(nsketches, gargs.shard, gargs.nshards);
+    const size_t nheld = nsketches - rows.first; // Row i of the shard is hlls[i - rows.first]
+    const auto arena_owner = make_comparison_arena(hlls, nheld, result_type);
+    const HllArena *const arena = arena_owner.get();
+    const float ksinv = 1./ k;
+    const int fn = fileno(ofp);
+    omp_set_num_threads(nthreads);
+    const auto shape = tile_shape(nsketches);
+    ShardHeader hdr;
+    hdr.n = nsketches, hdr.row_begin = rows.first, hdr.row_end = rows.second;
+    hdr.result_type = result_type, hdr.shard = gargs.shard, hdr.nshards = gargs.nshards;
+    std::fflush(ofp);
+    write_shard_header(fn, hdr, inpaths);
+    const auto start = std::chrono::steady_clock::now();
+    for_each_row_block(hlls, arena, nheld, 0, rows.second - rows.first, result_type, ksinv, shape.first, shape.second, [&](size_t i0, size_t i1, float *const *dists) {
+        for(size_t i = i0; i < i1; ++i) write_fully(fn, dists[i - i0], sizeof(float) * (nheld - i - 1));
+    });
+    const double npairs = pairs_before_row(nsketches, rows.second) - pairs_before_row(nsketches, rows.first);
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    LOG_INFO("Shard %u/%u: rows [%zu, %zu) of %zu, %.0f pairs in %.3fs (%.4g pairs/s)\n",
+             gargs.shard, gargs.nshards, rows.first, rows.second, nsketches, npairs, secs, npairs / secs);
+}
+/*
+ * --extend-matrix: the first gargs.extend_nold inputs are those of the existing binary matrix at gargs.extend_matrix, in order,
+ * and the rest are new. Only new x old (one new input against all old ones at a time) and new x new are computed.
+ * The extended matrix is written row by row: old rows are read from the existing matrix a block at a time and followed by
+ * their new columns, then the new rows follow, so that neither matrix is held in memory.
+ * The binary layout is dm::DistanceMatrix's: the number of inputs (uint64_t), the diagonal's value (float), then the upper triangle by rows.
+ */
+template<typename SketchType>
+void extend_loop(std::FILE *ofp, SketchType *hlls, const HllArena *arena, const std::vector<std::string> &inpaths, const unsigned k, const EmissionType result_type) {
+    static constexpr size_t BLOCK_FLOATS = size_t(1) << 22; // Old entries read at a time
+    const size_t n = inpaths.size(), nold = gargs.extend_nold, nnew = n - nold;
+    const float ksinv = 1./ k;
+    std::unique_ptr<std::FILE, decltype(&std::fclose)> ifp(std::fopen(gargs.extend_matrix.data(), "rb"), &std::fclose);
+    if(!ifp) RUNTIME_ERROR(std::string("Could not open matrix at ") + gargs.extend_matrix);
+    uint64_t oldn = 0;
+    float diagonal = 0;
+    struct stat st;
+    if(::fstat(fileno(ifp.get()), &st) || std::fread(&oldn, sizeof(oldn), 1, ifp.get()) != 1 || std::fread(&diagonal, sizeof(diagonal), 1, ifp.get()) != 1
+       || oldn != nold || uint64_t(st.st_size) != sizeof(oldn) + sizeof(diagonal) + sizeof(float) * pairs_before_row(nold, nold))
+        RUNTIME_ERROR(ks::sprintf("%s is not an (uncompressed) binary matrix of the %zu inputs its labels list", gargs.extend_matrix.data(), nold).data());
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<float> cross(nnew * nold); // cross[(j - nold) * nold + i]: old i against new j
+    for(size_t j = nold; j < n; ++j) fill_query_row(hlls, nold, j, result_type, ksinv, cross.data() + (j - nold) * nold, arena);
+    std::vector<float> newrows(nnew * (nnew - (nnew > 0)) / 2); // Upper triangle of new x new, row by row
+    std::vector<float *> newrowps(nnew);
+    for(size_t i = nold, off = 0; i < n; off += n - i - 1, ++i) newrowps[i - nold] = newrows.data() + off;
+    const auto shape = tile_shape(nnew);
+    for_each_row_block(hlls, arena, n, nold, n, result_type, ksinv, shape.first, shape.second, [&](size_t i0, size_t i1, float *const *rows) {
+        for(size_t i = i0; i < i1; ++i) std::copy(rows[i - i0], rows[i - i0] + (n - i - 1), newrowps[i - nold]);
+    });
+    const double npairs = double(nnew) * nold + nnew * (nnew - 1) / 2.;
+    LOG_INFO("Extended a %zu-input matrix by %zu inputs: compared %.0f pairs in %.3fs\n", nold, nnew, npairs,
+             std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    const int fn = fileno(ofp);
+    const uint64_t newn = n;
+    std::fflush(ofp);
+    write_fully(fn, &newn, sizeof(newn));
+    write_fully(fn, &diagonal, sizeof(diagonal));
+    std::vector<float> in, out;
+    for(size_t i0 = 0, i1; i0 < nold; i0 = i1) {
+        size_t nin = 0; // Old entries in rows [i0, i1)
+        for(i1 = i0; i1 < nold && (i1 == i0 || nin + (nold - i1 - 1) <= BLOCK_FLOATS); nin += nold - i1 - 1, ++i1);
+        in.resize(nin);
+        out.resize(nin + (i1 - i0) * nnew);
+        if(std::fread(in.data(), sizeof(float), nin, ifp.get()) != nin) RUNTIME_ERROR(std::string("Truncated matrix at ") + gargs.extend_matrix);
+        const float *p = in.data();
+        float *o = out.data();
+        for(size_t i = i0; i < i1; ++i) { // Row i: its old entries, then old i against every new input
+            o = std::copy(p, p + (nold - i - 1), o), p += nold - i - 1;
+            for(size_t j = 0; j < nnew; ++j) *o++ = cross[j * nold + i];
+        }
+        write_fully(fn, out.data(), sizeof(float) * out.size());
+    }
+    write_fully(fn, newrows.data(), sizeof(float) * newrows.size());
+}
 #define DECSKETCHCORE(DS) template void sketch_core<DS>(uint32_t ssarg, uint32_t nthreads,\
                                 uint32_t wsz, uint32_t k, const Spacer &sp,\
                                 const std::vector<std::string> &inpaths,\
@@ -0,0 +1,114 @@
+#include "sketch_and_cmp.h"
+namespace bns {
+
+namespace {
+
+/*
+ * One sketch type of a multi-type run. Each thread fills its own sketch, which is written and cleared after every input,
+ * as in sketch_core. K-mers arrive in buffers of up to BATCH_INSERT_SIZE, so the virtual call is paid once per buffer.
+ */
+struct MultiSketchMember {
+    virtual ~MultiSketchMember() {}
+    virtual CachedSketch find(const std::string &path, bool canon, const CountingSketch *filter, uint32_t mincount, bool check) const = 0;
+    virtual void add(unsigned tid, const uint64_t *vals, size_t n) = 0;
+    virtual void write(unsigned tid, const std::string &fname) = 0;
+};
+
+template<typename SketchType>
+class TypedMember: public MultiSketchMember {
+    std::vector<SketchType> sketches_;
+    const uint32_t sketch_size_, wsz_;
+    const Spacer &sp_;
+    const std::string &spacing_, &suffix_, &prefix_;
+    const EncodingType enct_;
+public:
+    TypedMember(uint32_t ssarg, unsigned nthreads, EstimationMethod estim, JointEstimationMethod jestim, uint32_t wsz, const Spacer &sp,
+                const std::string &spacing, const std::string &suffix, const std::string &prefix, EncodingType enct):
+        sketch_size_(bytesl2_to_arg(ssarg, SketchEnum<SketchType>::value)), wsz_(wsz), sp_(sp), spacing_(spacing), suffix_(suffix), prefix_(prefix), enct_(enct)
+    {
+        while(sketches_.size() < nthreads) sketches_.push_back(construct<SketchType>(sketch_size_)), set_estim_and_jestim(sketches_.back(), estim, jestim);
+    }
+    CachedSketch find(const std::string &path, bool canon, const CountingSketch *filter, uint32_t mincount, bool check) const override {
+        return find_cached<SketchType>(path, sketch_size_, wsz_, sp_.k_, sp_.c_, spacing_, suffix_, prefix_, enct_, canon, filter, mincount, check);
+    }
+    void add(unsigned tid, const uint64_t *vals, size_t n) override {
+        if(enct_ == NTHASH) BatchInsert<SketchType, true>::apply(sketches_[tid], vals, n);
+        else                BatchInsert<SketchType, false>::apply(sketches_[tid], vals, n);
+    }
+    void write(unsigned tid, const std::string &fname) override {
+        auto &h = sketches_[tid];
+        sketch_finalize(h);
+        h.write(fname.data());
+        h.clear();
+    }
+};
+
+std::unique_ptr<MultiSketchMember> make_member(Sketch type, uint32_t ssarg, unsigned nthreads, EstimationMethod estim, JointEstimationMethod jestim, uint32_t wsz, const Spacer &sp,
+                                               const std::string &spacing, const std::string &suffix, const std::string &prefix, EncodingType enct)
+{
+#define MAKE_MEMBER(type) std::unique_ptr<MultiSketchMember>(new TypedMember<type>(ssarg, nthreads, estim, jestim, wsz, sp, spacing, suffix, prefix, enct))
+    switch(type) {
+        case HLL: return MAKE_MEMBER(hll::hll_t);
+        case BLOOM_FILTER: return MAKE_MEMBER(bf::bf_t);
+        case RANGE_MINHASH: return MAKE_MEMBER(mh::RangeMinHash<uint64_t>);
+        case COUNTING_RANGE_MINHASH: return MAKE_MEMBER(mh::CountingRangeMinHash<uint64_t>);
+        case BB_MINHASH: return MAKE_MEMBER(mh::BBitMinHasher<uint64_t>);
+        case BB_SUPERMINHASH: return MAKE_MEMBER(SuperMinHashType);
+        case FULL_KHASH_SET: return MAKE_MEMBER(khset64_t);
+        default: RUNTIME_ERROR(std::string("Sketch ") + sketch_names[type] + " not yet supported.");
+    }
+#undef MAKE_MEMBER
+    return nullptr;
+}
+
+} // anonymous namespace
+
+/*
+ * Like sketch_core, but every k-mer parsed and encoded from an input is handed to each requested sketch type,
+ * so that I/O, decompression, parsing and encoding are paid once rather than once per type.
+ * Count-min filtering (if any) is likewise applied once, before k-mers are buffered.
+ */
+void multi_sketch_core(const std::vector<SketchSpec> &specs, uint32_t nthreads, uint32_t wsz, uint32_t k, const Spacer &sp, const std::vector<std::string> &inpaths, const std::string &suffix, const std::string &prefix, std::vector<CountingSketch> &cms, EstimationMethod estim, JointEstimationMethod jestim, KSeqBufferHolder &kseqs, const std::vector<bool> &use_filter, const std::string &spacing, bool skip_cached, bool canon, uint32_t mincount, EncodingType enct) {
+    if(gargs.demux) RUNTIME_ERROR("Demultiplexing is not supported with several sketch types.");
+    if(gargs.split_files || gargs.io_threads)
+        LOG_WARNING("Not splitting files across threads: not supported with several sketch types.\n");
+    std::vector<std::unique_ptr<MultiSketchMember>> members;
+    for(const auto &spec: specs) members.push_back(make_member(spec.first, spec.second, nthreads, estim, jestim, wsz, sp, spacing, suffix, prefix, enct));
+    const KmerKernel kernel = make_kmer_kernel(sp, canon, enct);
+    const std::vector<size_t> work = detail::estimate_work(inpaths);
+    ScheduleReport report(nthreads);
+    for_each_scheduled(work, std::vector<bool>(inpaths.size()), report, [&](size_t i, bool) {
+        const int tid = omp_get_thread_num();
+        std::vector<std::pair<MultiSketchMember *, CachedSketch>> todo;
+        for(const auto &m: members) {
+            CachedSketch cached = m->find(inpaths[i], canon, use_filter.size() && use_filter[i] ? &cms.front(): nullptr, mincount, skip_cached);
+            LOG_DEBUG("fname: %s from %s\n", cached.path.data(), inpaths[i].data());
+            if(!skip_cached || !cached.found) todo.emplace_back(m.get(), std::move(cached));
+        }
+        if(todo.empty()) return;
+        Encoder<bns::score::Lex> enc(nullptr, 0, sp, nullptr, canon);
+        RollingHasher<uint64_t> rolling_hasher(k, canon);
+        uint64_t buf[BATCH_INSERT_SIZE];
+        unsigned n = 0;
+        const auto flush = [&]() {
+            for(const auto &t: todo) t.first->add(tid, buf, n);
+            n = 0;
+        };
+        const auto add = [&](u64 kmer) {
+            buf[n++] = kmer;
+            if(n == BATCH_INSERT_SIZE) flush();
+        };
+        if(use_filter.size() && use_filter[i]) {
+            auto &cm = cms[tid];
+            for_each_substr([&](const char *s) {for_each_kmer(enc, rolling_hasher, kernel, enct, s, &kseqs[tid], [&](u64 kmer){if(cm.addh(kmer) >= mincount) add(kmer);});}, inpaths[i], FNAME_SEP);
+            cm.clear();
+        } else {
+            for_each_substr([&](const char *s) {for_each_kmer(enc, rolling_hasher, kernel, enct, s, &kseqs[tid], add);}, inpaths[i], FNAME_SEP);
+        }
+        flush();
+        for(const auto &t: todo) t.first->write(tid, t.second.write_path()), t.second.insert(inpaths[i]);
+    });
+    report.report("Sketching");
+}
+
+} // namespace bns
@@ -0,0 +1,133 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <omp.h>
+
+namespace bns {
+
+/*
+ * Sorting and merging of arrays of 64-bit keys (full k-mer hash sets), using every OpenMP thread available.
+ * Called from inside a parallel region (e.g., when finalizing many sketches at once), these run on the calling thread alone.
+ */
+
+static constexpr size_t RADIX_SORT_MIN = size_t(1) << 16; // Below this, std::sort is as fast
+
+/*
+ * Parallel LSD radix sort, one byte per pass. Each thread counts the digits of its own slice of the input,
+ * then scatters that slice to the offsets it owns. Passes on bytes which are the same in every key are skipped.
+ */
+inline void radix_sort(uint64_t *data, size_t n) {
+    if(n < RADIX_SORT_MIN) {
+        std::sort(data, data + n);
+        return;
+    }
+    uint64_t ormask = 0, andmask = UINT64_MAX;
+    #pragma omp parallel for reduction(|:ormask) reduction(&:andmask)
+    for(size_t i = 0; i < n; ++i) ormask |= data[i], andmask &= data[i];
+    const uint64_t varying = ormask ^ andmask;
+    unsigned npasses = 0;
+    for(unsigned shift = 0; shift < 64; shift += 8) npasses += ((varying >> shift) & 0xFF) != 0;
+    if(npasses == 0) return;
+    std::unique_ptr<uint64_t[]> buf(new uint64_t[n]);
+    std::vector<std::array<size_t, 256>> counts;
+    #pragma omp parallel
+    {
+        const size_t nt = omp_get_num_threads(), t = omp_get_thread_num();
+        #pragma omp single
+        counts.resize(nt);
+        const size_t lo = n * t / nt, hi = n * (t + 1) / nt;
+        uint64_t *src = data, *dst = buf.get();
+        for(unsigned shift = 0; shift < 64; shift += 8) {
+            if(((varying >> shift) & 0xFF) == 0) continue;
+            auto &c = counts[t];
+            c.fill(0);
+            for(size_t i = lo; i < hi; ++i) ++c[(src[i] >> shift) & 0xFF];
+            #pragma omp barrier
+            size_t offsets[256], sum = 0;
+            for(unsigned d = 0; d < 256; ++d)
+                for(size_t u = 0; u < nt; ++u) {
+                    if(u == t) offsets[d] = sum;
+                    sum += counts[u][d];
+                }
+            for(size_t i = lo; i < hi; ++i) {
+                const uint64_t v = src[i];
+                dst[offsets[(v >> shift) & 0xFF]++] = v;
+            }
+            #pragma omp barrier
+            std::swap(src, dst);
+        }
+        if(npasses & 1) std::memcpy(data + lo, buf.get() + lo, (hi - lo) * sizeof(uint64_t));
+    }
+}
+
+/*
+ * Union of k sorted, duplicate-free key arrays, as consecutive sorted parts (every key of a part is below every key of the next).
+ * Splitters are weighted quantiles of keys sampled from every input, so parts hold about the same number of keys;
+ * each part is merged independently through a k-way heap in O(keys * log k).
+ */
+inline std::vector<std::vector<uint64_t>> union_sorted_parts(const std::vector<std::pair<const uint64_t *, size_t>> &sets) {
+    size_t total = 0;
+    for(const auto &s: sets) total += s.second;
+    const size_t nparts = total < RADIX_SORT_MIN ? 1: size_t(omp_get_max_threads()) * 4;
+    std::vector<uint64_t> splitters; // Part p holds keys in [splitters[p - 1], splitters[p])
+    if(nparts > 1) {
+        static constexpr size_t SAMPLES_PER_SET = 1024;
+        std::vector<std::pair<uint64_t, double>> samples;
+        for(const auto &s: sets) {
+            const size_t ns = std::min(s.second, SAMPLES_PER_SET);
+            for(size_t i = 0; i < ns; ++i) samples.emplace_back(s.first[s.second * i / ns], double(s.second) / ns);
+        }
+        std::sort(samples.begin(), samples.end());
+        double cum = 0.;
+        for(const auto &sample: samples) {
+            cum += sample.second;
+            if(cum >= double(total) * (splitters.size() + 1) / nparts && (splitters.empty() || sample.first > splitters.back()))
+                splitters.push_back(sample.first);
+            if(splitters.size() + 1 == nparts) break;
+        }
+    }
+    std::vector<std::vector<uint64_t>> parts(splitters.size() + 1);
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t p = 0; p < parts.size(); ++p) {
+        using Cursor = std::pair<const uint64_t *, const uint64_t *>; // Next key, end of this set's range
+        std::vector<Cursor> cursors;
+        size_t bound = 0;
+        for(const auto &s: sets) {
+            const uint64_t *const end = s.first + s.second;
+            const uint64_t *b = p ? std::lower_bound(s.first, end, splitters[p - 1]): s.first;
+            const uint64_t *e = p < splitters.size() ? std::lower_bound(b, end, splitters[p]): end;
+            if(b != e) cursors.emplace_back(b, e), bound = std::max(bound, size_t(e - b));
+        }
+        auto &out = parts[p];
+        out.reserve(bound);
+        const auto later = [](const Cursor &a, const Cursor &b) {return *a.first > *b.first;};
+        std::make_heap(cursors.begin(), cursors.end(), later);
+        while(!cursors.empty()) {
+            std::pop_heap(cursors.begin(), cursors.end(), later);
+            Cursor &c = cursors.back();
+            const uint64_t v = *c.first++;
+            if(out.empty() || out.back() != v) out.push_back(v);
+            if(c.first == c.second) cursors.pop_back();
+            else                    std::push_heap(cursors.begin(), cursors.end(), later);
+        }
+    }
+    return parts;
+}
+
+inline std::vector<uint64_t> union_sorted(const std::vector<std::pair<const uint64_t *, size_t>> &sets) {
+    auto parts = union_sorted_parts(sets);
+    std::vector<size_t> offsets(parts.size() + 1);
+    for(size_t p = 0; p < parts.size(); ++p) offsets[p + 1] = offsets[p] + parts[p].size();
+    std::vector<uint64_t> ret(offsets.back());
+    #pragma omp parallel for
+    for(size_t p = 0; p < parts.size(); ++p)
+        std::copy(parts[p].begin(), parts[p].end(), ret.begin() + offsets[p]), std::vector<uint64_t>().swap(parts[p]);
+    return ret;
+}
+
+} // namespace bns
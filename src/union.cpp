@@ -9,10 +9,8 @@ template<typename T>
 void union_core(std::vector<std::string> &paths, gzFile ofp) {
     T ret(paths.back().data());
     paths.pop_back();
-    if(paths.size() == 1) {
-        merge(ret, T(paths.back().data()));
-        paths.pop_back();
-        assert(paths.empty());
+    if(paths.empty()) {
+        ret.write(ofp);
         return;
     }
     T tmp(paths.back().data());
@@ -25,6 +23,22 @@ void union_core(std::vector<std::string> &paths, gzFile ofp) {
     }
     ret.write(ofp);
 }
+// Full hash sets are unioned all at once by a k-way merge, rather than one at a time, and written without building a khash set.
+template<>
+void union_core<khset64_t>(std::vector<std::string> &paths, gzFile ofp) {
+    std::vector<khset64_t> sets(paths.size());
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t i = 0; i < paths.size(); ++i) sets[i].read(paths[i]), sets[i].decompress();
+    std::vector<std::pair<const uint64_t *, size_t>> spans;
+    for(const auto &s: sets) spans.emplace_back(reinterpret_cast<const uint64_t *>(s.keys), s.n_occupied);
+    auto parts = union_sorted_parts(spans);
+    uint64_t nelem = 0;
+    for(const auto &part: parts) nelem += part.size();
+    LOG_INFO("Union of %zu sets holds %zu keys\n", paths.size(), size_t(nelem));
+    CompactSetWriter writer(ofp);
+    for(auto &part: parts) writer.add(part.data(), part.size()), std::vector<uint64_t>().swap(part);
+    writer.finish();
+}
 int union_main(int argc, char *argv[]) {
     if(std::find_if(argv, argc + argv,
                     [](const char *s) {return std::strcmp(s, "--help") == 0 || std::strcmp(s, "-h") == 0;})
@@ -35,7 +49,7 @@ int union_main(int argc, char *argv[]) {
     const char *opath = "/dev/stdout";
     std::vector<std::string> paths;
     Sketch sketch_type = HLL;
-    for(int c;(c = getopt(argc, argv, "b:o:F:zZ:h?")) >= 0;) {
+    for(int c;(c = getopt(argc, argv, "bo:F:zZ:rHh?")) >= 0;) {
         switch(c) {
             case 'h': union_usage(*argv);
             case 'Z': compression_level = std::atoi(optarg); [[fallthrough]];